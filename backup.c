@@ -0,0 +1,313 @@
+#include "backup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "constants.h"
+
+#define BACKUP_MAGIC "KVSBCK\0\0"
+#define BACKUP_HEADER_SIZE 64
+#define BACKUP_IOV_BATCH 1020  // iovecs per writev, below IOV_MAX
+
+_Static_assert(MAX_STRING_SIZE <= BACKUP_DELETED, "key and value lengths are stored in one byte");
+
+// Pieces of the file queued for one writev. The pieces point straight into
+// the snapshot, only the binary record headers are stored here.
+typedef struct IovBatch {
+    int fd;
+    struct iovec iov[BACKUP_IOV_BATCH];
+    int count;
+    unsigned char lens[BACKUP_IOV_BATCH / 2][2];  // A record takes 2 or 3 iovecs
+    size_t num_lens;
+    uint64_t offset;    // File offset after the queued pieces
+    uint64_t checksum;  // Of the queued record bytes, binary format only
+    int failed;
+} IovBatch;
+
+static uint64_t checksum_update(uint64_t h, const void *data, size_t len) {
+    for (const unsigned char *p = data; len > 0; p++, len--) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t backup_checksum(const void *data, size_t len) {
+    return checksum_update(14695981039346656037ULL, data, len);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static void flush_batch(IovBatch *batch) {
+    struct iovec *iov = batch->iov;
+    int count = batch->count;
+    while (count > 0 && !batch->failed) {
+        ssize_t written = writev(batch->fd, iov, count);
+        if (written < 0) {
+            if (errno != EINTR) batch->failed = 1;
+            continue;
+        }
+        // Skip what was written, a short write can stop in the middle of a piece
+        size_t left = (size_t)written;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    batch->count = 0;
+    batch->num_lens = 0;
+}
+
+static void queue(IovBatch *batch, const void *data, size_t len) {
+    if (batch->count == BACKUP_IOV_BATCH) flush_batch(batch);
+    batch->iov[batch->count].iov_base = (void *)data;
+    batch->iov[batch->count].iov_len = len;
+    batch->count++;
+    batch->offset += len;
+}
+
+static void queue_text_pair(const char *key, const char *value, void *arg) {
+    IovBatch *batch = arg;
+    if (batch->count + 5 > BACKUP_IOV_BATCH) flush_batch(batch);
+    queue(batch, "(", 1);
+    queue(batch, key, strlen(key));
+    if (value != NULL) {
+        queue(batch, ", ", 2);
+        queue(batch, value, strlen(value));
+    }
+    queue(batch, ")\n", 2);
+}
+
+int backup_write_text(int fd, Snapshot *snap) {
+    IovBatch *batch = calloc(1, sizeof(IovBatch));
+    if (batch == NULL) return 1;
+    batch->fd = fd;
+    snapshot_for_each(snap, queue_text_pair, batch);
+    flush_batch(batch);
+    int failed = batch->failed;
+    free(batch);
+    return failed;
+}
+
+typedef struct IndexEntry {
+    const char *key;
+    uint64_t offset;
+} IndexEntry;
+
+typedef struct BinaryWriter {
+    IovBatch batch;
+    IndexEntry *index;
+    size_t num_pairs;
+    size_t capacity;
+    int failed;
+} BinaryWriter;
+
+static void queue_binary_pair(const char *key, const char *value, void *arg) {
+    BinaryWriter *writer = arg;
+    IovBatch *batch = &writer->batch;
+    if (writer->num_pairs == writer->capacity) {
+        size_t capacity = writer->capacity * 2 + 1024;
+        IndexEntry *index = realloc(writer->index, capacity * sizeof(IndexEntry));
+        if (index == NULL) {
+            writer->failed = 1;
+            return;
+        }
+        writer->index = index;
+        writer->capacity = capacity;
+    }
+    writer->index[writer->num_pairs].key = key;
+    writer->index[writer->num_pairs].offset = batch->offset;
+    writer->num_pairs++;
+
+    if (batch->count + 3 > BACKUP_IOV_BATCH) flush_batch(batch);
+    size_t key_len = strlen(key);
+    size_t value_len = value != NULL ? strlen(value) : 0;
+    unsigned char *lens = batch->lens[batch->num_lens++];
+    lens[0] = (unsigned char)key_len;
+    lens[1] = value != NULL ? (unsigned char)value_len : BACKUP_DELETED;
+    batch->checksum = checksum_update(batch->checksum, lens, 2);
+    batch->checksum = checksum_update(batch->checksum, key, key_len);
+    batch->checksum = checksum_update(batch->checksum, value, value_len);
+    queue(batch, lens, 2);
+    queue(batch, key, key_len);
+    if (value != NULL) queue(batch, value, value_len);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const IndexEntry *)a)->key, ((const IndexEntry *)b)->key);
+}
+
+int backup_write_binary(int fd, Snapshot *snap) {
+    BinaryWriter *writer = calloc(1, sizeof(BinaryWriter));
+    if (writer == NULL) return 1;
+    writer->batch.fd = fd;
+    writer->batch.offset = BACKUP_HEADER_SIZE;
+    writer->batch.checksum = backup_checksum(NULL, 0);
+
+    // The header needs the totals, it is written last
+    int failed = lseek(fd, BACKUP_HEADER_SIZE, SEEK_SET) < 0;
+    if (!failed) {
+        snapshot_for_each(snap, queue_binary_pair, writer);
+        flush_batch(&writer->batch);
+        failed = writer->failed || writer->batch.failed;
+    }
+
+    unsigned char *offsets = NULL;
+    uint64_t data_size = writer->batch.offset - BACKUP_HEADER_SIZE;
+    uint64_t index_offset = writer->batch.offset;
+    if (!failed) {
+        if (writer->num_pairs > 0) qsort(writer->index, writer->num_pairs, sizeof(IndexEntry), compare_entries);
+        offsets = malloc((writer->num_pairs + 1) * 8);
+        failed = offsets == NULL;
+    }
+    if (!failed) {
+        for (size_t i = 0; i < writer->num_pairs; i++) {
+            put_u64(offsets + i * 8, writer->index[i].offset);
+        }
+        put_u64(offsets + writer->num_pairs * 8, backup_checksum(offsets, writer->num_pairs * 8));
+        queue(&writer->batch, offsets, (writer->num_pairs + 1) * 8);
+        flush_batch(&writer->batch);
+        failed = writer->batch.failed;
+    }
+
+    if (!failed) {
+        unsigned char header[BACKUP_HEADER_SIZE];
+        memcpy(header, BACKUP_MAGIC, 8);
+        put_u32(header + 8, BACKUP_VERSION);
+        put_u32(header + 12, BACKUP_HAS_INDEX | (snapshot_is_delta(snap) ? BACKUP_IS_DELTA : 0));
+        put_u64(header + 16, writer->num_pairs);
+        put_u64(header + 24, data_size);
+        put_u64(header + 32, writer->batch.checksum);
+        put_u64(header + 40, index_offset);
+        put_u64(header + 48, snapshot_log_position(snap));
+        put_u64(header + 56, backup_checksum(header, 56));
+        failed = pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header);
+    }
+
+    free(offsets);
+    free(writer->index);
+    free(writer);
+    return failed;
+}
+
+// Checks the header, the checksums and every record of a mapped backup.
+// @return Number of pairs in the file, -1 if it is corrupt.
+static long check_backup(const unsigned char *map, size_t size) {
+    if (size < BACKUP_HEADER_SIZE || memcmp(map, BACKUP_MAGIC, 8) != 0) return -1;
+    if (get_u64(map + 56) != backup_checksum(map, 56) || get_u32(map + 8) != BACKUP_VERSION) return -1;
+
+    uint32_t flags = get_u32(map + 12);
+    uint64_t num_pairs = get_u64(map + 16);
+    uint64_t data_size = get_u64(map + 24);
+    if (data_size > size - BACKUP_HEADER_SIZE || num_pairs > data_size / 2) return -1;
+    const unsigned char *data = map + BACKUP_HEADER_SIZE;
+    if (get_u64(map + 32) != backup_checksum(data, data_size)) return -1;
+
+    if (flags & BACKUP_HAS_INDEX) {
+        uint64_t index_offset = get_u64(map + 40);
+        if (index_offset > size || (size - index_offset) / 8 < num_pairs + 1) return -1;
+        const unsigned char *index = map + index_offset;
+        if (get_u64(index + num_pairs * 8) != backup_checksum(index, num_pairs * 8)) return -1;
+    }
+
+    uint64_t count = 0;
+    for (size_t pos = 0; pos < data_size; count++) {
+        if (data_size - pos < 2) return -1;
+        size_t key_len = data[pos];
+        size_t value_len = data[pos + 1];
+        if (value_len == BACKUP_DELETED && (flags & BACKUP_IS_DELTA)) value_len = 0;
+        if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE) return -1;
+        if (data_size - pos - 2 < key_len + value_len) return -1;
+        if (memchr(data + pos + 2, '\0', key_len + value_len) != NULL) return -1;
+        pos += 2 + key_len + value_len;
+    }
+    return count == num_pairs ? (long)count : -1;
+}
+
+long backup_restore(HashTable *ht, const char *path, uint64_t *log_position) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < BACKUP_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    long num_pairs = check_backup(map, size);
+    if (num_pairs >= 0) *log_position = get_u64((const unsigned char *)map + 48);
+    if (num_pairs > 0) {
+        // Bulk insert, MAX_WRITE_SIZE pairs per batch like a WRITE command.
+        // A key appears once in a file, so writes and deletes can be batched apart.
+        char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+        char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+        char deleted[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+        char results[MAX_WRITE_SIZE];
+        int write_failed = 0;
+        const unsigned char *data = (const unsigned char *)map + BACKUP_HEADER_SIZE;
+        size_t pos = 0;
+        size_t pending = 0;
+        size_t pending_deletes = 0;
+        for (long i = 0; i < num_pairs; i++) {
+            size_t key_len = data[pos];
+            size_t value_len = data[pos + 1];
+            if (value_len == BACKUP_DELETED) {
+                memcpy(deleted[pending_deletes], data + pos + 2, key_len);
+                deleted[pending_deletes++][key_len] = '\0';
+                pos += 2 + key_len;
+            } else {
+                memcpy(keys[pending], data + pos + 2, key_len);
+                keys[pending][key_len] = '\0';
+                memcpy(values[pending], data + pos + 2 + key_len, value_len);
+                values[pending++][value_len] = '\0';
+                pos += 2 + key_len + value_len;
+            }
+            if (pending == MAX_WRITE_SIZE || (i == num_pairs - 1 && pending > 0)) {
+                write_failed |= write_pairs(ht, pending, keys, values, results);
+                pending = 0;
+            }
+            if (pending_deletes == MAX_WRITE_SIZE || (i == num_pairs - 1 && pending_deletes > 0)) {
+                delete_pairs(ht, pending_deletes, deleted, results);
+                pending_deletes = 0;
+            }
+        }
+        if (write_failed) num_pairs = -1;
+    }
+
+    munmap(map, size);
+    return num_pairs;
+}
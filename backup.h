@@ -0,0 +1,60 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+// Backup files. The text format is one "(key, value)" line per pair, the
+// same as SHOW; a delta also has a "(key)" line per deleted key. The binary
+// format is meant to be loaded back with backup_restore; all integers are
+// little-endian:
+//
+//   header   magic "KVSBCK\0\0", u32 version, u32 flags, u64 num_pairs,
+//            u64 data_size, u64 data_checksum, u64 index_offset,
+//            u64 log_position, u64 header_checksum (of the bytes before it)
+//   data     num_pairs records: u8 key_len, u8 value_len, key, value;
+//            in a delta, a deleted key has value_len BACKUP_DELETED and
+//            no value
+//   index    if BACKUP_HAS_INDEX: num_pairs u64 file offsets of the
+//            records sorted by key, then u64 checksum of the offsets
+//
+// Checksums are 64-bit FNV-1a. log_position is the change log position of
+// the snapshot (see snapshot_log_position), so a write-ahead log can be
+// replayed from there after a restore. A delta (BACKUP_IS_DELTA) only has
+// the keys changed since the previous backup and is restored on top of it.
+
+#define BACKUP_VERSION 2
+#define BACKUP_HAS_INDEX 0x1
+#define BACKUP_IS_DELTA 0x2
+#define BACKUP_DELETED 0xFF  // value_len of a deleted key
+
+/// Writes a snapshot as text, one "(key, value)" line per pair and, for a
+/// delta, one "(key)" line per deleted key.
+/// @param fd File descriptor to write to.
+/// @param snap Snapshot completed by snapshot_capture.
+/// @return 0 on success, 1 if a write failed.
+int backup_write_text(int fd, Snapshot *snap);
+
+/// Writes a snapshot in the binary format, with an index.
+/// @param fd File descriptor of a new file, open for writing at offset 0.
+/// @param snap Snapshot completed by snapshot_capture.
+/// @return 0 on success, 1 if a write failed.
+int backup_write_binary(int fd, Snapshot *snap);
+
+/// Computes the checksum used by the binary format.
+/// @param data Bytes to checksum.
+/// @param len Number of bytes.
+/// @return 64-bit FNV-1a of the bytes.
+uint64_t backup_checksum(const void *data, size_t len);
+
+/// Loads a binary backup into the table. The file is mapped and checked
+/// before any pair is written. A delta is applied on top of what the table
+/// has, so the backups of a chain are restored in order.
+/// @param ht Hash table to write the pairs to.
+/// @param path Path of the binary backup file.
+/// @param log_position Set to the change log position of the backup.
+/// @return Number of pairs restored or deleted, -1 if the file could not be read or is corrupt.
+long backup_restore(HashTable *ht, const char *path, uint64_t *log_position);
+
+#endif  // KVS_BACKUP_H
@@ -0,0 +1,89 @@
+// Single-threaded benchmark of the storage engine linked with kvs.o.
+// Fills the table with num_keys keys and times three workloads:
+//   hit    - reads of keys that are in the table
+//   miss   - reads of keys that are not in the table
+//   update - writes that replace the value of existing keys
+// and prints the peak resident set size of the process at the end.
+//
+// Usage: engine_bench [num_keys [ops]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../constants.h"
+#include "../kvs.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *workload, unsigned long ops, double seconds) {
+    printf("%s\t%.1f\t%.0f\n", workload, seconds * 1e9 / (double)ops, (double)ops / seconds);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int num_keys = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 100000;
+    unsigned long ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    if (num_keys == 0 || ops == 0) {
+        fprintf(stderr, "Usage: %s [num_keys [ops]]\n", argv[0]);
+        return 1;
+    }
+
+    HashTable *ht = create_hash_table();
+    if (ht == NULL) {
+        fprintf(stderr, "Failed to create hash table\n");
+        return 1;
+    }
+
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    double start = now_seconds();
+    for (unsigned int k = 0; k < num_keys; k++) {
+        snprintf(key, sizeof(key), "key%u", k);
+        snprintf(value, sizeof(value), "value%u", k);
+        write_pair(ht, key, value);
+    }
+
+    printf("# %u keys, %lu ops per workload\n", num_keys, ops);
+    printf("workload\tns/op\tops/sec\n");
+    report("insert", num_keys, now_seconds() - start);
+
+    unsigned long found = 0;
+    start = now_seconds();
+    for (unsigned long i = 0; i < ops; i++) {
+        snprintf(key, sizeof(key), "key%lu", (i * 7919) % num_keys);
+        found += read_pair(ht, key, value, sizeof(value)) == 0;
+    }
+    report("hit", ops, now_seconds() - start);
+
+    start = now_seconds();
+    for (unsigned long i = 0; i < ops; i++) {
+        snprintf(key, sizeof(key), "miss%lu", (i * 7919) % num_keys);
+        found += read_pair(ht, key, value, sizeof(value)) == 0;
+    }
+    report("miss", ops, now_seconds() - start);
+
+    start = now_seconds();
+    for (unsigned long i = 0; i < ops; i++) {
+        snprintf(key, sizeof(key), "key%lu", (i * 7919) % num_keys);
+        snprintf(value, sizeof(value), "new%lu", i);
+        write_pair(ht, key, value);
+    }
+    report("update", ops, now_seconds() - start);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("# peak RSS %ld KiB\n", usage.ru_maxrss);
+
+    free_table(ht);
+    if (found != ops) {
+        fprintf(stderr, "Expected %lu hits, got %lu\n", ops, found);
+        return 1;
+    }
+    return 0;
+}
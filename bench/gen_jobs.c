@@ -0,0 +1,223 @@
+// Synthetic job file generator for bench/harness.
+// Writes num_files job files to a directory. Keys are drawn from a fixed key
+// space with a Zipfian popularity (exponent 0 is uniform), and each key has
+// a fixed length drawn from a range. Commands carry 1 to max_pairs keys.
+// File sizes can be skewed the same way: file i gets a share of the commands
+// proportional to 1 / (i + 1)^file_skew.
+//
+// Usage: gen_jobs [-f files] [-c commands] [-k keys] [-l min_len:max_len]
+//                 [-m read:write:delete] [-p max_pairs] [-z key_skew]
+//                 [-s file_skew] [-b backup_every] [-r seed] directory
+//
+//   -f  number of job files (8)
+//   -c  total number of commands over all files (100000)
+//   -k  size of the key space (10000)
+//   -l  range of key lengths (4:12)
+//   -m  percentages of READ, WRITE and DELETE commands (60:30:10)
+//   -p  maximum keys per command (4)
+//   -z  Zipf exponent of key popularity, 0 for uniform (0.99)
+//   -s  Zipf exponent of file sizes, 0 for equal files (0)
+//   -b  a BACKUP every that many commands of a file, 0 for none (0)
+//   -r  random seed (1)
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../constants.h"
+
+typedef struct {
+    unsigned int files;
+    unsigned long commands;
+    unsigned int keys;
+    unsigned int min_len;
+    unsigned int max_len;
+    unsigned int read_percent;
+    unsigned int write_percent;
+    unsigned int delete_percent;
+    unsigned int max_pairs;
+    double key_skew;
+    double file_skew;
+    unsigned long backup_every;
+    unsigned long long seed;
+} gen_config_t;
+
+static unsigned long long random_state;
+
+// splitmix64, so the same seed gives the same files everywhere
+static unsigned long long next_random(void) {
+    unsigned long long z = (random_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static double next_uniform(void) {
+    return (double)(next_random() >> 11) / 9007199254740992.0;  // [0, 1)
+}
+
+// Cumulative distribution of a Zipf law over n items.
+static double *zipf_cdf(unsigned int n, double exponent) {
+    double *cdf = malloc(n * sizeof(double));
+    if (cdf == NULL) return NULL;
+    double sum = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)i + 1, exponent);
+        cdf[i] = sum;
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+static unsigned int zipf_sample(const double *cdf, unsigned int n) {
+    double u = next_uniform();
+    unsigned int low = 0, high = n - 1;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Key of an id: "k", the id and 'x' padding up to the length of the key.
+// The length only depends on the id, so a key is always written the same.
+static void make_key(char *key, unsigned int id, const gen_config_t *config) {
+    unsigned long long h = (id + 1) * 0x9E3779B97F4A7C15ULL;
+    unsigned int len = config->min_len + (unsigned int)((h >> 32) % (config->max_len - config->min_len + 1));
+    int n = snprintf(key, MAX_STRING_SIZE, "k%u", id);
+    while ((unsigned int)n < len) key[n++] = 'x';
+    key[n] = '\0';
+}
+
+static int parse_range(const char *arg, unsigned int *values, int count) {
+    char *end;
+    for (int i = 0; i < count; i++) {
+        values[i] = (unsigned int)strtoul(arg, &end, 10);
+        if (end == arg || (i < count - 1 && *end != ':') || (i == count - 1 && *end != '\0')) return 1;
+        arg = end + 1;
+    }
+    return 0;
+}
+
+static int write_file(const char *path, unsigned long commands, const double *key_cdf, const gen_config_t *config) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to create job file");
+        return 1;
+    }
+
+    char key[MAX_STRING_SIZE];
+    for (unsigned long c = 0; c < commands; c++) {
+        if (config->backup_every > 0 && c > 0 && c % config->backup_every == 0) {
+            fprintf(file, "BACKUP\n");
+        }
+        unsigned int op = (unsigned int)(next_random() % 100);
+        unsigned int pairs = 1 + (unsigned int)(next_random() % config->max_pairs);
+        if (op < config->write_percent) {
+            fprintf(file, "WRITE [");
+            for (unsigned int i = 0; i < pairs; i++) {
+                make_key(key, zipf_sample(key_cdf, config->keys), config);
+                fprintf(file, "(%s,v%llu)", key, next_random() % 1000000);
+            }
+        } else {
+            fprintf(file, op < config->write_percent + config->read_percent ? "READ [" : "DELETE [");
+            for (unsigned int i = 0; i < pairs; i++) {
+                make_key(key, zipf_sample(key_cdf, config->keys), config);
+                fprintf(file, "%s%s", i > 0 ? "," : "", key);
+            }
+        }
+        fprintf(file, "]\n");
+    }
+    return fclose(file) != 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-f files] [-c commands] [-k keys] [-l min_len:max_len] [-m read:write:delete]\n"
+            "          [-p max_pairs] [-z key_skew] [-s file_skew] [-b backup_every] [-r seed] directory\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    gen_config_t config = {8, 100000, 10000, 4, 12, 60, 30, 10, 4, 0.99, 0, 0, 1};
+    unsigned int range[3];
+    int opt;
+    while ((opt = getopt(argc, argv, "f:c:k:l:m:p:z:s:b:r:")) != -1) {
+        switch (opt) {
+            case 'f': config.files = (unsigned int)strtoul(optarg, NULL, 10); break;
+            case 'c': config.commands = strtoul(optarg, NULL, 10); break;
+            case 'k': config.keys = (unsigned int)strtoul(optarg, NULL, 10); break;
+            case 'l':
+                if (parse_range(optarg, range, 2)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                config.min_len = range[0];
+                config.max_len = range[1];
+                break;
+            case 'm':
+                if (parse_range(optarg, range, 3)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                config.read_percent = range[0];
+                config.write_percent = range[1];
+                config.delete_percent = range[2];
+                break;
+            case 'p': config.max_pairs = (unsigned int)strtoul(optarg, NULL, 10); break;
+            case 'z': config.key_skew = strtod(optarg, NULL); break;
+            case 's': config.file_skew = strtod(optarg, NULL); break;
+            case 'b': config.backup_every = strtoul(optarg, NULL, 10); break;
+            case 'r': config.seed = strtoull(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 1 || config.files == 0 || config.keys == 0 || config.max_pairs == 0 ||
+        config.max_pairs > MAX_WRITE_SIZE || config.min_len > config.max_len || config.max_len >= MAX_STRING_SIZE ||
+        config.read_percent + config.write_percent + config.delete_percent != 100 ||
+        config.key_skew < 0 || config.file_skew < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Every key id must fit in its key
+    char widest[MAX_STRING_SIZE];
+    if ((unsigned int)snprintf(widest, sizeof(widest), "k%u", config.keys - 1) >= MAX_STRING_SIZE) {
+        fprintf(stderr, "Too many keys for MAX_STRING_SIZE\n");
+        return 1;
+    }
+    const char *dir = argv[optind];
+    random_state = config.seed;
+
+    double *key_cdf = zipf_cdf(config.keys, config.key_skew);
+    double *file_cdf = zipf_cdf(config.files, config.file_skew);
+    if (key_cdf == NULL || file_cdf == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    int result = 0;
+    unsigned long assigned = 0;
+    for (unsigned int f = 0; f < config.files && result == 0; f++) {
+        // The last file takes what rounding left over
+        double share = file_cdf[f] - (f > 0 ? file_cdf[f - 1] : 0);
+        unsigned long commands = f + 1 == config.files ? config.commands - assigned
+                                                       : (unsigned long)(share * (double)config.commands);
+        assigned += commands;
+        char path[MAX_JOB_FILE_NAME_SIZE];
+        snprintf(path, sizeof(path), "%s/gen%03u.job", dir, f);
+        result = write_file(path, commands, key_cdf, &config);
+    }
+    free(key_cdf);
+    free(file_cdf);
+    return result;
+}
@@ -0,0 +1,316 @@
+// Benchmark harness: measures kvs on a directory of job files, such as the
+// ones written by gen_jobs.
+//   process    runs the kvs binary on the directory and reports its wall
+//              time and peak RSS
+//   inprocess  runs the same commands through operations.h in this process,
+//              one thread per job file up to max_threads like kvs, timing
+//              every command to report p50/p99 latency per command type
+// ops/sec counts the commands of the job files. With -j the report is one
+// JSON object, to be stored and compared between builds.
+//
+// Usage: harness [-j] [-t max_threads] [-k kvs_path] directory
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../constants.h"
+#include "../operations.h"
+#include "../output.h"
+#include "../parser.h"
+
+enum { LAT_WRITE, LAT_READ, LAT_DELETE, LAT_SHOW, LAT_SCAN, LAT_BACKUP, LAT_TYPES };
+static const char *const lat_names[LAT_TYPES] = {"WRITE", "READ", "DELETE", "SHOW", "SCAN", "BACKUP"};
+
+typedef struct {
+    unsigned long long *ns;
+    size_t count;
+    size_t capacity;
+} latencies_t;
+
+typedef struct {
+    char (*files)[MAX_JOB_FILE_NAME_SIZE];
+    size_t num_files;
+    atomic_size_t next;
+} file_queue_t;
+
+typedef struct {
+    file_queue_t *queue;
+    int null_fd;
+    latencies_t lat[LAT_TYPES];
+    int failed;
+} harness_thread_t;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static int record(latencies_t *lat, unsigned long long ns) {
+    if (lat->count == lat->capacity) {
+        size_t capacity = lat->capacity * 2 + 1024;
+        unsigned long long *values = realloc(lat->ns, capacity * sizeof(unsigned long long));
+        if (values == NULL) return 1;
+        lat->ns = values;
+        lat->capacity = capacity;
+    }
+    lat->ns[lat->count++] = ns;
+    return 0;
+}
+
+// Runs the commands of one job file, timing each of them.
+static void run_job(harness_thread_t *data, const char *job_file, InputBuffer *in, OutputBuffer *out) {
+    static _Thread_local char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    static _Thread_local char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    backup_chain_t chain = {NULL, 0, 0};
+    unsigned int delay;
+
+    while (1) {
+        enum Command cmd = get_next(in);
+        size_t num_pairs = 0;
+        unsigned long long start = 0;
+        int type = -1;
+        switch (cmd) {
+            case CMD_WRITE:
+                num_pairs = parse_write(in, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                start = now_ns();
+                if (num_pairs > 0 && kvs_write(num_pairs, keys, values) == 0) type = LAT_WRITE;
+                break;
+            case CMD_READ:
+                num_pairs = parse_read_delete(in, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                start = now_ns();
+                if (num_pairs > 0 && kvs_read(out, num_pairs, keys) == 0) type = LAT_READ;
+                break;
+            case CMD_DELETE:
+                num_pairs = parse_read_delete(in, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                start = now_ns();
+                if (num_pairs > 0 && kvs_delete(out, num_pairs, keys) == 0) type = LAT_DELETE;
+                break;
+            case CMD_SHOW:
+                start = now_ns();
+                kvs_show(out);
+                type = LAT_SHOW;
+                break;
+            case CMD_SCAN:
+                num_pairs = parse_read_delete(in, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                start = now_ns();
+                if ((num_pairs == 1 || num_pairs == 2) &&
+                    kvs_scan(out, keys[0], num_pairs == 2 ? keys[1] : NULL) == 0) {
+                    type = LAT_SCAN;
+                }
+                break;
+            case CMD_BACKUP:
+                output_flush(out);
+                start = now_ns();
+                if (kvs_backup(job_file, &chain, 1) == 0) type = LAT_BACKUP;
+                break;
+            case CMD_WAIT:
+                if (parse_wait(in, &delay, NULL) == 0 && delay > 0) kvs_wait(delay);
+                break;
+            case CMD_SUBSCRIBE:
+            case CMD_UNSUBSCRIBE:
+                // Without a connection there is nothing to notify
+                parse_read_delete(in, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                break;
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+                break;
+            case EOC:
+                output_flush(out);
+                return;
+        }
+        if (type >= 0 && record(&data->lat[type], now_ns() - start) != 0) data->failed = 1;
+    }
+}
+
+static void *harness_thread(void *arg) {
+    harness_thread_t *data = arg;
+    InputBuffer *in = malloc(sizeof(InputBuffer));
+    OutputBuffer *out = malloc(sizeof(OutputBuffer));
+    if (in == NULL || out == NULL) {
+        free(in);
+        free(out);
+        data->failed = 1;
+        return NULL;
+    }
+    output_init(out, data->null_fd);
+
+    size_t index;
+    while ((index = atomic_fetch_add(&data->queue->next, 1)) < data->queue->num_files) {
+        const char *job_file = data->queue->files[index];
+        int fd = open(job_file, O_RDONLY);
+        if (fd < 0) {
+            data->failed = 1;
+            continue;
+        }
+        parser_init(in, fd);
+        run_job(data, job_file, in, out);
+        close(fd);
+    }
+    free(in);
+    free(out);
+    return NULL;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned long long percentile(const latencies_t *lat, unsigned int p) {
+    if (lat->count == 0) return 0;
+    size_t index = (lat->count * p + 99) / 100;
+    return lat->ns[index > 0 ? index - 1 : 0];
+}
+
+// Runs kvs on the directory as a child process.
+// @return 0 on success, 1 if it could not be run or failed.
+static int run_process(const char *kvs_path, const char *dir, int max_threads, double *seconds, long *rss_kib) {
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%d", max_threads);
+    unsigned long long start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        execl(kvs_path, kvs_path, dir, "1", threads, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) return 1;
+    *seconds = (double)(now_ns() - start) / 1e9;
+    // kvs is the only child, so the largest child is kvs
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    *rss_kib = usage.ru_maxrss;
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int main(int argc, char *argv[]) {
+    int json = 0;
+    int max_threads = 4;
+    const char *kvs_path = "./kvs";
+    int opt;
+    while ((opt = getopt(argc, argv, "jt:k:")) != -1) {
+        switch (opt) {
+            case 'j': json = 1; break;
+            case 't': max_threads = atoi(optarg); break;
+            case 'k': kvs_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-t max_threads] [-k kvs_path] directory\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 1 || max_threads <= 0) {
+        fprintf(stderr, "Usage: %s [-j] [-t max_threads] [-k kvs_path] directory\n", argv[0]);
+        return 1;
+    }
+    const char *dir = argv[optind];
+
+    int count = count_job_files(dir);
+    file_queue_t queue = {NULL, 0, 0};
+    queue.files = malloc((size_t)(count > 0 ? count : 1) * MAX_JOB_FILE_NAME_SIZE);
+    if (count <= 0 || queue.files == NULL) {
+        fprintf(stderr, "No job files in %s\n", dir);
+        return 1;
+    }
+    queue.num_files = list_job_files(dir, queue.files);
+
+    double process_seconds = 0;
+    long process_rss = 0;
+    if (run_process(kvs_path, dir, max_threads, &process_seconds, &process_rss) != 0) {
+        fprintf(stderr, "Failed to run %s\n", kvs_path);
+        return 1;
+    }
+
+    if (kvs_init()) {
+        fprintf(stderr, "Failed to initialize KVS\n");
+        return 1;
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    int num_threads = (size_t)max_threads < queue.num_files ? max_threads : (int)queue.num_files;
+    pthread_t tids[num_threads];
+    harness_thread_t data[num_threads];
+    unsigned long long start = now_ns();
+    for (int t = 0; t < num_threads; t++) {
+        memset(&data[t], 0, sizeof(data[t]));
+        data[t].queue = &queue;
+        data[t].null_fd = null_fd;
+        if (pthread_create(&tids[t], NULL, harness_thread, &data[t]) != 0) {
+            perror("Failed to create thread");
+            return 1;
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    kvs_terminate();
+    double seconds = (double)(now_ns() - start) / 1e9;
+    close(null_fd);
+
+    // Merge the latencies of every thread per command type
+    latencies_t lat[LAT_TYPES];
+    size_t total = 0;
+    int failed = 0;
+    for (int type = 0; type < LAT_TYPES; type++) {
+        lat[type] = (latencies_t){NULL, 0, 0};
+        for (int t = 0; t < num_threads; t++) {
+            for (size_t i = 0; i < data[t].lat[type].count; i++) {
+                failed |= record(&lat[type], data[t].lat[type].ns[i]);
+            }
+            free(data[t].lat[type].ns);
+        }
+        if (lat[type].count > 0) qsort(lat[type].ns, lat[type].count, sizeof(unsigned long long), compare_ns);
+        total += lat[type].count;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        failed |= data[t].failed;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (json) {
+        printf("{\"directory\": \"%s\", \"job_files\": %zu, \"threads\": %d, \"commands\": %zu,\n", dir,
+               queue.num_files, max_threads, total);
+        printf(" \"process\": {\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"peak_rss_kib\": %ld},\n",
+               process_seconds, (double)total / process_seconds, process_rss);
+        printf(" \"inprocess\": {\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"peak_rss_kib\": %ld, \"latency_ns\": {",
+               seconds, (double)total / seconds, usage.ru_maxrss);
+        int first = 1;
+        for (int type = 0; type < LAT_TYPES; type++) {
+            if (lat[type].count == 0) continue;
+            printf("%s\n   \"%s\": {\"count\": %zu, \"p50\": %llu, \"p99\": %llu}", first ? "" : ",", lat_names[type],
+                   lat[type].count, percentile(&lat[type], 50), percentile(&lat[type], 99));
+            first = 0;
+        }
+        printf("}}}\n");
+    } else {
+        printf("# %s: %zu job files, %zu commands, %d threads\n", dir, queue.num_files, total, max_threads);
+        printf("run\tseconds\tops/sec\tpeak_rss_kib\n");
+        printf("process\t%.3f\t%.0f\t%ld\n", process_seconds, (double)total / process_seconds, process_rss);
+        printf("inprocess\t%.3f\t%.0f\t%ld\n", seconds, (double)total / seconds, usage.ru_maxrss);
+        printf("command\tcount\tp50_ns\tp99_ns\n");
+        for (int type = 0; type < LAT_TYPES; type++) {
+            if (lat[type].count == 0) continue;
+            printf("%s\t%zu\t%llu\t%llu\n", lat_names[type], lat[type].count, percentile(&lat[type], 50),
+                   percentile(&lat[type], 99));
+        }
+    }
+
+    for (int type = 0; type < LAT_TYPES; type++) {
+        free(lat[type].ns);
+    }
+    free(queue.files);
+    return failed;
+}
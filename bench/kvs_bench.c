@@ -0,0 +1,170 @@
+// Multi-threaded throughput benchmark for the hash table in kvs.c.
+// Runs the same READ/WRITE mix with 1, 2, ..., max_threads threads and
+// prints the aggregate throughput of each run.
+//
+// With -s it runs a stress test instead: every thread mixes READ, WRITE and
+// DELETE on a small set of keys, writing self-describing values, and every
+// value read is checked for tearing (a mix of two writes). The exit status
+// is non-zero if any torn value was seen. bench/stress_jobs.sh does the same
+// check through job files run by kvs.
+//
+// With -o the table keeps an ordered index (see set_ordered_index), to
+// measure what it costs the writers; run it with read_percent 0 and many
+// keys for an insert-heavy load.
+//
+// Usage: kvs_bench [-s] [-o] [max_threads [ops_per_thread [num_keys [read_percent]]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../constants.h"
+#include "../kvs.h"
+
+typedef struct {
+    HashTable *ht;
+    unsigned int seed;
+    unsigned long ops;
+    unsigned int num_keys;
+    unsigned int read_percent;
+    int stress;
+    unsigned long torn;  // Torn values seen, only counted with -s
+} bench_thread_t;
+
+static unsigned int next_random(unsigned int *state) {
+    // xorshift32, good enough to spread keys over the table
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void make_key(char *key, unsigned int n) {
+    snprintf(key, MAX_STRING_SIZE, "key%u", n);
+}
+
+// Stress values are "<key>:" followed by one letter repeated a random number
+// of times, so a value made of two different writes is easy to spot.
+static void make_stress_value(char *value, const char *key, unsigned int r) {
+    int len = snprintf(value, MAX_STRING_SIZE, "%s:", key);
+    size_t fill = 1 + (r >> 8) % (MAX_STRING_SIZE - (size_t)len - 1);
+    memset(value + len, 'a' + (int)(r % 26), fill);
+    value[(size_t)len + fill] = '\0';
+}
+
+static int is_torn(const char *value, const char *key) {
+    size_t key_len = strlen(key);
+    if (strncmp(value, key, key_len) != 0 || value[key_len] != ':' || value[key_len + 1] == '\0') return 1;
+    for (const char *p = value + key_len + 2; *p != '\0'; p++) {
+        if (*p != value[key_len + 1]) return 1;
+    }
+    return 0;
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *data = (bench_thread_t *)arg;
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    unsigned int state = data->seed;
+
+    for (unsigned long i = 0; i < data->ops; i++) {
+        unsigned int r = next_random(&state);
+        unsigned int op = (r >> 16) % 100;
+        make_key(key, r % data->num_keys);
+        if (op < data->read_percent) {
+            if (read_pair(data->ht, key, value, sizeof(value)) == 0 && data->stress && is_torn(value, key)) {
+                data->torn++;
+            }
+        } else if (data->stress && op % 2 == 0) {
+            delete_pair(data->ht, key);
+        } else if (data->stress) {
+            make_stress_value(value, key, r);
+            write_pair(data->ht, key, value);
+        } else {
+            snprintf(value, sizeof(value), "v%u", r);
+            write_pair(data->ht, key, value);
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int stress = 0;
+    int ordered = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "so")) != -1) {
+        if (opt == 's') {
+            stress = 1;
+        } else if (opt == 'o') {
+            ordered = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-s] [-o] [max_threads [ops_per_thread [num_keys [read_percent]]]]\n", argv[0]);
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    unsigned long ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    unsigned int num_keys = argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : (stress ? 64 : 10000);
+    unsigned int read_percent = argc > 4 ? (unsigned int)strtoul(argv[4], NULL, 10) : 90;
+    if (max_threads <= 0 || ops == 0 || num_keys == 0 || read_percent > 100) {
+        fprintf(stderr, "Usage: %s [-s] [-o] [max_threads [ops_per_thread [num_keys [read_percent]]]]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned long torn = 0;
+    printf("# %s%s%lu ops/thread, %u keys, %u%% reads\n", stress ? "stress, " : "", ordered ? "ordered index, " : "", ops, num_keys, read_percent);
+    printf("threads\tseconds\tops/sec%s\n", stress ? "\ttorn" : "");
+    for (int threads = 1; threads <= max_threads; threads++) {
+        HashTable *ht = create_hash_table();
+        if (ht == NULL || (ordered && set_ordered_index(ht, 1) != 0)) {
+            fprintf(stderr, "Failed to create hash table\n");
+            return 1;
+        }
+        char key[MAX_STRING_SIZE];
+        char value[MAX_STRING_SIZE];
+        for (unsigned int k = 0; k < num_keys; k++) {
+            make_key(key, k);
+            make_stress_value(value, key, k);
+            write_pair(ht, key, value);
+        }
+
+        pthread_t tids[threads];
+        bench_thread_t data[threads];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < threads; t++) {
+            data[t] = (bench_thread_t){ht, 2463534242u + (unsigned int)t * 7919u, ops, num_keys, read_percent, stress, 0};
+            if (pthread_create(&tids[t], NULL, bench_thread, &data[t]) != 0) {
+                perror("Failed to create thread");
+                return 1;
+            }
+        }
+        unsigned long run_torn = 0;
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+            run_torn += data[t].torn;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed_seconds(&start, &end);
+        if (stress) {
+            printf("%d\t%.3f\t%.0f\t%lu\n", threads, seconds, (double)ops * threads / seconds, run_torn);
+        } else {
+            printf("%d\t%.3f\t%.0f\n", threads, seconds, (double)ops * threads / seconds);
+        }
+        torn += run_torn;
+        free_table(ht);
+    }
+    return torn != 0;
+}
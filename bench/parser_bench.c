@@ -0,0 +1,147 @@
+// Parser benchmark: generates a job file of the given size and parses it
+// three times: reading one byte per read() call (how the parser used to
+// work), with the buffered reader and from a memory mapping of the file.
+// Reports read() calls and throughput of each run.
+//
+// Usage: parser_bench [size_mb [path]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../constants.h"
+#include "../parser.h"
+
+static unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Writes a mix of WRITE, READ, DELETE and SHOW commands until size bytes.
+static int generate(const char *path, size_t size) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to create job file");
+        return 1;
+    }
+
+    unsigned int state = 2463534242u;
+    size_t written = 0;
+    while (written < size) {
+        unsigned int r = next_random(&state);
+        unsigned int pairs = 1 + r % 8;
+        int len = 0;
+        switch ((r >> 8) % 4) {
+            case 0:
+                len += fprintf(file, "WRITE [");
+                for (unsigned int i = 0; i < pairs; i++) {
+                    len += fprintf(file, "(key%u,value%u)", next_random(&state) % 100000, r);
+                }
+                len += fprintf(file, "]\n");
+                break;
+            case 1:
+            case 2:
+                len += fprintf(file, "%s [", (r >> 8) % 4 == 1 ? "READ" : "DELETE");
+                for (unsigned int i = 0; i < pairs; i++) {
+                    len += fprintf(file, "%skey%u", i > 0 ? "," : "", next_random(&state) % 100000);
+                }
+                len += fprintf(file, "]\n");
+                break;
+            default:
+                len += fprintf(file, "SHOW\n");
+                break;
+        }
+        written += (size_t)len;
+    }
+    return fclose(file) != 0;
+}
+
+// Parses the whole file, reading chunk bytes per read() call, or from a
+// mapping of the file when chunk is 0.
+static int run(const char *path, size_t chunk, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open job file");
+        return 1;
+    }
+
+    static InputBuffer in;
+    static char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    static char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    if (chunk == 0) {
+        if (parser_init_mmap(&in, fd) != 0) {
+            fprintf(stderr, "Failed to map job file\n");
+            close(fd);
+            return 1;
+        }
+    } else {
+        parser_init(&in, fd);
+        in.chunk = chunk;
+    }
+
+    struct timespec start, end;
+    unsigned long commands = 0;
+    unsigned int delay;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (enum Command cmd = get_next(&in); cmd != EOC; cmd = get_next(&in)) {
+        switch (cmd) {
+            case CMD_WRITE:
+                parse_write(&in, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                break;
+            case CMD_READ:
+            case CMD_DELETE:
+            case CMD_SCAN:
+            case CMD_SUBSCRIBE:
+            case CMD_UNSUBSCRIBE:
+                parse_read_delete(&in, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+                break;
+            case CMD_WAIT:
+                parse_wait(&in, &delay, NULL);
+                break;
+            case CMD_SHOW:
+            case CMD_BACKUP:
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+            case EOC:
+                break;
+        }
+        commands++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    parser_release(&in);
+    close(fd);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (chunk == 0) {
+        printf("mmap");
+    } else {
+        printf("%zu", chunk);
+    }
+    printf("\t%lu\t%lu\t%.3f\t%.1f\n", in.refills, commands, seconds, (double)size / 1e6 / seconds);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    const char *path = argc > 2 ? argv[2] : "/tmp/kvs_parser_bench.job";
+    if (size_mb == 0) {
+        fprintf(stderr, "Usage: %s [size_mb [path]]\n", argv[0]);
+        return 1;
+    }
+
+    size_t size = size_mb * 1000 * 1000;
+    if (generate(path, size) != 0) return 1;
+
+    printf("# %zu MB job file %s\n", size_mb, path);
+    printf("chunk\tread()\tcommands\tseconds\tMB/s\n");
+    if (run(path, 1, size) != 0 || run(path, PARSER_BUFFER_SIZE, size) != 0 || run(path, 0, size) != 0) return 1;
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,347 @@
+// Load generator for the kvs server mode: num_clients connections, each in
+// its own thread, send random READ and WRITE commands over num_keys keys and
+// wait for their replies. With -d a client keeps depth commands in flight,
+// sending them together and then reading their replies. A command's latency
+// runs from the send of its batch to its status line, or its response frame.
+// With -b the commands are sent as binary frames (wire.h) instead of text,
+// and with -B each batch goes in one BATCH frame.
+// Reports ops/sec and p50/p99 latency; with -j as one JSON object.
+//
+// Usage: server_load [-j] [-b | -B] [-c clients] [-n requests] [-k keys]
+//                    [-w write%] [-p pairs] [-d depth] socket_path
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../constants.h"
+#include "../wire.h"
+
+#define MAX_DEPTH 1024
+#define MAX_COMMAND 1024
+#define MAX_PAIRS 16
+#define READ_BUFFER_SIZE (64 * 1024)
+
+enum Encoding { ENCODING_TEXT, ENCODING_BINARY, ENCODING_BATCH };
+static const char *const encoding_names[] = {"text", "binary", "batch"};
+
+// Frames of the responses, read from the socket in large chunks
+typedef struct {
+    int fd;
+    size_t pos;
+    size_t len;
+    char data[READ_BUFFER_SIZE];
+} reader_t;
+
+typedef struct {
+    const char *socket_path;
+    unsigned int seed;
+    unsigned long requests;
+    unsigned long keys;
+    unsigned int write_percent;
+    unsigned int pairs;
+    unsigned int depth;
+    enum Encoding encoding;
+    unsigned long long *ns;  // Latency of every request
+    unsigned long errors;
+    int failed;
+} client_t;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static int connect_to(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) return 1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Picks a random command: its keys, and values if it is a write.
+// @return 1 for a write, 0 for a read.
+static int make_command(client_t *client, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+    int write = (unsigned int)rand_r(&client->seed) % 100 < client->write_percent;
+    for (unsigned int i = 0; i < client->pairs; i++) {
+        snprintf(keys[i], MAX_STRING_SIZE, "key%lu", (unsigned long)rand_r(&client->seed) % client->keys);
+        if (write) snprintf(values[i], MAX_STRING_SIZE, "value%d", rand_r(&client->seed) % 1000);
+    }
+    return write;
+}
+
+// Writes one random command to buffer in the encoding of the client and
+// returns its length.
+static size_t encode_command(client_t *client, char *buffer) {
+    char keys[MAX_PAIRS][MAX_STRING_SIZE];
+    char values[MAX_PAIRS][MAX_STRING_SIZE];
+    int write = make_command(client, keys, values);
+
+    if (client->encoding != ENCODING_TEXT) {
+        const char *key_ptrs[MAX_PAIRS];
+        const char *value_ptrs[MAX_PAIRS];
+        for (unsigned int i = 0; i < client->pairs; i++) {
+            key_ptrs[i] = keys[i];
+            value_ptrs[i] = values[i];
+        }
+        return wire_encode_request(buffer, MAX_COMMAND, write ? WIRE_WRITE : WIRE_READ, client->pairs, key_ptrs,
+                                   write ? value_ptrs : NULL);
+    }
+
+    size_t len = (size_t)snprintf(buffer, MAX_COMMAND, "%s [", write ? "WRITE" : "READ");
+    for (unsigned int i = 0; i < client->pairs; i++) {
+        if (write) {
+            len += (size_t)snprintf(buffer + len, MAX_COMMAND - len, "(%s,%s)", keys[i], values[i]);
+        } else {
+            len += (size_t)snprintf(buffer + len, MAX_COMMAND - len, "%s%s", keys[i], i + 1 < client->pairs ? "," : "");
+        }
+    }
+    len += (size_t)snprintf(buffer + len, MAX_COMMAND - len, "]\n");
+    return len;
+}
+
+// Reads the next response frame.
+// @return Its payload, valid until the next call; NULL if the connection ended.
+static const char *read_frame(reader_t *reader, WireHeader *header) {
+    while (1) {
+        size_t available = reader->len - reader->pos;
+        if (available >= WIRE_HEADER_SIZE) {
+            wire_get_header(reader->data + reader->pos, header);
+            if (available - WIRE_HEADER_SIZE >= header->length) {
+                const char *payload = reader->data + reader->pos + WIRE_HEADER_SIZE;
+                reader->pos += WIRE_HEADER_SIZE + header->length;
+                return payload;
+            }
+        }
+        memmove(reader->data, reader->data + reader->pos, available);
+        reader->pos = 0;
+        reader->len = available;
+        if (reader->len == READ_BUFFER_SIZE) return NULL;
+        ssize_t n = read(reader->fd, reader->data + reader->len, READ_BUFFER_SIZE - reader->len);
+        if (n <= 0) return NULL;
+        reader->len += (size_t)n;
+    }
+}
+
+// Waits for the replies of count commands sent at start.
+// @return Number of replies received.
+static unsigned long read_replies(client_t *client, FILE *replies, reader_t *reader, unsigned long done,
+                                  unsigned long count, unsigned long long start) {
+    unsigned long replied = 0;
+    if (client->encoding == ENCODING_TEXT) {
+        char *line = NULL;
+        size_t capacity = 0;
+        while (replied < count && getline(&line, &capacity, replies) != -1) {
+            int ok = strcmp(line, "OK\n") == 0;
+            if (!ok && strcmp(line, "ERR\n") != 0) continue;  // Output of a READ
+            if (!ok) client->errors++;
+            client->ns[done + replied++] = now_ns() - start;
+        }
+        free(line);
+        return replied;
+    }
+
+    WireHeader header;
+    while (replied < count && read_frame(reader, &header) != NULL) {
+        if (header.flags & WIRE_MORE) continue;
+        if (header.flags & WIRE_ERR) client->errors++;
+        client->ns[done + replied++] = now_ns() - start;
+    }
+    return replied;
+}
+
+static void *client_thread(void *arg) {
+    client_t *client = arg;
+    int fd = connect_to(client->socket_path);
+    FILE *replies = NULL;
+    reader_t *reader = NULL;
+    if (fd >= 0 && client->encoding == ENCODING_TEXT) {
+        replies = fdopen(fd, "r");
+    } else if (fd >= 0 && (reader = malloc(sizeof(reader_t))) != NULL) {
+        reader->fd = fd;
+        reader->pos = reader->len = 0;
+        const char magic = (char)WIRE_MAGIC;
+        if (send_all(fd, &magic, 1)) {
+            free(reader);
+            reader = NULL;
+        }
+    }
+    if (replies == NULL && reader == NULL) {
+        perror("Failed to connect");
+        if (fd >= 0) close(fd);
+        client->failed = 1;
+        return NULL;
+    }
+
+    // Room for the header of a BATCH frame before the commands
+    char *batch = malloc(WIRE_HEADER_SIZE + (size_t)client->depth * MAX_COMMAND);
+    unsigned long done = 0;
+    while (batch != NULL && done < client->requests) {
+        unsigned long count = client->requests - done < client->depth ? client->requests - done : client->depth;
+        size_t len = WIRE_HEADER_SIZE;
+        for (unsigned long i = 0; i < count; i++) len += encode_command(client, batch + len);
+        const char *frames = batch + WIRE_HEADER_SIZE;
+        if (client->encoding == ENCODING_BATCH) {
+            WireHeader header = {(uint32_t)(len - WIRE_HEADER_SIZE), WIRE_BATCH, 0, (uint16_t)count};
+            wire_put_header(batch, &header);
+            frames = batch;
+        }
+
+        unsigned long long start = now_ns();
+        if (send_all(fd, frames, len - (size_t)(frames - batch))) break;
+        if (read_replies(client, replies, reader, done, count, start) < count) break;
+        done += count;
+    }
+    if (done < client->requests) {
+        fprintf(stderr, "Client stopped after %lu requests\n", done);
+        client->failed = 1;
+    }
+    free(batch);
+    if (replies != NULL) fclose(replies);
+    if (reader != NULL) {
+        close(fd);
+        free(reader);
+    }
+    return NULL;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-j] [-b | -B] [-c clients] [-n requests] [-k keys] [-w write%%] [-p pairs] [-d depth] "
+            "socket_path\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int num_clients = 4;
+    unsigned long requests = 20000;
+    unsigned long keys = 10000;
+    unsigned int write_percent = 20;
+    unsigned int pairs = 1;
+    unsigned int depth = 1;
+    enum Encoding encoding = ENCODING_TEXT;
+    int json = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "jbBc:n:k:w:p:d:")) != -1) {
+        switch (opt) {
+            case 'j':
+                json = 1;
+                break;
+            case 'b':
+                encoding = ENCODING_BINARY;
+                break;
+            case 'B':
+                encoding = ENCODING_BATCH;
+                break;
+            case 'c':
+                num_clients = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                requests = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                keys = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                write_percent = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                pairs = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                depth = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 1 || num_clients == 0 || requests == 0 || keys == 0 || write_percent > 100 ||
+        pairs == 0 || pairs > MAX_PAIRS || depth == 0 || depth > MAX_DEPTH) {
+        usage(argv[0]);
+        return 1;
+    }
+    // The server takes frames of up to 64 KiB, a BATCH frame included
+    if (encoding == ENCODING_BATCH && depth * (pairs * 2 * MAX_STRING_SIZE + WIRE_HEADER_SIZE) > 64 * 1024) {
+        fprintf(stderr, "Batches of %u commands of %u pairs may not fit in a frame\n", depth, pairs);
+        return 1;
+    }
+
+    client_t *clients = calloc(num_clients, sizeof(client_t));
+    pthread_t *threads = calloc(num_clients, sizeof(pthread_t));
+    unsigned long long *ns = calloc((size_t)num_clients * requests, sizeof(unsigned long long));
+    if (clients == NULL || threads == NULL || ns == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    unsigned long long start = now_ns();
+    for (unsigned int i = 0; i < num_clients; i++) {
+        clients[i] = (client_t){argv[optind], i + 1, requests, keys, write_percent, pairs, depth, encoding,
+                                ns + (size_t)i * requests, 0, 0};
+        if (pthread_create(&threads[i], NULL, client_thread, &clients[i]) != 0) {
+            fprintf(stderr, "Failed to create client thread\n");
+            return 1;
+        }
+    }
+    int failed = 0;
+    unsigned long errors = 0;
+    for (unsigned int i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= clients[i].failed;
+        errors += clients[i].errors;
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    if (failed) return 1;
+
+    size_t total = (size_t)num_clients * requests;
+    qsort(ns, total, sizeof(unsigned long long), compare_ns);
+    double p50 = (double)ns[total / 2] / 1e3;
+    double p99 = (double)ns[total * 99 / 100] / 1e3;
+    double ops = (double)total / seconds;
+    if (json) {
+        printf("{\"encoding\":\"%s\",\"clients\":%u,\"requests\":%zu,\"depth\":%u,\"write_percent\":%u,"
+               "\"pairs\":%u,\"seconds\":%.3f,\"ops_per_sec\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+               "\"errors\":%lu}\n",
+               encoding_names[encoding], num_clients, total, depth, write_percent, pairs, seconds, ops, p50, p99,
+               errors);
+    } else {
+        printf("# server_load: %s, %u clients, %zu requests, depth %u, %u%% writes, %u pairs\n",
+               encoding_names[encoding], num_clients, total, depth, write_percent, pairs);
+        printf("%-12s %12s %10s %10s %8s\n", "seconds", "ops/sec", "p50_us", "p99_us", "errors");
+        printf("%-12.3f %12.0f %10.1f %10.1f %8lu\n", seconds, ops, p50, p99, errors);
+    }
+    free(ns);
+    free(threads);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Starts kvs in server mode on a temporary socket and measures it with
+# server_load, one command per round trip and then with commands in flight,
+# with the text commands, binary frames and BATCH frames.
+#
+# Usage: bench/server_load.sh [workers [clients [requests]]]
+
+set -e
+
+KVS=${KVS:-./kvs}
+LOAD=${LOAD:-./bench/server_load}
+WORKERS=${1:-4}
+CLIENTS=${2:-8}
+REQUESTS=${3:-20000}
+
+DIR=$(mktemp -d)
+SOCKET="$DIR/kvs.sock"
+"$KVS" -l "$SOCKET" 1 "$WORKERS" > /dev/null &
+PID=$!
+trap 'kill "$PID" 2>/dev/null; wait "$PID" 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# The server unlinks and binds the socket once the table is ready
+tries=0
+while [ ! -S "$SOCKET" ]; do
+    tries=$((tries + 1))
+    if [ "$tries" -gt 100 ]; then
+        echo "kvs server did not start" >&2
+        exit 1
+    fi
+    sleep 0.05
+done
+
+for encoding in "" -b; do
+    "$LOAD" $encoding -c "$CLIENTS" -n "$REQUESTS" "$SOCKET"
+done
+for encoding in "" -b -B; do
+    "$LOAD" $encoding -c "$CLIENTS" -n "$REQUESTS" -d 32 -p 4 "$SOCKET"
+done
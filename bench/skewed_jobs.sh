@@ -0,0 +1,46 @@
+#!/bin/sh
+# Measures total completion time of kvs on a directory with skewed job sizes:
+# one large job file and many small ones.
+#
+# Usage: bench/skewed_jobs.sh [max_threads [big_lines [small_files [small_lines]]]]
+
+set -e
+
+KVS=${KVS:-./kvs}
+MAX_THREADS=${1:-4}
+BIG_LINES=${2:-200000}
+SMALL_FILES=${3:-16}
+SMALL_LINES=${4:-10000}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Alternates WRITE and READ commands over a small key space
+gen_job() {
+    awk -v lines="$1" -v seed="$2" 'BEGIN {
+        srand(seed);
+        for (i = 0; i < lines; i++) {
+            k = int(rand() * 1000);
+            if (i % 2 == 0) printf "WRITE [(k%d,v%d)(j%d,w%d)]\n", k, i, k, i;
+            else printf "READ [k%d,j%d]\n", k, k;
+        }
+    }' > "$3"
+}
+
+gen_job "$BIG_LINES" 1 "$DIR/big.job"
+i=0
+while [ "$i" -lt "$SMALL_FILES" ]; do
+    gen_job "$SMALL_LINES" "$((i + 2))" "$DIR/small$i.job"
+    i=$((i + 1))
+done
+
+echo "# 1 job of $BIG_LINES lines, $SMALL_FILES jobs of $SMALL_LINES lines"
+echo "threads	seconds"
+threads=1
+while [ "$threads" -le "$MAX_THREADS" ]; do
+    start=$(date +%s.%N)
+    "$KVS" "$DIR" 1 "$threads" > /dev/null
+    end=$(date +%s.%N)
+    awk -v t="$threads" -v s="$start" -v e="$end" 'BEGIN { printf "%d\t%.3f\n", t, e - s }'
+    threads=$((threads * 2))
+done
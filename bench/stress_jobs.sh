@@ -0,0 +1,75 @@
+#!/bin/sh
+# Stress test of kvs through job files: several jobs run READ, WRITE, DELETE,
+# SHOW and BACKUP concurrently on a few hot keys. Every value written names
+# its key and is its own tag twice, "<tag>Z<tag>", so a value that is a mix
+# of two writes, or that belongs to another key, shows up in the .out and
+# .bck files. Exits non-zero if any is found.
+#
+# Usage: bench/stress_jobs.sh [jobs [lines_per_job [num_keys [max_threads]]]]
+# KVS_FLAGS is passed to kvs, e.g. KVS_FLAGS=-p2 to stress the pipeline.
+
+set -e
+
+KVS=${KVS:-./kvs}
+JOBS=${1:-8}
+LINES=${2:-20000}
+KEYS=${3:-16}
+MAX_THREADS=${4:-4}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Mostly READs and WRITEs of up to three hot keys, with DELETEs, SHOWs and
+# a backup every few thousand lines
+gen_job() {
+    awk -v lines="$LINES" -v keys="$KEYS" -v job="$1" 'BEGIN {
+        srand(job + 1);
+        for (i = 0; i < lines; i++) {
+            r = rand();
+            n = 1 + int(rand() * 3);
+            if (r < 0.40) {
+                printf "READ [";
+                for (p = 0; p < n; p++) printf "%sh%d", p ? "," : "", int(rand() * keys);
+                printf "]\n";
+            } else if (r < 0.75) {
+                printf "WRITE [";
+                for (p = 0; p < n; p++) {
+                    k = int(rand() * keys);
+                    tag = sprintf("h%dj%dn%d", k, job, i * 3 + p);
+                    printf "(h%d,%sZ%s)", k, tag, tag;
+                }
+                printf "]\n";
+            } else if (r < 0.95) {
+                printf "DELETE [h%d]\n", int(rand() * keys);
+            } else {
+                printf "SHOW\n";
+            }
+            if (i % 5000 == 4999) printf "BACKUP\n";
+        }
+    }' > "$DIR/stress$1.job"
+}
+
+i=0
+while [ "$i" -lt "$JOBS" ]; do
+    gen_job "$i"
+    i=$((i + 1))
+done
+
+echo "# $JOBS jobs of $LINES lines on $KEYS keys, $MAX_THREADS threads"
+# shellcheck disable=SC2086
+"$KVS" $KVS_FLAGS "$DIR" 2 "$MAX_THREADS" > /dev/null
+
+# READ and DELETE print (key,value), SHOW and text backups (key, value)
+cat "$DIR"/*.out "$DIR"/*.bck | grep -o '([^()]*)' | awk -F', *' '
+    {
+        sub(/^\(/, ""); sub(/\)$/, "");
+        if (NF < 2 || $2 == "KVSERROR" || $2 == "KVSMISSING") next;
+        checked++;
+        if (split($2, half, "Z") != 2 || half[1] != half[2] || index(half[1], $1 "j") != 1) {
+            if (++torn <= 5) printf "torn value: (%s,%s)\n", $1, $2;
+        }
+    }
+    END {
+        printf "%d values checked, %d torn\n", checked, torn;
+        exit torn > 0 || checked == 0;
+    }'
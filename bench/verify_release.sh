@@ -0,0 +1,74 @@
+#!/bin/sh
+# Runs two kvs builds on the same job files and checks that they write
+# byte-identical output and backup files. Jobs run on one thread, so the
+# output of a build does not depend on scheduling.
+#
+# Usage: bench/verify_release.sh reference_kvs candidate_kvs
+
+set -e
+
+if [ "$#" -ne 2 ]; then
+    echo "Usage: $0 reference_kvs candidate_kvs" >&2
+    exit 1
+fi
+REFERENCE=$1
+CANDIDATE=$2
+GEN_JOBS=${GEN_JOBS:-./bench/gen_jobs}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Every command and the parser errors, then generated workloads
+mkdir "$DIR/commands"
+cat > "$DIR/commands/commands.job" <<'JOB'
+WRITE [(a,1)(b,2)(c,3)(apple,red)(apricot,orange)(banana,yellow)]
+READ [a,b,z,apple]
+SHOW
+SCAN [ap]
+SCAN [a,b]
+BACKUP
+DELETE [a,z,banana]
+WRITE [(b,22)(d,4)]
+SHOW
+BACKUP
+WAIT 0
+HELP
+READ
+WRITE [(x,1]
+NOT A COMMAND
+SHOW
+JOB
+
+mkdir "$DIR/zipf" && "$GEN_JOBS" -f 1 -c 20000 -k 500 -b 2000 "$DIR/zipf"
+mkdir "$DIR/uniform" && "$GEN_JOBS" -f 4 -c 20000 -k 20000 -z 0 -m 40:40:20 -p 10 -b 3000 -r 7 "$DIR/uniform"
+mkdir "$DIR/long_keys" && "$GEN_JOBS" -f 3 -c 10000 -k 2000 -l 1:39 -s 1 -b 1500 -r 42 "$DIR/long_keys"
+
+failed=0
+for jobs in "$DIR"/*; do
+    for flags in "" "-s"; do
+        rm -rf "$DIR/ref" "$DIR/cand"
+        cp -r "$jobs" "$DIR/ref"
+        cp -r "$jobs" "$DIR/cand"
+        # shellcheck disable=SC2086
+        "$REFERENCE" $flags "$DIR/ref" 2 1 > "$DIR/ref.stdout" 2> "$DIR/ref.stderr"
+        # shellcheck disable=SC2086
+        "$CANDIDATE" $flags "$DIR/cand" 2 1 > "$DIR/cand.stdout" 2> "$DIR/cand.stderr"
+        for file in "$DIR/ref"/* "$DIR/ref.stdout" "$DIR/ref.stderr"; do
+            other=$(echo "$file" | sed "s#^$DIR/ref#$DIR/cand#")
+            if ! cmp -s "$file" "$other"; then
+                echo "differs: $(basename "$jobs") ${flags:+$flags }$(basename "$file")"
+                failed=1
+            fi
+        done
+        if [ "$(ls "$DIR/ref" | wc -l)" -ne "$(ls "$DIR/cand" | wc -l)" ]; then
+            echo "differs: $(basename "$jobs") ${flags:+$flags }number of files"
+            failed=1
+        fi
+    done
+done
+
+if [ "$failed" -ne 0 ]; then
+    echo "$CANDIDATE does not match $REFERENCE"
+    exit 1
+fi
+echo "$CANDIDATE matches $REFERENCE"
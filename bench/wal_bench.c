@@ -0,0 +1,92 @@
+// Group commit benchmark for the write-ahead log in wal.c.
+// Every thread logs single-pair writes and waits for each to be durable, as
+// a WRITE command does. The run is repeated for each group commit window and
+// prints how many commits and how many fdatasync calls per second it got.
+//
+// Usage: wal_bench [threads [commits_per_thread [log_dir]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../constants.h"
+#include "../kvs.h"
+#include "../wal.h"
+
+typedef struct {
+    Wal *wal;
+    unsigned int id;
+    unsigned long commits;
+} bench_thread_t;
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *data = (bench_thread_t *)arg;
+    char keys[1][MAX_STRING_SIZE];
+    char values[1][MAX_STRING_SIZE];
+
+    for (unsigned long i = 0; i < data->commits; i++) {
+        snprintf(keys[0], MAX_STRING_SIZE, "t%uk%lu", data->id, i % 1000);
+        snprintf(values[0], MAX_STRING_SIZE, "v%lu", i);
+        wal_append(data->wal, 1, keys, values);
+        wal_commit(data->wal);
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    unsigned long commits = argc > 2 ? strtoul(argv[2], NULL, 10) : 500;
+    const char *dir = argc > 3 ? argv[3] : ".";
+    if (threads <= 0 || commits == 0) {
+        fprintf(stderr, "Usage: %s [threads [commits_per_thread [log_dir]]]\n", argv[0]);
+        return 1;
+    }
+
+    static const unsigned int windows[] = {0, 50, 200, 1000, 5000};
+    char path[MAX_JOB_FILE_NAME_SIZE];
+    snprintf(path, sizeof(path), "%s/wal_bench.%d.log", dir, (int)getpid());
+
+    printf("# %d threads, %lu commits/thread\n", threads, commits);
+    printf("window_us\tseconds\tcommits/sec\tsyncs/sec\tcommits/sync\n");
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        HashTable *ht = create_hash_table();
+        unlink(path);
+        Wal *wal = ht != NULL ? wal_open(path, ht, 0, windows[w]) : NULL;
+        if (wal == NULL) {
+            fprintf(stderr, "Failed to open log %s\n", path);
+            return 1;
+        }
+
+        pthread_t tids[threads];
+        bench_thread_t data[threads];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < threads; t++) {
+            data[t] = (bench_thread_t){wal, (unsigned int)t, commits};
+            if (pthread_create(&tids[t], NULL, bench_thread, &data[t]) != 0) {
+                perror("Failed to create thread");
+                return 1;
+            }
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed_seconds(&start, &end);
+        double total = (double)commits * threads;
+        double syncs = (double)wal_syncs(wal);
+        printf("%u\t%.3f\t%.0f\t%.0f\t%.1f\n", windows[w], seconds, total / seconds, syncs / seconds, total / syncs);
+        wal_close(wal);
+        free_table(ht);
+    }
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Client of the kvs server mode (kvs -l socket_path). Sends the commands of a
+// job file, or of stdin, one line at a time and prints the output of each.
+// The status line that ends every reply is not printed; a command that failed
+// is reported on stderr with its line number, and makes the exit status 1.
+// Changes of subscribed keys arrive as NOTIFY lines; with -f the client keeps
+// printing them after the last command, until the server goes away.
+//
+// Usage: kvs_client [-f] socket_path [job_file]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int connect_to(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Failed to connect");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) return 1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int follow = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        if (opt != 'f') {
+            fprintf(stderr, "Usage: %s [-f] socket_path [job_file]\n", argv[0]);
+            return 1;
+        }
+        follow = 1;
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        fprintf(stderr, "Usage: %s [-f] socket_path [job_file]\n", argv[0]);
+        return 1;
+    }
+    FILE *input = stdin;
+    if (argc - optind == 2 && (input = fopen(argv[optind + 1], "r")) == NULL) {
+        perror("Failed to open job file");
+        return 1;
+    }
+    int fd = connect_to(argv[optind]);
+    if (fd < 0) return 1;
+    FILE *replies = fdopen(fd, "r");
+    if (replies == NULL) {
+        perror("Failed to read from the server");
+        close(fd);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    char *reply = NULL;
+    size_t reply_capacity = 0;
+    unsigned long number = 0;
+    int failed = 0;
+    ssize_t len;
+    while ((len = getline(&line, &capacity, input)) != -1) {
+        number++;
+        if (send_all(fd, line, (size_t)len) || (line[len - 1] != '\n' && send_all(fd, "\n", 1))) {
+            perror("Failed to send command");
+            failed = 1;
+            break;
+        }
+
+        // Output lines until the status line of the command
+        ssize_t reply_len;
+        while ((reply_len = getline(&reply, &reply_capacity, replies)) != -1) {
+            if (strcmp(reply, "OK\n") == 0) break;
+            if (strcmp(reply, "ERR\n") == 0) {
+                fprintf(stderr, "Command on line %lu failed\n", number);
+                failed = 1;
+                break;
+            }
+            fwrite(reply, 1, (size_t)reply_len, stdout);
+        }
+        if (reply_len == -1) {
+            fprintf(stderr, "Connection closed by the server\n");
+            failed = 1;
+            break;
+        }
+        fflush(stdout);
+    }
+    while (follow && !failed && getline(&reply, &reply_capacity, replies) != -1) {
+        fputs(reply, stdout);
+        fflush(stdout);
+    }
+
+    free(line);
+    free(reply);
+    fclose(replies);
+    if (input != stdin) fclose(input);
+    return failed;
+}
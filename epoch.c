@@ -0,0 +1,158 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define EPOCH_RECLAIM_THRESHOLD 64  // Retired objects before a reclaim attempt
+
+typedef struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    uint64_t epoch;  // Global epoch when ptr was retired
+} Retired;
+
+typedef struct RetiredList {
+    Retired *items;
+    size_t count;
+    size_t capacity;
+} RetiredList;
+
+// One record per thread that ever entered the epoch. Records are never
+// freed, a thread that exits leaves its record to be reused by the next one.
+typedef struct EpochRecord {
+    _Atomic uint64_t state;  // (epoch << 1) | 1 while inside a critical section, 0 otherwise
+    atomic_int in_use;
+    RetiredList retired;
+    struct EpochRecord *next;
+} EpochRecord;
+
+static _Atomic uint64_t global_epoch = 0;
+static _Atomic(EpochRecord *) records = NULL;
+
+// Objects retired by threads that have exited, freed by whoever reclaims next
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RetiredList orphans = {NULL, 0, 0};
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static _Thread_local EpochRecord *self = NULL;
+
+static int list_push(RetiredList *list, Retired item) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? EPOCH_RECLAIM_THRESHOLD : list->capacity * 2;
+        Retired *items = realloc(list->items, capacity * sizeof(Retired));
+        if (items == NULL) return 1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = item;
+    return 0;
+}
+
+// Frees every item retired at least two epochs before epoch.
+static void list_reclaim(RetiredList *list, uint64_t epoch) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].epoch + 2 <= epoch) {
+            list->items[i].free_fn(list->items[i].ptr);
+        } else {
+            list->items[kept++] = list->items[i];
+        }
+    }
+    list->count = kept;
+}
+
+static void list_free_all(RetiredList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        list->items[i].free_fn(list->items[i].ptr);
+    }
+    free(list->items);
+    *list = (RetiredList){NULL, 0, 0};
+}
+
+static void release_record(void *arg) {
+    EpochRecord *record = (EpochRecord *)arg;
+    pthread_mutex_lock(&orphans_mutex);
+    for (size_t i = 0; i < record->retired.count; i++) {
+        if (list_push(&orphans, record->retired.items[i]) != 0) {
+            // No memory to hand it over, leaking is safer than freeing early
+            break;
+        }
+    }
+    pthread_mutex_unlock(&orphans_mutex);
+    free(record->retired.items);
+    record->retired = (RetiredList){NULL, 0, 0};
+    atomic_store(&record->in_use, 0);
+}
+
+static void create_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+static EpochRecord *get_record(void) {
+    if (self != NULL) return self;
+
+    EpochRecord *record;
+    for (record = atomic_load(&records); record != NULL; record = record->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&record->in_use, &expected, 1)) break;
+    }
+    if (record == NULL) {
+        record = calloc(1, sizeof(EpochRecord));
+        if (record == NULL) abort(); // Readers cannot run safely without a record
+        atomic_store(&record->in_use, 1);
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record))
+            ;
+    }
+
+    pthread_once(&key_once, create_key);
+    pthread_setspecific(record_key, record);
+    self = record;
+    return record;
+}
+
+// Advances the global epoch if every active thread has observed it.
+static uint64_t try_advance(void) {
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+        uint64_t state = atomic_load(&record->state);
+        if ((state & 1) && (state >> 1) != epoch) return epoch;
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+    return atomic_load(&global_epoch);
+}
+
+void epoch_enter(void) {
+    EpochRecord *record = get_record();
+    // seq_cst so the announcement is visible before any shared pointer is read
+    atomic_store(&record->state, (atomic_load(&global_epoch) << 1) | 1);
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    EpochRecord *record = get_record();
+    if (list_push(&record->retired, (Retired){ptr, free_fn, atomic_load(&global_epoch)}) != 0) {
+        return; // Leak rather than free memory a reader may still use
+    }
+    if (record->retired.count < EPOCH_RECLAIM_THRESHOLD) return;
+
+    uint64_t epoch = try_advance();
+    list_reclaim(&record->retired, epoch);
+    if (pthread_mutex_trylock(&orphans_mutex) == 0) {
+        list_reclaim(&orphans, epoch);
+        pthread_mutex_unlock(&orphans_mutex);
+    }
+}
+
+void epoch_drain(void) {
+    if (self != NULL) list_free_all(&self->retired);
+    pthread_mutex_lock(&orphans_mutex);
+    list_free_all(&orphans);
+    pthread_mutex_unlock(&orphans_mutex);
+}
@@ -0,0 +1,25 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// Epoch-based memory reclamation.
+// Readers that traverse shared structures without a lock wrap the traversal
+// in epoch_enter/epoch_exit. Writers that unlink memory hand it to
+// epoch_retire instead of freeing it; it is freed once every reader that
+// could still hold a pointer to it has left its critical section.
+
+/// Starts a read-side critical section of the calling thread.
+void epoch_enter(void);
+
+/// Ends the read-side critical section started by epoch_enter.
+void epoch_exit(void);
+
+/// Defers freeing memory until no reader can still reference it.
+/// @param ptr Memory that is no longer reachable by new readers.
+/// @param free_fn Function that releases ptr.
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/// Frees all retired memory right away.
+/// Must only be called when no other thread is using the epoch.
+void epoch_drain(void);
+
+#endif  // KVS_EPOCH_H
@@ -1,121 +1,840 @@
 #include "kvs.h"
+#include "kvs_engine.h"
+#include "constants.h"
+#include "epoch.h"
+#include "skiplist.h"
+#include "lockprof.h"
+#include "notify.h"
 #include "string.h"
 
+#include <stdatomic.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <pthread.h>
 
-static pthread_mutex_t kvs_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define KVS_READ_RETRIES 4  // Optimistic reads before falling back to the lock
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+// A key changed while ht->generation was generation, see set_change_tracking
+typedef struct Change {
+    char key[MAX_STRING_SIZE];
+    uint64_t generation;
+} Change;
+
+// Writers hold the lock in write mode and make seq odd while they change the
+// segment. Readers take no lock: they read the segment inside an epoch and
+// retry when seq shows that a writer ran in the meantime.
+typedef struct Stripe {
+    pthread_rwlock_t lock;
+    atomic_uint seq;
+    Segment *segment;
+    SkipList *index;  // Keys of the segment in order, only with set_ordered_index
+    // Keys changed since the oldest delta base still needed, in generation
+    // order, only while change tracking is on (see set_change_tracking)
+    Change *changes;
+    size_t first_change;
+    size_t num_changes;
+    size_t changes_capacity;
+    // Keys already recorded in recorded_generation, the last
+    // generation_changes changes, by hash. Each slot holds the offset of the
+    // change among them plus one, 0 if it is free.
+    size_t *recorded;
+    size_t recorded_capacity;       // Power of two, at most half full
+    size_t num_recorded;
+    size_t generation_changes;
+    uint64_t recorded_generation;
+} Stripe;
+
+// A point-in-time copy of the table. Each stripe is copied once, by the
+// backup thread or by the first writer that changes it after the snapshot was
+// taken, whichever comes first, so writers never wait for a whole backup.
+struct Snapshot {
+    struct Snapshot *next;          // Next snapshot still being captured
+    char *pairs[KVS_STRIPES];       // Keys and values of each stripe, '\0' separated
+    size_t size[KVS_STRIPES];
+    char *deleted[KVS_STRIPES];     // Keys deleted since base, '\0' separated, deltas only
+    size_t deleted_size[KVS_STRIPES];
+    char captured[KVS_STRIPES];     // Guarded by the lock of each stripe
+    uint64_t generation;
+    uint64_t base;                  // Generation the delta is relative to, 0 for a full copy
+    uint64_t log_position;          // Change log position when it was taken
+    int failed;
+};
+
+struct HashTable {
+    Stripe stripes[KVS_STRIPES];
+    // Snapshots still being captured. The list only changes while every
+    // stripe is read locked, so writers walk it under their write lock.
+    Snapshot *snapshots;
+    pthread_mutex_t snapshot_mutex;  // Serializes changes to the list
+    ChangeLog log;                   // Set before the table is shared, see set_change_log
+    // Generation of the next snapshot; changes are stamped with it. It only
+    // moves while every stripe is read locked, like the snapshot list.
+    uint64_t generation;
+    int track_changes;
+    _Atomic uint64_t changes_lost;   // Generation in which a change could not be recorded
+    atomic_int index_lost;           // Some key could not be added to the ordered index
+};
+
+uint64_t kvs_hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    return h;
+}
+
+static Stripe *stripe_of(HashTable *ht, uint64_t h) {
+    return &ht->stripes[h & (KVS_STRIPES - 1)];
 }
 
 struct HashTable* create_hash_table() {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
+  for (int i = 0; i < KVS_STRIPES; i++) {
+      ht->stripes[i].segment = segment_create();
+      if (ht->stripes[i].segment == NULL) {
+          for (int j = 0; j < i; j++) {
+              segment_destroy(ht->stripes[j].segment);
+              pthread_rwlock_destroy(&ht->stripes[j].lock);
+          }
+          free(ht);
+          return NULL;
+      }
+      pthread_rwlock_init(&ht->stripes[i].lock, NULL);
+      atomic_init(&ht->stripes[i].seq, 0);
+      ht->stripes[i].index = NULL;
+      ht->stripes[i].changes = NULL;
+      ht->stripes[i].first_change = 0;
+      ht->stripes[i].num_changes = 0;
+      ht->stripes[i].changes_capacity = 0;
+      ht->stripes[i].recorded = NULL;
+      ht->stripes[i].recorded_capacity = 0;
+      ht->stripes[i].num_recorded = 0;
+      ht->stripes[i].generation_changes = 0;
+      ht->stripes[i].recorded_generation = 0;
   }
+  ht->snapshots = NULL;
+  ht->generation = 1;
+  ht->track_changes = 0;
+  atomic_init(&ht->changes_lost, 0);
+  atomic_init(&ht->index_lost, 0);
+  ht->log = (ChangeLog){NULL, NULL, NULL};
+  pthread_mutex_init(&ht->snapshot_mutex, NULL);
   return ht;
 }
 
+typedef struct PairBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+} PairBuffer;
+
+static void append_pair(const char *key, const char *value, void *arg) {
+    PairBuffer *buffer = arg;
+    size_t key_len = strlen(key) + 1;
+    size_t value_len = strlen(value) + 1;
+    if (buffer->failed) return;
+    if (buffer->size + key_len + value_len > buffer->capacity) {
+        size_t capacity = buffer->capacity * 2 + key_len + value_len;
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, key, key_len);
+    memcpy(buffer->data + buffer->size + key_len, value, value_len);
+    buffer->size += key_len + value_len;
+}
+
+static void append_key(PairBuffer *buffer, const char *key) {
+    size_t len = strlen(key) + 1;
+    if (buffer->failed) return;
+    if (buffer->size + len > buffer->capacity) {
+        size_t capacity = buffer->capacity * 2 + len;
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, key, len);
+    buffer->size += len;
+}
+
+static int compare_change_keys(const void *a, const void *b) {
+    return strcmp((*(const Change *const *)a)->key, (*(const Change *const *)b)->key);
+}
+
+// Copies the keys of a stripe changed after the snapshot base, with their
+// current value, or as deleted if they are gone.
+static void capture_changes(Snapshot *snap, Stripe *stripe, PairBuffer *pairs, PairBuffer *deleted) {
+    // Changes are in generation order, the ones after base are at the end
+    size_t first = stripe->first_change + stripe->num_changes;
+    while (first > stripe->first_change && stripe->changes[first - 1].generation > snap->base) first--;
+    size_t count = stripe->first_change + stripe->num_changes - first;
+    if (count == 0) return;
+
+    const Change **sorted = malloc(count * sizeof(Change *));
+    if (sorted == NULL) {
+        pairs->failed = 1;
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = &stripe->changes[first + i];
+    }
+    // A key changed many times is copied once
+    qsort(sorted, count, sizeof(Change *), compare_change_keys);
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && strcmp(sorted[i]->key, sorted[i - 1]->key) == 0) continue;
+        const char *value = segment_find(stripe->segment, kvs_hash(sorted[i]->key), sorted[i]->key);
+        if (value != NULL) {
+            append_pair(sorted[i]->key, value, pairs);
+        } else {
+            append_key(deleted, sorted[i]->key);
+        }
+    }
+    free(sorted);
+}
+
+// Copies a stripe into the snapshot, unless it was already copied.
+// The caller must hold the stripe lock.
+static void capture_stripe(Snapshot *snap, size_t index, Stripe *stripe) {
+    if (snap->captured[index]) return;
+    PairBuffer pairs = {NULL, 0, 0, 0};
+    PairBuffer deleted = {NULL, 0, 0, 0};
+    if (snap->base > 0) {
+        capture_changes(snap, stripe, &pairs, &deleted);
+    } else {
+        segment_for_each(stripe->segment, append_pair, &pairs);
+    }
+    if (pairs.failed || deleted.failed) snap->failed = 1;
+    snap->pairs[index] = pairs.data;
+    snap->size[index] = pairs.failed ? 0 : pairs.size;
+    snap->deleted[index] = deleted.data;
+    snap->deleted_size[index] = deleted.failed ? 0 : deleted.size;
+    snap->captured[index] = 1;
+}
+
+// Slot of the recorded set where a key is, or the free slot where it goes.
+// The low bits of the hash pick the stripe, so the set uses the high ones.
+static size_t recorded_slot(const Stripe *stripe, uint64_t h, const char *key) {
+    const Change *generation = stripe->changes + stripe->first_change + stripe->num_changes - stripe->generation_changes;
+    size_t mask = stripe->recorded_capacity - 1;
+    size_t slot = (size_t)(h >> 32) & mask;
+    while (stripe->recorded[slot] != 0 && strcmp(generation[stripe->recorded[slot] - 1].key, key) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Doubles the recorded set and adds back the changes of the generation.
+// @return 0 on success, 1 if there was no memory for it.
+static int grow_recorded(Stripe *stripe) {
+    size_t capacity = stripe->recorded_capacity > 0 ? stripe->recorded_capacity * 2 : 64;
+    size_t *recorded = calloc(capacity, sizeof(size_t));
+    if (recorded == NULL) return 1;
+    free(stripe->recorded);
+    stripe->recorded = recorded;
+    stripe->recorded_capacity = capacity;
+    stripe->num_recorded = 0;
+    const Change *generation = stripe->changes + stripe->first_change + stripe->num_changes - stripe->generation_changes;
+    for (size_t i = 0; i < stripe->generation_changes; i++) {
+        size_t slot = recorded_slot(stripe, kvs_hash(generation[i].key), generation[i].key);
+        if (stripe->recorded[slot] != 0) continue;
+        stripe->recorded[slot] = i + 1;
+        stripe->num_recorded++;
+    }
+    return 0;
+}
+
+// Notes that a key of the stripe changed, for delta snapshots. A key is
+// recorded once per generation, so the changes grow with the keys changed
+// rather than with the writes.
+// The caller must hold the stripe lock in write mode.
+static void record_change(HashTable *ht, Stripe *stripe, uint64_t h, const char *key) {
+    if (stripe->recorded_generation != ht->generation) {
+        if (stripe->recorded != NULL) memset(stripe->recorded, 0, stripe->recorded_capacity * sizeof(size_t));
+        stripe->num_recorded = 0;
+        stripe->generation_changes = 0;
+        stripe->recorded_generation = ht->generation;
+    }
+    size_t slot = 0;
+    if (stripe->recorded_capacity > 0) {
+        slot = recorded_slot(stripe, h, key);
+        if (stripe->recorded[slot] != 0) return;
+    }
+
+    if (stripe->first_change + stripe->num_changes == stripe->changes_capacity) {
+        if (stripe->first_change > stripe->num_changes) {
+            // More than half of the array was trimmed, reuse it
+            memmove(stripe->changes, stripe->changes + stripe->first_change, stripe->num_changes * sizeof(Change));
+            stripe->first_change = 0;
+        } else {
+            size_t capacity = stripe->changes_capacity * 2 + 64;
+            Change *changes = realloc(stripe->changes, capacity * sizeof(Change));
+            if (changes == NULL) {
+                // Without the record a delta could miss the key, so deltas
+                // based on an older generation become full copies
+                atomic_store(&ht->changes_lost, ht->generation);
+                return;
+            }
+            stripe->changes = changes;
+            stripe->changes_capacity = capacity;
+        }
+    }
+    Change *change = &stripe->changes[stripe->first_change + stripe->num_changes++];
+    size_t len = strnlen(key, MAX_STRING_SIZE - 1);
+    memcpy(change->key, key, len);
+    change->key[len] = '\0';
+    change->generation = ht->generation;
+    stripe->generation_changes++;
+
+    // Without room in the set the key may be recorded again, which only
+    // costs a duplicate
+    if ((stripe->num_recorded + 1) * 2 > stripe->recorded_capacity) {
+        grow_recorded(stripe);
+    } else {
+        stripe->recorded[slot] = stripe->generation_changes;
+        stripe->num_recorded++;
+    }
+}
+
+// Keeps the ordered index of the stripe in step with a successful change.
+// The caller must hold the stripe lock in write mode.
+static void index_change(HashTable *ht, Stripe *stripe, uint64_t h, const char *key, int deleted) {
+    if (deleted) {
+        skiplist_remove(stripe->index, key);
+    } else if (skiplist_insert(stripe->index, key, h) != 0) {
+        // The index misses the key from now on, sorted walks stop using it
+        atomic_store(&ht->index_lost, 1);
+    }
+}
+
+static void begin_write(HashTable *ht, Stripe *stripe, enum LockSite site) {
+    prof_wrlock(&stripe->lock, site);
+    // Backups still need the stripe as it was, copy it before it changes
+    for (Snapshot *snap = ht->snapshots; snap != NULL; snap = snap->next) {
+        capture_stripe(snap, (size_t)(stripe - ht->stripes), stripe);
+    }
+    unsigned int seq = atomic_load_explicit(&stripe->seq, memory_order_relaxed);
+    atomic_store_explicit(&stripe->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void end_write(Stripe *stripe) {
+    unsigned int seq = atomic_load_explicit(&stripe->seq, memory_order_relaxed);
+    atomic_store_explicit(&stripe->seq, seq + 1, memory_order_release);
+    prof_rwunlock(&stripe->lock);
+}
+
+// Copies the value found in a segment to the caller's buffer.
+// @return 1 if a value was copied, 0 if found is NULL.
+static int copy_value(const char *found, char *value, size_t size) {
+    if (found == NULL) return 0;
+    // Values are bounded by MAX_STRING_SIZE, never scan further than that
+    size_t len = strnlen(found, (size < MAX_STRING_SIZE ? size : MAX_STRING_SIZE) - 1);
+    memcpy(value, found, len);
+    value[len] = '\0';
+    return 1;
+}
+
+// Hands a single pair to the change log, in the array form it expects.
+static void log_pair(HashTable *ht, const char *key, const char *value) {
+    char keys[1][MAX_STRING_SIZE];
+    char values[1][MAX_STRING_SIZE];
+    size_t len = strnlen(key, MAX_STRING_SIZE - 1);
+    memcpy(keys[0], key, len);
+    keys[0][len] = '\0';
+    if (value != NULL) {
+        len = strnlen(value, MAX_STRING_SIZE - 1);
+        memcpy(values[0], value, len);
+        values[0][len] = '\0';
+    }
+    ht->log.append(1, keys, value != NULL ? values : NULL, ht->log.arg);
+}
+
 int write_pair(HashTable *ht, const char *key, const char *value) {
-    pthread_mutex_lock(&kvs_mutex);
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            pthread_mutex_unlock(&kvs_mutex);
+    uint64_t h = kvs_hash(key);
+    Stripe *stripe = stripe_of(ht, h);
+    begin_write(ht, stripe, LOCK_WRITE);
+    int result = segment_put(stripe->segment, h, key, value);
+    if (result == 0 && stripe->index != NULL) index_change(ht, stripe, h, key, 0);
+    if (result == 0 && ht->track_changes) record_change(ht, stripe, h, key);
+    if (result == 0 && ht->log.append != NULL) log_pair(ht, key, value);
+    if (result == 0 && notify_watched(h)) notify_publish(h, key, value);
+    end_write(stripe);
+    return result;
+}
+
+int read_pair(HashTable *ht, const char *key, char *value, size_t size) {
+    uint64_t h = kvs_hash(key);
+    Stripe *stripe = stripe_of(ht, h);
+
+    epoch_enter();
+    for (int attempt = 0; attempt < KVS_READ_RETRIES; attempt++) {
+        unsigned int seq = atomic_load_explicit(&stripe->seq, memory_order_acquire);
+        if (seq & 1) continue; // A writer is changing the stripe
+        int found = copy_value(segment_find(stripe->segment, h, key), value, size);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&stripe->seq, memory_order_relaxed) == seq) {
+            epoch_exit();
+            return !found;
+        }
+    }
+    epoch_exit();
+
+    // The stripe kept changing, wait for the writers behind the lock
+    prof_rdlock(&stripe->lock, LOCK_READ);
+    int found = copy_value(segment_find(stripe->segment, h, key), value, size);
+    prof_rwunlock(&stripe->lock);
+    return !found;
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+    uint64_t h = kvs_hash(key);
+    Stripe *stripe = stripe_of(ht, h);
+    begin_write(ht, stripe, LOCK_DELETE);
+    int result = segment_remove(stripe->segment, h, key);
+    if (result == 0 && stripe->index != NULL) index_change(ht, stripe, h, key, 1);
+    if (result == 0 && ht->track_changes) record_change(ht, stripe, h, key);
+    if (result == 0 && ht->log.append != NULL) log_pair(ht, key, NULL);
+    if (result == 0 && notify_watched(h)) notify_publish(h, key, NULL);
+    end_write(stripe);
+    return result;
+}
+
+// The keys of a batch grouped by stripe: order lists the key indices of each
+// involved stripe, stripes in ascending order and keys of the same stripe in
+// command order, so repeated keys are applied in the order they were given.
+typedef struct Batch {
+    size_t num_stripes;
+    unsigned int stripes[KVS_STRIPES];
+    size_t first[KVS_STRIPES + 1];  // Keys of stripes[s] are order[first[s]..first[s + 1]]
+} Batch;
+
+static void group_by_stripe(Batch *batch, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                            uint64_t hashes[], size_t order[]) {
+    size_t count[KVS_STRIPES] = {0};
+    for (size_t i = 0; i < num_keys; i++) {
+        hashes[i] = kvs_hash(keys[i]);
+        count[hashes[i] & (KVS_STRIPES - 1)]++;
+    }
+
+    size_t next[KVS_STRIPES];
+    size_t pos = 0;
+    batch->num_stripes = 0;
+    for (unsigned int s = 0; s < KVS_STRIPES; s++) {
+        next[s] = pos;
+        if (count[s] == 0) continue;
+        batch->first[batch->num_stripes] = pos;
+        batch->stripes[batch->num_stripes++] = s;
+        pos += count[s];
+    }
+    batch->first[batch->num_stripes] = pos;
+
+    for (size_t i = 0; i < num_keys; i++) {
+        order[next[hashes[i] & (KVS_STRIPES - 1)]++] = i;
+    }
+}
+
+// Takes the write lock of every stripe of the batch, in stripe order like
+// rdlock_table, so batches and table-wide lockers never deadlock. All the
+// stripes stay odd until the whole batch is applied, so readers either see
+// all of it or none of it.
+static void begin_batch_write(HashTable *ht, const Batch *batch, enum LockSite site) {
+    for (size_t s = 0; s < batch->num_stripes; s++) {
+        begin_write(ht, &ht->stripes[batch->stripes[s]], site);
+    }
+}
+
+static void end_batch_write(HashTable *ht, const Batch *batch) {
+    for (size_t s = batch->num_stripes; s > 0; s--) {
+        end_write(&ht->stripes[batch->stripes[s - 1]]);
+    }
+}
+
+int write_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                char values[][MAX_STRING_SIZE], char failed[]) {
+    if (num_pairs == 0) return 0;
+    Batch batch;
+    uint64_t hashes[num_pairs];
+    size_t order[num_pairs];
+    group_by_stripe(&batch, num_pairs, keys, hashes, order);
+
+    int result = 0;
+    begin_batch_write(ht, &batch, LOCK_WRITE);
+    for (size_t s = 0; s < batch.num_stripes; s++) {
+        Stripe *stripe = &ht->stripes[batch.stripes[s]];
+        for (size_t k = batch.first[s]; k < batch.first[s + 1]; k++) {
+            size_t i = order[k];
+            failed[i] = segment_put(stripe->segment, hashes[i], keys[i], values[i]) != 0;
+            result |= failed[i];
+            if (!failed[i] && stripe->index != NULL) index_change(ht, stripe, hashes[i], keys[i], 0);
+            if (!failed[i] && ht->track_changes) record_change(ht, stripe, hashes[i], keys[i]);
+            if (!failed[i] && notify_watched(hashes[i])) notify_publish(hashes[i], keys[i], values[i]);
+        }
+    }
+    // Logged while the stripes are locked, so the log has the changes of a
+    // key in the order they were applied
+    if (ht->log.append != NULL) ht->log.append(num_pairs, keys, values, ht->log.arg);
+    end_batch_write(ht, &batch);
+    return result;
+}
+
+static void read_batch(HashTable *ht, const Batch *batch, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE], char missing[],
+                       const uint64_t hashes[], const size_t order[]) {
+    for (size_t s = 0; s < batch->num_stripes; s++) {
+        Segment *segment = ht->stripes[batch->stripes[s]].segment;
+        for (size_t k = batch->first[s]; k < batch->first[s + 1]; k++) {
+            size_t i = order[k];
+            missing[i] = !copy_value(segment_find(segment, hashes[i], keys[i]), values[i], MAX_STRING_SIZE);
+        }
+    }
+}
+
+int read_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+               char values[][MAX_STRING_SIZE], char missing[]) {
+    if (num_pairs == 0) return 0;
+    Batch batch;
+    uint64_t hashes[num_pairs];
+    size_t order[num_pairs];
+    unsigned int seqs[KVS_STRIPES];
+    group_by_stripe(&batch, num_pairs, keys, hashes, order);
+
+    // Same as read_pair, but the batch is only kept if none of its stripes
+    // changed, so it is consistent with every batch written concurrently
+    epoch_enter();
+    for (int attempt = 0; attempt < KVS_READ_RETRIES; attempt++) {
+        int busy = 0;
+        for (size_t s = 0; s < batch.num_stripes && !busy; s++) {
+            seqs[s] = atomic_load_explicit(&ht->stripes[batch.stripes[s]].seq, memory_order_acquire);
+            busy = seqs[s] & 1;
+        }
+        if (busy) continue;
+
+        read_batch(ht, &batch, keys, values, missing, hashes, order);
+        atomic_thread_fence(memory_order_acquire);
+        size_t s = 0;
+        while (s < batch.num_stripes &&
+               atomic_load_explicit(&ht->stripes[batch.stripes[s]].seq, memory_order_relaxed) == seqs[s]) {
+            s++;
+        }
+        if (s == batch.num_stripes) {
+            epoch_exit();
             return 0;
         }
-        keyNode = keyNode->next; // Move to the next node
     }
+    epoch_exit();
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
-    pthread_mutex_unlock(&kvs_mutex);
+    // Some stripe kept changing, wait for the writers behind the locks
+    for (size_t s = 0; s < batch.num_stripes; s++) {
+        prof_rdlock(&ht->stripes[batch.stripes[s]].lock, LOCK_READ);
+    }
+    read_batch(ht, &batch, keys, values, missing, hashes, order);
+    for (size_t s = batch.num_stripes; s > 0; s--) {
+        prof_rwunlock(&ht->stripes[batch.stripes[s - 1]].lock);
+    }
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    pthread_mutex_lock(&kvs_mutex);
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value = NULL;
+int delete_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE], char missing[]) {
+    if (num_pairs == 0) return 0;
+    Batch batch;
+    uint64_t hashes[num_pairs];
+    size_t order[num_pairs];
+    group_by_stripe(&batch, num_pairs, keys, hashes, order);
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            break;
+    begin_batch_write(ht, &batch, LOCK_DELETE);
+    for (size_t s = 0; s < batch.num_stripes; s++) {
+        Stripe *stripe = &ht->stripes[batch.stripes[s]];
+        for (size_t k = batch.first[s]; k < batch.first[s + 1]; k++) {
+            size_t i = order[k];
+            missing[i] = segment_remove(stripe->segment, hashes[i], keys[i]) != 0;
+            if (!missing[i] && stripe->index != NULL) index_change(ht, stripe, hashes[i], keys[i], 1);
+            if (!missing[i] && ht->track_changes) record_change(ht, stripe, hashes[i], keys[i]);
+            if (!missing[i] && notify_watched(hashes[i])) notify_publish(hashes[i], keys[i], NULL);
         }
-        keyNode = keyNode->next; // Move to the next node
     }
-    pthread_mutex_unlock(&kvs_mutex);
-    return value; // Return copy of the value if found, or NULL if not found
+    if (ht->log.append != NULL) ht->log.append(num_pairs, keys, NULL, ht->log.arg);
+    end_batch_write(ht, &batch);
+    return 0;
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    pthread_mutex_lock(&kvs_mutex);
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
-
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+void set_change_log(HashTable *ht, const ChangeLog *log) {
+    ht->log = *log;
+}
+
+void set_change_tracking(HashTable *ht, int enabled) {
+    ht->track_changes = enabled;
+}
+
+static void index_pair(const char *key, const char *value, void *arg) {
+    (void)value;
+    Stripe *stripe = arg;
+    if (stripe->index == NULL) return;
+    if (skiplist_insert(stripe->index, key, kvs_hash(key)) != 0) {
+        skiplist_destroy(stripe->index);
+        stripe->index = NULL;
+    }
+}
+
+int set_ordered_index(HashTable *ht, int enabled) {
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        Stripe *stripe = &ht->stripes[i];
+        if (enabled && stripe->index == NULL) {
+            // The pairs already in the table are indexed too
+            stripe->index = skiplist_create();
+            if (stripe->index != NULL) segment_for_each(stripe->segment, index_pair, stripe);
+            if (stripe->index == NULL) {
+                set_ordered_index(ht, 0);
+                return 1;
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            pthread_mutex_unlock(&kvs_mutex);
-            return 0; // Exit the function
+        } else if (!enabled && stripe->index != NULL) {
+            skiplist_destroy(stripe->index);
+            stripe->index = NULL;
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
     }
-    pthread_mutex_unlock(&kvs_mutex);
-    return 1;
+    atomic_store(&ht->index_lost, 0);
+    return 0;
 }
 
-void free_table(HashTable *ht) {
-    pthread_mutex_lock(&kvs_mutex);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+void trim_changes(HashTable *ht, uint64_t generation) {
+    prof_mutex_lock(&ht->snapshot_mutex, LOCK_TRIM);
+    // Deltas still being captured need the changes after their base
+    for (Snapshot *snap = ht->snapshots; snap != NULL; snap = snap->next) {
+        if (snap->base > 0 && snap->base < generation) generation = snap->base;
+    }
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        Stripe *stripe = &ht->stripes[i];
+        prof_wrlock(&stripe->lock, LOCK_TRIM);
+        while (stripe->num_changes > 0 && stripe->changes[stripe->first_change].generation <= generation) {
+            stripe->first_change++;
+            stripe->num_changes--;
         }
+        if (stripe->num_changes == 0) stripe->first_change = 0;
+        prof_rwunlock(&stripe->lock);
+    }
+    prof_mutex_unlock(&ht->snapshot_mutex);
+}
+
+static void lock_table(HashTable *ht, enum LockSite site) {
+    // Always in stripe order, so two table-wide lockers never deadlock
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        prof_rdlock(&ht->stripes[i].lock, site);
+    }
+}
+
+void rdlock_table(HashTable *ht) {
+    lock_table(ht, LOCK_SHOW);
+}
+
+void unlock_table(HashTable *ht) {
+    for (int i = KVS_STRIPES - 1; i >= 0; i--) {
+        prof_rwunlock(&ht->stripes[i].lock);
+    }
+}
+
+Snapshot *snapshot_create(HashTable *ht, uint64_t base) {
+    Snapshot *snap = calloc(1, sizeof(Snapshot));
+    if (snap == NULL) return NULL;
+
+    // No writer is halfway through a change while every stripe is read
+    // locked, and every writer after this sees the snapshot in the list
+    prof_mutex_lock(&ht->snapshot_mutex, LOCK_BACKUP);
+    lock_table(ht, LOCK_BACKUP);
+    snap->next = ht->snapshots;
+    ht->snapshots = snap;
+    snap->generation = ht->generation++;
+    // A delta needs every change since its base, or it becomes a full copy
+    if (ht->track_changes && base > 0 && base < snap->generation && base >= atomic_load(&ht->changes_lost)) {
+        snap->base = base;
+    }
+    if (ht->log.position != NULL) snap->log_position = ht->log.position(ht->log.arg);
+    unlock_table(ht);
+    prof_mutex_unlock(&ht->snapshot_mutex);
+    return snap;
+}
+
+int snapshot_capture(HashTable *ht, Snapshot *snap) {
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        prof_rdlock(&ht->stripes[i].lock, LOCK_BACKUP);
+        capture_stripe(snap, i, &ht->stripes[i]);
+        prof_rwunlock(&ht->stripes[i].lock);
     }
+
+    prof_mutex_lock(&ht->snapshot_mutex, LOCK_BACKUP);
+    lock_table(ht, LOCK_BACKUP);
+    Snapshot **link = &ht->snapshots;
+    while (*link != snap) link = &(*link)->next;
+    *link = snap->next;
+    unlock_table(ht);
+    prof_mutex_unlock(&ht->snapshot_mutex);
+    return snap->failed;
+}
+
+void snapshot_for_each(Snapshot *snap, void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        const char *p = snap->pairs[i];
+        const char *end = p + snap->size[i];
+        while (p < end) {
+            const char *value = p + strlen(p) + 1;
+            fn(p, value, arg);
+            p = value + strlen(value) + 1;
+        }
+        p = snap->deleted[i];
+        end = p + snap->deleted_size[i];
+        while (p < end) {
+            fn(p, NULL, arg);
+            p += strlen(p) + 1;
+        }
+    }
+}
+
+uint64_t snapshot_generation(Snapshot *snap) {
+    return snap->generation;
+}
+
+int snapshot_is_delta(Snapshot *snap) {
+    return snap->base > 0;
+}
+
+uint64_t snapshot_log_position(Snapshot *snap) {
+    return snap->log_position;
+}
+
+void snapshot_free(Snapshot *snap) {
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        free(snap->pairs[i]);
+        free(snap->deleted[i]);
+    }
+    free(snap);
+}
+
+void for_each_pair(HashTable *ht, void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        segment_for_each(ht->stripes[i].segment, fn, arg);
+    }
+}
+
+// Min-heap of the stripe index cursors, ordered by their current key
+typedef struct IndexMerge {
+    const SkipNode *nodes[KVS_STRIPES];
+    Stripe *stripes[KVS_STRIPES];
+    size_t size;
+} IndexMerge;
+
+static void merge_sift_down(IndexMerge *merge, size_t i) {
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < merge->size && strcmp(merge->nodes[left]->key, merge->nodes[smallest]->key) < 0) smallest = left;
+        if (right < merge->size && strcmp(merge->nodes[right]->key, merge->nodes[smallest]->key) < 0) smallest = right;
+        if (smallest == i) return;
+        const SkipNode *node = merge->nodes[i];
+        Stripe *stripe = merge->stripes[i];
+        merge->nodes[i] = merge->nodes[smallest];
+        merge->stripes[i] = merge->stripes[smallest];
+        merge->nodes[smallest] = node;
+        merge->stripes[smallest] = stripe;
+        i = smallest;
+    }
+}
+
+// Streams the pairs in order by merging the sorted keys of every stripe.
+static void for_each_indexed(HashTable *ht, const char *start, const char *end,
+                             void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    IndexMerge merge;
+    merge.size = 0;
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        const SkipNode *node = skiplist_seek(ht->stripes[i].index, start);
+        if (node == NULL) continue;
+        merge.nodes[merge.size] = node;
+        merge.stripes[merge.size++] = &ht->stripes[i];
+    }
+    for (size_t i = merge.size / 2; i > 0; i--) merge_sift_down(&merge, i - 1);
+
+    while (merge.size > 0) {
+        const SkipNode *node = merge.nodes[0];
+        if (end != NULL && strcmp(node->key, end) > 0) return;
+        const char *value = segment_find(merge.stripes[0]->segment, node->hash, node->key);
+        if (value != NULL) fn(node->key, value, arg);
+        if (node->next[0] != NULL) {
+            merge.nodes[0] = node->next[0];
+        } else {
+            merge.size--;
+            merge.nodes[0] = merge.nodes[merge.size];
+            merge.stripes[0] = merge.stripes[merge.size];
+        }
+        merge_sift_down(&merge, 0);
+    }
+}
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Same as for_each_indexed for a table without a usable index: the pairs
+// are copied and sorted first.
+static int for_each_sorted_copy(HashTable *ht, const char *start, const char *end,
+                                void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    PairBuffer pairs = {NULL, 0, 0, 0};
+    for (size_t i = 0; i < KVS_STRIPES; i++) {
+        segment_for_each(ht->stripes[i].segment, append_pair, &pairs);
+    }
+    size_t count = 0;
+    for (const char *p = pairs.data; p < pairs.data + pairs.size; p += strlen(p) + 1) count++;
+    const char **keys = malloc((count / 2 + 1) * sizeof(char *));
+    if (pairs.failed || keys == NULL) {
+        free(pairs.data);
+        free(keys);
+        return 1;
+    }
+
+    size_t num_keys = 0;
+    for (const char *p = pairs.data; p < pairs.data + pairs.size;) {
+        const char *value = p + strlen(p) + 1;
+        if ((start == NULL || strcmp(p, start) >= 0) && (end == NULL || strcmp(p, end) <= 0)) {
+            keys[num_keys++] = p;
+        }
+        p = value + strlen(value) + 1;
+    }
+    qsort(keys, num_keys, sizeof(char *), compare_keys);
+    for (size_t i = 0; i < num_keys; i++) {
+        fn(keys[i], keys[i] + strlen(keys[i]) + 1, arg);
+    }
+    free(keys);
+    free(pairs.data);
+    return 0;
+}
+
+int for_each_pair_sorted(HashTable *ht, const char *start, const char *end,
+                         void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    if (ht->stripes[0].index == NULL || atomic_load(&ht->index_lost)) {
+        return for_each_sorted_copy(ht, start, end, fn, arg);
+    }
+    for_each_indexed(ht, start, end, fn, arg);
+    return 0;
+}
+
+void free_table(HashTable *ht) {
+    // No reader is left, so memory retired by the writers can go right away.
+    // It may live in the segments, so it goes before them.
+    epoch_drain();
+    for (int i = 0; i < KVS_STRIPES; i++) {
+        if (ht->stripes[i].index != NULL) skiplist_destroy(ht->stripes[i].index);
+        segment_destroy(ht->stripes[i].segment);
+        pthread_rwlock_destroy(&ht->stripes[i].lock);
+        free(ht->stripes[i].changes);
+        free(ht->stripes[i].recorded);
+    }
+    pthread_mutex_destroy(&ht->snapshot_mutex);
     free(ht);
-    pthread_mutex_unlock(&kvs_mutex);
-}
\ No newline at end of file
+}
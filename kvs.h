@@ -1,19 +1,28 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
-
 #include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// The table is split into lock stripes, each backed by a storage engine
+// segment (see kvs_engine.h). Its layout is private to kvs.c.
+typedef struct HashTable HashTable;
 
-typedef struct KeyNode {
-    char *key;
-    char *value;
-    struct KeyNode *next;
-} KeyNode;
+// A point-in-time copy of the table, see snapshot_create.
+typedef struct Snapshot Snapshot;
 
-typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-} HashTable;
+// Receives every change made to the table, e.g. to keep a write-ahead log.
+// append is called with the stripes of the change still write locked, so the
+// changes of a key reach it in the order they were applied. values is NULL
+// for deletes. position returns the current log position; snapshots record
+// it, which tells how much of the log they already contain.
+typedef struct ChangeLog {
+    void (*append)(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], void *arg);
+    uint64_t (*position)(void *arg);
+    void *arg;
+} ChangeLog;
 
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
@@ -26,11 +35,15 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-/// Deletes the value of given key.
-/// @param ht Hash table to delete from.
-/// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-char* read_pair(HashTable *ht, const char *key);
+/// Reads the value of a given key.
+/// The value is copied into the caller's buffer while the stripe lock is held,
+/// so no memory is allocated.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param value Buffer where the value is copied to, truncated to size - 1 characters.
+/// @param size Size of the value buffer, must be at least 1.
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, const char *key, char *value, size_t size);
 
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
@@ -38,6 +51,137 @@ char* read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Writes a batch of pairs, taking each stripe lock once.
+/// The pairs become visible to read_pairs all at once; pairs with the same key
+/// are applied in the order they were given.
+/// @param ht Hash table to be modified.
+/// @param num_pairs Number of pairs to write.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs.
+/// @param failed Set to 1 for every pair that could not be written, 0 otherwise.
+/// @return 0 if every pair was written, 1 otherwise.
+int write_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                char values[][MAX_STRING_SIZE], char failed[]);
+
+/// Reads a batch of keys, consistent with every concurrent write_pairs or
+/// delete_pairs call.
+/// @param ht Hash table to read from.
+/// @param num_pairs Number of keys to read.
+/// @param keys Keys to read.
+/// @param values Buffers where the values are copied to.
+/// @param missing Set to 1 for every key that was not found, 0 otherwise.
+/// @return 0.
+int read_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+               char values[][MAX_STRING_SIZE], char missing[]);
+
+/// Deletes a batch of keys, taking each stripe lock once.
+/// @param ht Hash table to be modified.
+/// @param num_pairs Number of keys to delete.
+/// @param keys Keys to delete.
+/// @param missing Set to 1 for every key that was not found, 0 otherwise.
+/// @return 0.
+int delete_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE], char missing[]);
+
+/// Sets the change log of the table. Must be called before other threads
+/// use the table.
+/// @param ht Hash table to be logged.
+/// @param log Functions called on every change.
+void set_change_log(HashTable *ht, const ChangeLog *log);
+
+/// Turns on recording the keys changed in each generation, needed for delta
+/// snapshots. Must be called before other threads use the table.
+/// @param ht Hash table to track.
+/// @param enabled 1 to record changes, 0 not to.
+void set_change_tracking(HashTable *ht, int enabled);
+
+/// Keeps the keys of every stripe in a skip list as well, so that
+/// for_each_pair_sorted streams them in order instead of sorting a copy.
+/// Writes pay an ordered insert or remove for it. Pairs already in the table
+/// are indexed. Must be called before other threads use the table.
+/// @param ht Hash table to index.
+/// @param enabled 1 to keep the index, 0 to drop it.
+/// @return 0 on success, 1 if the index could not be built.
+int set_ordered_index(HashTable *ht, int enabled);
+
+/// Forgets the changes recorded up to a generation, once no delta will be
+/// taken with a base older than it. Deltas still being captured are kept whole.
+/// @param ht Hash table to trim.
+/// @param generation Oldest base a later delta may use.
+void trim_changes(HashTable *ht, uint64_t generation);
+
+/// Takes the read lock of every stripe, in stripe order.
+/// @param ht Hash table to be locked.
+void rdlock_table(HashTable *ht);
+
+/// Releases the locks taken by rdlock_table.
+/// @param ht Hash table to be unlocked.
+void unlock_table(HashTable *ht);
+
+/// Calls fn for every pair in the table, in stripe order.
+/// The caller must hold the table locks (see rdlock_table).
+/// @param ht Hash table to iterate.
+/// @param fn Function called with each key and value.
+/// @param arg Extra argument passed to fn.
+void for_each_pair(HashTable *ht, void (*fn)(const char *key, const char *value, void *arg), void *arg);
+
+/// Calls fn for every pair with start <= key <= end, in strcmp order of the
+/// keys. Uses the ordered index (see set_ordered_index) when the table has
+/// one, otherwise copies and sorts the pairs.
+/// The caller must hold the table locks (see rdlock_table).
+/// @param ht Hash table to iterate.
+/// @param start Smallest key, NULL for no lower bound.
+/// @param end Largest key, NULL for no upper bound.
+/// @param fn Function called with each key and value.
+/// @param arg Extra argument passed to fn.
+/// @return 0 on success, 1 if the pairs could not be sorted.
+int for_each_pair_sorted(HashTable *ht, const char *start, const char *end,
+                         void (*fn)(const char *key, const char *value, void *arg), void *arg);
+
+/// Takes a snapshot of the table as it is now. Writers keep going: each
+/// stripe is copied before its first change, or by snapshot_capture.
+/// With change tracking on and a base generation, the snapshot is a delta: it
+/// only holds the keys changed since the snapshot of that generation, with
+/// their value or as deleted. It is a full copy otherwise, or if some change
+/// since base could not be recorded (see snapshot_is_delta).
+/// @param ht Hash table to snapshot.
+/// @param base Generation of an earlier snapshot, 0 for a full copy.
+/// @return Newly created snapshot, NULL on failure.
+Snapshot *snapshot_create(HashTable *ht, uint64_t base);
+
+/// Copies the stripes that no writer has copied yet. Must be called once
+/// before snapshot_for_each; until then writers copy the stripes they change.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snap Snapshot to complete.
+/// @return 0 if every stripe was copied, 1 if some ran out of memory.
+int snapshot_capture(HashTable *ht, Snapshot *snap);
+
+/// Calls fn for every pair in the snapshot, in stripe order. For a delta,
+/// fn is also called with a NULL value for every deleted key.
+/// @param snap Snapshot to iterate, completed by snapshot_capture.
+/// @param fn Function called with each key and value.
+/// @param arg Extra argument passed to fn.
+void snapshot_for_each(Snapshot *snap, void (*fn)(const char *key, const char *value, void *arg), void *arg);
+
+/// Returns the generation of a snapshot, the base of later deltas.
+/// @param snap Snapshot to query.
+/// @return Generation, increasing with every snapshot of the table.
+uint64_t snapshot_generation(Snapshot *snap);
+
+/// Tells whether a snapshot is a delta or a full copy.
+/// @param snap Snapshot to query.
+/// @return 1 for a delta, 0 for a full copy.
+int snapshot_is_delta(Snapshot *snap);
+
+/// Returns the change log position when the snapshot was taken: the
+/// snapshot contains every change logged before it and none after it.
+/// @param snap Snapshot to query.
+/// @return Log position, 0 if the table has no change log.
+uint64_t snapshot_log_position(Snapshot *snap);
+
+/// Frees a snapshot completed by snapshot_capture.
+/// @param snap Snapshot to be freed.
+void snapshot_free(Snapshot *snap);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
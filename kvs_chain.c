@@ -0,0 +1,302 @@
+// Chained storage engine: every segment is a table of linked lists that
+// grows incrementally. When its load factor is exceeded it allocates a table
+// twice as large and every write migrates KVS_REHASH_STEP buckets, so no
+// single operation rehashes the whole segment.
+//
+// Readers walk the lists without a lock, so writers publish nodes, values and
+// tables with release stores and retire what they unlink through the epoch.
+// Nodes come from a slab of the segment (see slab.h) and only hold what a
+// probe compares: the full hash, the length and the first bytes of the key,
+// so a walk past a node never leaves the chain. The key and the value live
+// in an entry of another slab, inline when they are short and otherwise in
+// MAX_STRING_SIZE strings of a third one.
+// A value that fits the buffer it replaces is overwritten in place; a reader
+// may see it halfway, which kvs.c discards, and the last byte of every value
+// buffer stays '\0' so such a read never runs past it.
+
+#include "kvs_engine.h"
+#include "constants.h"
+#include "epoch.h"
+#include "slab.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KVS_INITIAL_BUCKETS 8  // Buckets per segment, power of two
+#ifndef KVS_MAX_LOAD_FACTOR
+#define KVS_MAX_LOAD_FACTOR 2  // Pairs per bucket before growing
+#endif
+#define KVS_REHASH_STEP 4      // Buckets migrated per write
+#define KVS_KEY_PREFIX 7       // Key bytes kept in the node
+#define KVS_INLINE_KEY 24      // Keys shorter than this are stored in the entry
+#define KVS_INLINE_VALUE 24    // Same for values
+
+// Key and value of a node, one cache line
+typedef struct Entry {
+    _Atomic(char *) value;      // inline_value or a string of the slab
+    char *key;                  // inline_key or a string of the slab
+    char inline_key[KVS_INLINE_KEY];
+    char inline_value[KVS_INLINE_VALUE];
+} Entry;
+
+// 32 bytes, two per cache line
+typedef struct KeyNode {
+    uint64_t hash;  // Full hash of key, so migration never rehashes strings
+    _Atomic(struct KeyNode *) next;
+    Entry *entry;   // Set before the node is published, never replaced
+    unsigned char key_len;
+    char prefix[KVS_KEY_PREFIX];  // Whole key if it is that short
+} KeyNode;
+
+_Static_assert(sizeof(KeyNode) == 32, "a chain node is half a cache line");
+_Static_assert(sizeof(Entry) == 64, "an entry is one cache line");
+
+// Buckets and their count live in one allocation, so a reader that loads a
+// table pointer always sees the matching size.
+typedef struct Table {
+    size_t size;
+    _Atomic(KeyNode *) buckets[];
+} Table;
+
+struct Segment {
+    _Atomic(Table *) tables[2];  // [0] current table, [1] target table while resizing
+    size_t count;                // Number of pairs in the segment
+    size_t rehash_index;         // Next bucket of tables[0] to migrate
+    Slab nodes;
+    Slab entries;
+    Slab strings;  // Keys and values too long to be inline
+};
+
+// Shorthands for the accesses made by the writer, which holds the stripe lock
+#define PEEK(p) atomic_load_explicit(&(p), memory_order_relaxed)
+#define PUBLISH(p, v) atomic_store_explicit(&(p), (v), memory_order_release)
+#define LOAD(p) atomic_load_explicit(&(p), memory_order_acquire)
+
+static size_t bucket_of(uint64_t h, size_t size) {
+    return (size_t)SEGMENT_HASH(h) & (size - 1);
+}
+
+static Table *table_create(size_t size) {
+    Table *table = malloc(sizeof(Table) + size * sizeof(table->buckets[0]));
+    if (table == NULL) return NULL;
+    table->size = size;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&table->buckets[i], NULL);
+    }
+    return table;
+}
+
+// Copies a string into the inline buffer if it fits, or into a new string.
+static char *string_create(Segment *segment, char *inline_buffer, size_t inline_size, const char *s, size_t len) {
+    char *copy = inline_buffer;
+    size_t size = inline_size;
+    if (len >= inline_size) {
+        copy = slab_alloc(&segment->strings);
+        if (copy == NULL) return NULL;
+        size = segment->strings.object_size;
+    }
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    copy[size - 1] = '\0';
+    return copy;
+}
+
+static void entry_free(Entry *entry) {
+    if (entry->key != NULL && entry->key != entry->inline_key) slab_free(entry->key);
+    char *value = PEEK(entry->value);
+    if (value != NULL && value != entry->inline_value) slab_free(value);
+    slab_free(entry);
+}
+
+static void node_free(void *ptr) {
+    KeyNode *keyNode = (KeyNode *)ptr;
+    entry_free(keyNode->entry);
+    slab_free(keyNode);
+}
+
+// Integer compares first, then the prefix in the node; the entry is only
+// read for the rest of a longer key once all of those match.
+static int node_matches(const KeyNode *keyNode, uint64_t h, const char *key, size_t len) {
+    if (keyNode->hash != h || keyNode->key_len != len) return 0;
+    if (len <= KVS_KEY_PREFIX) return memcmp(keyNode->prefix, key, len) == 0;
+    return memcmp(keyNode->prefix, key, KVS_KEY_PREFIX) == 0 &&
+           memcmp(keyNode->entry->key + KVS_KEY_PREFIX, key + KVS_KEY_PREFIX, len - KVS_KEY_PREFIX) == 0;
+}
+
+// Moves up to KVS_REHASH_STEP buckets from the old table to the new one.
+static void rehash_step(Segment *segment) {
+    Table *from = PEEK(segment->tables[0]);
+    Table *to = PEEK(segment->tables[1]);
+    if (to == NULL) return;
+
+    for (int step = 0; step < KVS_REHASH_STEP && segment->rehash_index < from->size; step++) {
+        KeyNode *keyNode = PEEK(from->buckets[segment->rehash_index]);
+        while (keyNode != NULL) {
+            KeyNode *next = PEEK(keyNode->next);
+            size_t index = bucket_of(keyNode->hash, to->size);
+            PUBLISH(keyNode->next, PEEK(to->buckets[index]));
+            PUBLISH(to->buckets[index], keyNode);
+            keyNode = next;
+        }
+        PUBLISH(from->buckets[segment->rehash_index++], NULL);
+    }
+
+    if (segment->rehash_index == from->size) {
+        // Migration finished, the new table becomes the current one
+        PUBLISH(segment->tables[0], to);
+        PUBLISH(segment->tables[1], NULL);
+        segment->rehash_index = 0;
+        epoch_retire(from, free);
+    }
+}
+
+// Starts growing the segment if its load factor was exceeded.
+static void maybe_grow(Segment *segment) {
+    Table *current = PEEK(segment->tables[0]);
+    if (PEEK(segment->tables[1]) != NULL || segment->count <= current->size * KVS_MAX_LOAD_FACTOR) return;
+
+    Table *table = table_create(current->size * 2);
+    if (table == NULL) return; // Keep working with longer chains
+    segment->rehash_index = 0;
+    PUBLISH(segment->tables[1], table);
+}
+
+// Finds the link that points to the node of key. Only used by the writer.
+static _Atomic(KeyNode *) *find_link(Segment *segment, uint64_t h, const char *key, size_t len) {
+    for (int t = 0; t < 2; t++) {
+        Table *table = PEEK(segment->tables[t]);
+        if (table == NULL) break;
+        _Atomic(KeyNode *) *link = &table->buckets[bucket_of(h, table->size)];
+        for (KeyNode *keyNode = PEEK(*link); keyNode != NULL; keyNode = PEEK(*link)) {
+            if (node_matches(keyNode, h, key, len)) return link;
+            link = &keyNode->next;
+        }
+    }
+    return NULL;
+}
+
+Segment *segment_create(void) {
+    Segment *segment = malloc(sizeof(Segment));
+    if (segment == NULL) return NULL;
+    Table *table = table_create(KVS_INITIAL_BUCKETS);
+    if (table == NULL) {
+        free(segment);
+        return NULL;
+    }
+    atomic_init(&segment->tables[0], table);
+    atomic_init(&segment->tables[1], NULL);
+    segment->count = 0;
+    segment->rehash_index = 0;
+    slab_init(&segment->nodes, sizeof(KeyNode));
+    slab_init(&segment->entries, sizeof(Entry));
+    slab_init(&segment->strings, MAX_STRING_SIZE);
+    return segment;
+}
+
+const char *segment_find(Segment *segment, uint64_t h, const char *key) {
+    size_t len = strlen(key);
+    size_t walked = 0;
+    // Looks at both tables while the segment is resizing
+    for (int t = 0; t < 2; t++) {
+        Table *table = LOAD(segment->tables[t]);
+        if (table == NULL) break;
+        KeyNode *keyNode = LOAD(table->buckets[bucket_of(h, table->size)]);
+        for (; keyNode != NULL; keyNode = LOAD(keyNode->next)) {
+            walked++;
+            if (node_matches(keyNode, h, key, len)) {
+                stats_lookup(walked);
+                return LOAD(keyNode->entry->value);
+            }
+        }
+    }
+    stats_lookup(walked);
+    return NULL;
+}
+
+int segment_put(Segment *segment, uint64_t h, const char *key, const char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE) return 1;
+    rehash_step(segment);
+
+    _Atomic(KeyNode *) *link = find_link(segment, h, key, key_len);
+    if (link != NULL) {
+        Entry *entry = PEEK(*link)->entry;
+        char *old = PEEK(entry->value);
+        size_t size = old == entry->inline_value ? KVS_INLINE_VALUE : segment->strings.object_size;
+        if (value_len < size) {
+            // Fits, the last byte of the buffer is left as it is
+            memcpy(old, value, value_len);
+            old[value_len] = '\0';
+            return 0;
+        }
+        // Only an inline value can be too small, it stays in the entry
+        char *copy = string_create(segment, NULL, 0, value, value_len);
+        if (copy == NULL) return 1;
+        PUBLISH(entry->value, copy);
+        return 0;
+    }
+
+    // Key not found, create a new key node
+    Entry *entry = slab_alloc(&segment->entries);
+    if (entry == NULL) return 1;
+    entry->key = string_create(segment, entry->inline_key, KVS_INLINE_KEY, key, key_len);
+    atomic_init(&entry->value, string_create(segment, entry->inline_value, KVS_INLINE_VALUE, value, value_len));
+    KeyNode *keyNode = entry->key != NULL && PEEK(entry->value) != NULL ? slab_alloc(&segment->nodes) : NULL;
+    if (keyNode == NULL) {
+        entry_free(entry);
+        return 1;
+    }
+    keyNode->hash = h;
+    keyNode->entry = entry;
+    keyNode->key_len = (unsigned char)key_len;
+    memcpy(keyNode->prefix, key, key_len < KVS_KEY_PREFIX ? key_len : KVS_KEY_PREFIX);
+
+    // New nodes go to the table that will survive the resize
+    Table *table = PEEK(segment->tables[1]);
+    if (table == NULL) table = PEEK(segment->tables[0]);
+    size_t index = bucket_of(h, table->size);
+    atomic_init(&keyNode->next, PEEK(table->buckets[index])); // Link to existing nodes
+    PUBLISH(table->buckets[index], keyNode); // Place new key node at the start of the list
+    segment->count++;
+    maybe_grow(segment);
+    return 0;
+}
+
+int segment_remove(Segment *segment, uint64_t h, const char *key) {
+    rehash_step(segment);
+
+    _Atomic(KeyNode *) *link = find_link(segment, h, key, strlen(key));
+    if (link == NULL) return 1;
+
+    // Bypass the node; readers already on it can still follow its next link
+    KeyNode *keyNode = PEEK(*link);
+    PUBLISH(*link, PEEK(keyNode->next));
+    segment->count--;
+    epoch_retire(keyNode, node_free);
+    return 0;
+}
+
+void segment_for_each(Segment *segment, void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    for (int t = 0; t < 2; t++) {
+        Table *table = PEEK(segment->tables[t]);
+        if (table == NULL) break;
+        for (size_t b = 0; b < table->size; b++) {
+            for (KeyNode *keyNode = PEEK(table->buckets[b]); keyNode != NULL; keyNode = PEEK(keyNode->next)) {
+                fn(keyNode->entry->key, PEEK(keyNode->entry->value), arg);
+            }
+        }
+    }
+}
+
+void segment_destroy(Segment *segment) {
+    free(PEEK(segment->tables[0]));
+    free(PEEK(segment->tables[1]));
+    // Every node and string goes with the chunks, no list is walked
+    slab_destroy(&segment->nodes);
+    slab_destroy(&segment->entries);
+    slab_destroy(&segment->strings);
+    free(segment);
+}
@@ -0,0 +1,68 @@
+#ifndef KVS_ENGINE_H
+#define KVS_ENGINE_H
+
+// Storage engine interface used by kvs.c.
+// kvs.c splits the table into KVS_STRIPES stripes, each with its own lock,
+// and keeps one segment per stripe. Writers are serialized: segment_put and
+// segment_remove are called with the stripe lock held in write mode, and
+// segment_for_each with it held in read mode.
+// segment_find takes no lock and may run while a writer changes the segment.
+// kvs.c discards its result if that happened, but it must never touch freed
+// memory: engines publish with release stores and hand what they unlink to
+// epoch_retire (see epoch.h) instead of freeing it.
+// The engine is chosen at build time, see KVS_ENGINE in the Makefile.
+
+#include <stdint.h>
+
+#define KVS_STRIPE_BITS 6
+#define KVS_STRIPES (1 << KVS_STRIPE_BITS)
+
+// The low KVS_STRIPE_BITS bits of a hash select the stripe, so segments must
+// only use the bits above them.
+#define SEGMENT_HASH(h) ((h) >> KVS_STRIPE_BITS)
+
+typedef struct Segment Segment;
+
+/// Hash function used to pick stripes and slots (64-bit FNV-1a).
+/// @param key String to hash.
+/// @return hash.
+uint64_t kvs_hash(const char *key);
+
+/// Creates an empty segment.
+/// @return Newly created segment, NULL on failure.
+Segment *segment_create(void);
+
+/// Finds the value stored for key.
+/// @param segment Segment to search.
+/// @param h Full hash of key.
+/// @param key Key to look up.
+/// @return Stored value, valid until the caller leaves its epoch, or NULL if not found.
+const char *segment_find(Segment *segment, uint64_t h, const char *key);
+
+/// Inserts a pair or replaces the value of an existing key.
+/// @param segment Segment to modify.
+/// @param h Full hash of key.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @return 0 on success, 1 otherwise.
+int segment_put(Segment *segment, uint64_t h, const char *key, const char *value);
+
+/// Removes a pair.
+/// @param segment Segment to modify.
+/// @param h Full hash of key.
+/// @param key Key of the pair.
+/// @return 0 if the pair was removed, 1 if it was not found.
+int segment_remove(Segment *segment, uint64_t h, const char *key);
+
+/// Calls fn for every pair of the segment.
+/// @param segment Segment to iterate.
+/// @param fn Function called with each key and value.
+/// @param arg Extra argument passed to fn.
+void segment_for_each(Segment *segment, void (*fn)(const char *key, const char *value, void *arg), void *arg);
+
+/// Frees the segment and every pair in it. Memory the segment retired must
+/// have been freed already (see epoch_drain).
+/// @param segment Segment to free.
+void segment_destroy(Segment *segment);
+
+#endif  // KVS_ENGINE_H
@@ -0,0 +1,234 @@
+// Open addressing storage engine in the style of SwissTable.
+// Keys and values are stored inline in fixed-size slots (they are bounded by
+// MAX_STRING_SIZE), next to an array of one control byte per slot. A control
+// byte holds 7 bits of the hash for a used slot, or marks it empty/deleted,
+// so a probe compares 16 control bytes at once and only touches the slots
+// whose hash bits match.
+//
+// Readers probe without a lock and may see a slot while it is rewritten;
+// kvs.c discards such reads, so the reader side only has to stay within
+// bounds. Tables are replaced as a whole on resize and retired through the
+// epoch.
+
+#include "kvs_engine.h"
+#include "constants.h"
+#include "epoch.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define GROUP_WIDTH 16              // Control bytes scanned per probe step
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+#define MAX_LOAD_NUM 7              // Grow when used slots exceed 7/8
+#define MAX_LOAD_DEN 8
+
+typedef struct Slot {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} Slot;
+
+// Slots and control bytes live in one allocation, so a reader that loads a
+// table pointer always sees the matching capacity.
+typedef struct Table {
+    size_t capacity;  // Number of slots, a power of two multiple of GROUP_WIDTH
+    uint8_t *ctrl;    // One control byte per slot, stored after the slots
+    Slot slots[];
+} Table;
+
+struct Segment {
+    _Atomic(Table *) table;
+    size_t count;       // Slots holding a pair
+    size_t tombstones;  // Slots marked CTRL_DELETED
+};
+
+static size_t h1(uint64_t h) {
+    return (size_t)(SEGMENT_HASH(h) >> 7);
+}
+
+static uint8_t h2(uint64_t h) {
+    return (uint8_t)(SEGMENT_HASH(h) & 0x7F);
+}
+
+// Bit i of the result is set when ctrl[i] == byte.
+static unsigned int group_match(const uint8_t *ctrl, uint8_t byte) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    unsigned int mask = 0;
+    for (unsigned int i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i of the result is set when ctrl[i] is empty or deleted.
+static unsigned int group_match_free(const uint8_t *ctrl) {
+#if defined(__SSE2__)
+    // Free control bytes are the only ones with the high bit set
+    __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+    return (unsigned int)_mm_movemask_epi8(group);
+#else
+    unsigned int mask = 0;
+    for (unsigned int i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Returns the slot index of key, or capacity if it is not in the table.
+// Sets *probed to the number of groups visited.
+static size_t find_slot(const Table *table, uint64_t h, const char *key, size_t *probed) {
+    size_t groups = table->capacity / GROUP_WIDTH;
+    size_t group = h1(h) & (groups - 1);
+    uint8_t tag = h2(h);
+
+    // Triangular probing visits every group once when their number is a power of two
+    for (size_t step = 1; step <= groups; step++) {
+        *probed = step;
+        const uint8_t *ctrl = &table->ctrl[group * GROUP_WIDTH];
+        for (unsigned int mask = group_match(ctrl, tag); mask != 0; mask &= mask - 1) {
+            size_t index = group * GROUP_WIDTH + (size_t)__builtin_ctz(mask);
+            // Bounded, the slot may be rewritten under a concurrent reader
+            if (strncmp(table->slots[index].key, key, MAX_STRING_SIZE) == 0) return index;
+        }
+        if (group_match(ctrl, CTRL_EMPTY) != 0) break; // The key would have been placed here
+        group = (group + step) & (groups - 1);
+    }
+    return table->capacity;
+}
+
+// Returns the first empty or deleted slot on the probe sequence of h.
+static size_t find_free_slot(const Table *table, uint64_t h) {
+    size_t groups = table->capacity / GROUP_WIDTH;
+    size_t group = h1(h) & (groups - 1);
+
+    for (size_t step = 1;; step++) {
+        unsigned int mask = group_match_free(&table->ctrl[group * GROUP_WIDTH]);
+        if (mask != 0) return group * GROUP_WIDTH + (size_t)__builtin_ctz(mask);
+        group = (group + step) & (groups - 1);
+    }
+}
+
+static Table *table_create(size_t capacity) {
+    Table *table = malloc(sizeof(Table) + capacity * (sizeof(Slot) + 1));
+    if (table == NULL) return NULL;
+    table->capacity = capacity;
+    table->ctrl = (uint8_t *)&table->slots[capacity];
+    memset(table->ctrl, CTRL_EMPTY, capacity);
+    return table;
+}
+
+// Replaces the table by one with the given capacity, dropping tombstones.
+static int resize(Segment *segment, size_t capacity) {
+    Table *old = atomic_load_explicit(&segment->table, memory_order_relaxed);
+    Table *table = table_create(capacity);
+    if (table == NULL) return 1;
+
+    for (size_t i = 0; i < old->capacity; i++) {
+        if (old->ctrl[i] & 0x80) continue;
+        // Hashes are not stored, recomputing them for the short keys is cheaper
+        uint64_t h = kvs_hash(old->slots[i].key);
+        size_t index = find_free_slot(table, h);
+        table->ctrl[index] = h2(h);
+        table->slots[index] = old->slots[i];
+    }
+    segment->tombstones = 0;
+    atomic_store_explicit(&segment->table, table, memory_order_release);
+    epoch_retire(old, free);
+    return 0;
+}
+
+Segment *segment_create(void) {
+    Segment *segment = malloc(sizeof(Segment));
+    if (segment == NULL) return NULL;
+    Table *table = table_create(GROUP_WIDTH);
+    if (table == NULL) {
+        free(segment);
+        return NULL;
+    }
+    atomic_init(&segment->table, table);
+    segment->count = 0;
+    segment->tombstones = 0;
+    return segment;
+}
+
+const char *segment_find(Segment *segment, uint64_t h, const char *key) {
+    Table *table = atomic_load_explicit(&segment->table, memory_order_acquire);
+    size_t probed = 0;
+    size_t index = find_slot(table, h, key, &probed);
+    stats_lookup(probed);
+    return index < table->capacity ? table->slots[index].value : NULL;
+}
+
+int segment_put(Segment *segment, uint64_t h, const char *key, const char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE) return 1;
+
+    Table *table = atomic_load_explicit(&segment->table, memory_order_relaxed);
+    size_t probed;
+    size_t index = find_slot(table, h, key, &probed);
+    if (index < table->capacity) {
+        memcpy(table->slots[index].value, value, value_len + 1);
+        return 0;
+    }
+
+    if ((segment->count + segment->tombstones + 1) * MAX_LOAD_DEN > table->capacity * MAX_LOAD_NUM) {
+        // Only grow when the table is really full, otherwise purging tombstones is enough
+        size_t capacity = table->capacity;
+        if ((segment->count + 1) * MAX_LOAD_DEN * 2 > capacity * MAX_LOAD_NUM) capacity *= 2;
+        if (resize(segment, capacity) != 0) return 1;
+        table = atomic_load_explicit(&segment->table, memory_order_relaxed);
+    }
+
+    index = find_free_slot(table, h);
+    if (table->ctrl[index] == CTRL_DELETED) segment->tombstones--;
+    memcpy(table->slots[index].key, key, key_len + 1);
+    memcpy(table->slots[index].value, value, value_len + 1);
+    table->ctrl[index] = h2(h);
+    segment->count++;
+    return 0;
+}
+
+int segment_remove(Segment *segment, uint64_t h, const char *key) {
+    Table *table = atomic_load_explicit(&segment->table, memory_order_relaxed);
+    size_t probed;
+    size_t index = find_slot(table, h, key, &probed);
+    if (index == table->capacity) return 1;
+
+    // A slot in a group that still has an empty slot never stopped a probe,
+    // so it can go back to empty instead of becoming a tombstone
+    size_t group = index / GROUP_WIDTH;
+    if (group_match(&table->ctrl[group * GROUP_WIDTH], CTRL_EMPTY) != 0) {
+        table->ctrl[index] = CTRL_EMPTY;
+    } else {
+        table->ctrl[index] = CTRL_DELETED;
+        segment->tombstones++;
+    }
+    segment->count--;
+    return 0;
+}
+
+void segment_for_each(Segment *segment, void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    Table *table = atomic_load_explicit(&segment->table, memory_order_relaxed);
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (!(table->ctrl[i] & 0x80)) {
+            fn(table->slots[i].key, table->slots[i].value, arg);
+        }
+    }
+}
+
+void segment_destroy(Segment *segment) {
+    free(atomic_load_explicit(&segment->table, memory_order_relaxed));
+    free(segment);
+}
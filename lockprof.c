@@ -0,0 +1,188 @@
+#include "lockprof.h"
+
+#ifdef KVS_LOCK_PROFILE
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOCKPROF_MAX_HELD 128  // Locks one thread holds at once; SHOW holds every stripe
+
+typedef struct SiteCounters {
+    _Atomic uint64_t acquired;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t wait_max;
+    _Atomic uint64_t hold_ns;
+    _Atomic uint64_t hold_max;
+} SiteCounters;
+
+typedef struct HeldLock {
+    const void *lock;
+    enum LockSite site;
+    uint64_t since;
+} HeldLock;
+
+// Counters of one thread, written only by it, like the blocks of stats.c.
+// The locks it holds are a stack: they are mostly released in reverse order.
+typedef struct ThreadLocks {
+    struct ThreadLocks *next;
+    SiteCounters sites[LOCK_SITES];
+    HeldLock held[LOCKPROF_MAX_HELD];
+    size_t num_held;
+} ThreadLocks;
+
+static const char *const site_names[LOCK_SITES] = {"write", "read", "delete", "show", "backup", "trim", "terminate"};
+
+static _Atomic(ThreadLocks *) all_threads = NULL;
+static _Thread_local ThreadLocks *local_locks = NULL;
+static _Atomic uint64_t first_acquire = 0;  // Start of the profiled period
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static ThreadLocks *get_locks(void) {
+    if (local_locks != NULL) return local_locks;
+    ThreadLocks *locks = calloc(1, sizeof(ThreadLocks));
+    if (locks == NULL) return NULL;
+    ThreadLocks *head = atomic_load_explicit(&all_threads, memory_order_relaxed);
+    do {
+        locks->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&all_threads, &head, locks, memory_order_release,
+                                                    memory_order_relaxed));
+    local_locks = locks;
+    return locks;
+}
+
+static void add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void raise_max(_Atomic uint64_t *counter, uint64_t value) {
+    if (value > atomic_load_explicit(counter, memory_order_relaxed)) {
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+    }
+}
+
+// Records an acquisition that waited wait ns and starts timing the hold.
+static void acquired(const void *lock, enum LockSite site, int contended, uint64_t wait, uint64_t now) {
+    uint64_t expected = 0;
+    atomic_compare_exchange_strong(&first_acquire, &expected, now);
+    ThreadLocks *locks = get_locks();
+    if (locks == NULL) return;
+    SiteCounters *counters = &locks->sites[site];
+    add(&counters->acquired, 1);
+    if (contended) {
+        add(&counters->contended, 1);
+        add(&counters->wait_ns, wait);
+        raise_max(&counters->wait_max, wait);
+    }
+    // Past the limit the hold of the lock is not timed
+    if (locks->num_held < LOCKPROF_MAX_HELD) locks->held[locks->num_held++] = (HeldLock){lock, site, now};
+}
+
+static void released(const void *lock) {
+    ThreadLocks *locks = local_locks;
+    if (locks == NULL) return;
+    for (size_t i = locks->num_held; i > 0; i--) {
+        if (locks->held[i - 1].lock != lock) continue;
+        uint64_t hold = now_ns() - locks->held[i - 1].since;
+        SiteCounters *counters = &locks->sites[locks->held[i - 1].site];
+        add(&counters->hold_ns, hold);
+        raise_max(&counters->hold_max, hold);
+        locks->held[i - 1] = locks->held[--locks->num_held];
+        return;
+    }
+}
+
+void prof_rdlock(pthread_rwlock_t *lock, enum LockSite site) {
+    if (pthread_rwlock_tryrdlock(lock) == 0) {
+        acquired(lock, site, 0, 0, now_ns());
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_rwlock_rdlock(lock);
+    uint64_t now = now_ns();
+    stats_lock_wait(now - start);
+    acquired(lock, site, 1, now - start, now);
+}
+
+void prof_wrlock(pthread_rwlock_t *lock, enum LockSite site) {
+    if (pthread_rwlock_trywrlock(lock) == 0) {
+        acquired(lock, site, 0, 0, now_ns());
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_rwlock_wrlock(lock);
+    uint64_t now = now_ns();
+    stats_lock_wait(now - start);
+    acquired(lock, site, 1, now - start, now);
+}
+
+void prof_rwunlock(pthread_rwlock_t *lock) {
+    released(lock);
+    pthread_rwlock_unlock(lock);
+}
+
+void prof_mutex_lock(pthread_mutex_t *mutex, enum LockSite site) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        acquired(mutex, site, 0, 0, now_ns());
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_mutex_lock(mutex);
+    uint64_t now = now_ns();
+    acquired(mutex, site, 1, now - start, now);
+}
+
+void prof_mutex_unlock(pthread_mutex_t *mutex) {
+    released(mutex);
+    pthread_mutex_unlock(mutex);
+}
+
+void prof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, enum LockSite site) {
+    released(mutex);
+    pthread_cond_wait(cond, mutex);
+    // Taken again as a new, uncontended hold: the wait was for the condition
+    acquired(mutex, site, 0, 0, now_ns());
+}
+
+static uint64_t load(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void lockprof_report(FILE *stream) {
+    uint64_t start = atomic_load(&first_acquire);
+    double wall = start > 0 ? (double)(now_ns() - start) / 1e9 : 0;
+    ThreadLocks *first = atomic_load_explicit(&all_threads, memory_order_acquire);
+    size_t threads = 0;
+    for (ThreadLocks *locks = first; locks != NULL; locks = locks->next) threads++;
+
+    fprintf(stream, "# lock profile: %.3f s wall, %zu threads; wait%% is summed thread time over wall time\n",
+            wall, threads);
+    fprintf(stream, "%-10s %12s %10s %10s %8s %12s %10s %12s\n", "site", "acquired", "contended", "wait_ms",
+            "wait%", "max_wait_us", "hold_ms", "max_hold_us");
+    for (int site = 0; site < LOCK_SITES; site++) {
+        uint64_t acquired_count = 0, contended = 0, wait = 0, wait_max = 0, hold = 0, hold_max = 0;
+        for (ThreadLocks *locks = first; locks != NULL; locks = locks->next) {
+            const SiteCounters *counters = &locks->sites[site];
+            acquired_count += load(&counters->acquired);
+            contended += load(&counters->contended);
+            wait += load(&counters->wait_ns);
+            hold += load(&counters->hold_ns);
+            if (load(&counters->wait_max) > wait_max) wait_max = load(&counters->wait_max);
+            if (load(&counters->hold_max) > hold_max) hold_max = load(&counters->hold_max);
+        }
+        if (acquired_count == 0) continue;
+        fprintf(stream, "%-10s %12llu %10llu %10.3f %7.2f%% %12.1f %10.3f %12.1f\n", site_names[site],
+                (unsigned long long)acquired_count, (unsigned long long)contended, (double)wait / 1e6,
+                wall > 0 ? (double)wait / 1e7 / wall : 0, (double)wait_max / 1e3, (double)hold / 1e6,
+                (double)hold_max / 1e3);
+    }
+    fflush(stream);
+}
+
+#endif  // KVS_LOCK_PROFILE
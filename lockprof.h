@@ -0,0 +1,100 @@
+#ifndef KVS_LOCKPROF_H
+#define KVS_LOCKPROF_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+// Lock wrappers that profile the locks of the store per call site: how many
+// acquisitions, how many found the lock taken, the total and longest wait,
+// and the total and longest time the lock was held. lockprof_report prints
+// the sites as a table.
+//
+// The profiler is only built with -DKVS_LOCK_PROFILE (make LOCKPROF=1); it
+// times every acquisition and release. Without it the wrappers are inline
+// pthread calls; only stripe rwlocks under KVS_STATS time contended waits.
+
+enum LockSite {
+    LOCK_WRITE,      // write_pair, write_pairs
+    LOCK_READ,       // read_pair, read_pairs, after the optimistic reads failed
+    LOCK_DELETE,     // delete_pair, delete_pairs
+    LOCK_SHOW,       // SHOW and SCAN, every stripe read locked
+    LOCK_BACKUP,     // Snapshots and the backup bookkeeping of operations.c
+    LOCK_TRIM,       // trim_changes, after a backup was written
+    LOCK_TERMINATE,  // kvs_terminate waiting for backups before free_table
+    LOCK_SITES
+};
+
+#ifdef KVS_LOCK_PROFILE
+
+/// Read locks an rwlock, recording the acquisition for site.
+void prof_rdlock(pthread_rwlock_t *lock, enum LockSite site);
+
+/// Write locks an rwlock, recording the acquisition for site.
+void prof_wrlock(pthread_rwlock_t *lock, enum LockSite site);
+
+/// Unlocks an rwlock taken with prof_rdlock or prof_wrlock, recording how
+/// long it was held.
+void prof_rwunlock(pthread_rwlock_t *lock);
+
+/// Locks a mutex, recording the acquisition for site.
+void prof_mutex_lock(pthread_mutex_t *mutex, enum LockSite site);
+
+/// Unlocks a mutex taken with prof_mutex_lock, recording how long it was held.
+void prof_mutex_unlock(pthread_mutex_t *mutex);
+
+/// pthread_cond_wait on a mutex taken with prof_mutex_lock. The time spent
+/// waiting for the condition counts neither as held nor as lock wait.
+void prof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, enum LockSite site);
+
+/// Prints the counters of every site, added up over all threads.
+/// @param stream Stream to write to.
+void lockprof_report(FILE *stream);
+
+#else
+
+static inline void prof_rdlock(pthread_rwlock_t *lock, enum LockSite site) {
+    (void)site;
+#ifdef KVS_STATS
+    if (pthread_rwlock_tryrdlock(lock) == 0) return;
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(lock);
+    stats_lock_wait(stats_now() - start);
+#else
+    pthread_rwlock_rdlock(lock);
+#endif
+}
+
+static inline void prof_wrlock(pthread_rwlock_t *lock, enum LockSite site) {
+    (void)site;
+#ifdef KVS_STATS
+    if (pthread_rwlock_trywrlock(lock) == 0) return;
+    uint64_t start = stats_now();
+    pthread_rwlock_wrlock(lock);
+    stats_lock_wait(stats_now() - start);
+#else
+    pthread_rwlock_wrlock(lock);
+#endif
+}
+
+static inline void prof_rwunlock(pthread_rwlock_t *lock) { pthread_rwlock_unlock(lock); }
+
+static inline void prof_mutex_lock(pthread_mutex_t *mutex, enum LockSite site) {
+    (void)site;
+    pthread_mutex_lock(mutex);
+}
+
+static inline void prof_mutex_unlock(pthread_mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+
+static inline void prof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, enum LockSite site) {
+    (void)site;
+    pthread_cond_wait(cond, mutex);
+}
+
+static inline void lockprof_report(FILE *stream) { (void)stream; }
+
+#endif  // KVS_LOCK_PROFILE
+
+#endif  // KVS_LOCKPROF_H
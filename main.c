@@ -5,26 +5,126 @@
 #include "constants.h"
 #include "parser.h"
 #include "operations.h"
+#include "pipeline.h"
+#include "server.h"
+#include "stats.h"
+#include "lockprof.h"
+
+#define USAGE "Usage: %s [-m] [-p executors] [-s] [-b] [-d full_every] [-r backup_file]... [-w wal_file [-g window_us]] {directory_path | -l socket_path} max_backups max_threads\n"
 
 int main(int argc, char *argv[]) {
+    // Antes de qualquer outra thread, que herdam o SIGUSR1 bloqueado
+    if (stats_init(stderr)) {
+        fprintf(stderr, "Failed to start statistics\n");
+        return 1;
+    }
     if (kvs_init()) {
         fprintf(stderr, "Failed to initialize KVS\n");
         return 1;
     }
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s [directory_path max_backups [max_threads]]\n", argv[0]);
+    const char *restore_files[argc];
+    int num_restores = 0;
+    const char *wal_file = NULL;
+    const char *socket_path = NULL;
+    int pipelined = 0;
+    unsigned int window_us = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "mp:sbd:r:w:g:l:")) != -1) {
+        switch (opt) {
+            case 'm':
+                set_job_input_mmap(1);
+                break;
+            case 'p': {
+                int executors = atoi(optarg);
+                if (executors <= 0 || executors > PIPELINE_MAX_EXECUTORS) {
+                    fprintf(stderr, "Invalid value for -p, must be between 1 and %d\n", PIPELINE_MAX_EXECUTORS);
+                    return 1;
+                }
+                set_pipeline_executors((size_t)executors);
+                pipelined = 1;
+                break;
+            }
+            case 's':
+                if (set_sorted_keys(1)) {
+                    fprintf(stderr, "Failed to build the ordered index\n");
+                    return 1;
+                }
+                break;
+            case 'b':
+                set_backup_binary(1);
+                break;
+            case 'd': {
+                int full_every = atoi(optarg);
+                if (full_every <= 0) {
+                    fprintf(stderr, "Invalid value for -d, must be at least 1\n");
+                    return 1;
+                }
+                set_backup_deltas(full_every);
+                break;
+            }
+            case 'r':
+                restore_files[num_restores++] = optarg;
+                break;
+            case 'w':
+                wal_file = optarg;
+                break;
+            case 'g': {
+                int window = atoi(optarg);
+                if (window < 0) {
+                    fprintf(stderr, "Invalid value for -g, must be at least 0\n");
+                    return 1;
+                }
+                window_us = (unsigned int)window;
+                break;
+            }
+            case 'l':
+                socket_path = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+        }
+    }
+
+    // No modo servidor não há diretoria: os comandos chegam pelo socket
+    int positional = socket_path != NULL ? 2 : 3;
+    if (argc - optind != positional) {
+        fprintf(stderr, USAGE, argv[0]);
         return 1;
     }
-    char *directory_path = argv[1];
-    int max_backups = atoi(argv[2]);
-    int max_threads = atoi(argv[3]);
+    char *directory_path = socket_path != NULL ? NULL : argv[optind++];
+    int max_backups = atoi(argv[optind]);
+    int max_threads = atoi(argv[optind + 1]);
     if (max_backups <= 0 || max_threads <= 0) {
         fprintf(stderr, "Invalid value for <max_backups> or <max_threads>\n");
         return 1;
     }
-    if (process_job_files(directory_path, max_backups, max_threads) == 0) return 1;
+    // O writer do pipeline reordenaria a saída em relação às linhas de estado
+    if (socket_path != NULL && pipelined) {
+        fprintf(stderr, "-p cannot be used with -l\n");
+        return 1;
+    }
+    // Antes das threads do WAL, que herdam os sinais bloqueados
+    if (socket_path != NULL && server_block_signals()) {
+        fprintf(stderr, "Failed to block signals\n");
+        return 1;
+    }
+    // Um backup completo seguido dos seus deltas, por ordem; o log só tem de
+    // ser reposto a partir da posição do último
+    uint64_t log_position = 0;
+    for (int i = 0; i < num_restores; i++) {
+        if (kvs_restore(restore_files[i], &log_position)) return 1;
+    }
+    if (wal_file != NULL && kvs_open_wal(wal_file, log_position, window_us)) return 1;
+    if (socket_path != NULL) {
+        if (server_run(socket_path, max_backups, max_threads)) return 1;
+    } else if (process_job_files(directory_path, max_backups, max_threads) == 0) {
+        return 1;
+    }
 
     kvs_terminate();
+    stats_dump(stderr);
+    lockprof_report(stderr);
     return 0;
 }
@@ -0,0 +1,336 @@
+#include "notify.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "kvs_engine.h"
+
+#define WATCH_BUCKETS 1024  // Buckets of the watched keys, a power of two
+#define NOTIFY_BATCH 1024   // Most changes delivered per batch
+#define NOTIFY_MAX_QUEUED (256 * 1024)  // Changes queued past which new ones are dropped
+
+typedef struct Event {
+    _Atomic(struct Event *) next;
+    uint64_t h;
+    int deleted;
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} Event;
+
+typedef struct Subscription {
+    Subscriber *subscriber;
+    struct Subscription *next;
+} Subscription;
+
+// A key with at least one subscriber
+typedef struct Watch {
+    uint64_t h;
+    char key[MAX_STRING_SIZE];
+    Subscription *subscriptions;
+    struct Watch *next;
+} Watch;
+
+struct Subscriber {
+    void *owner;
+    int refs;     // Batches still delivering to it, guarded by registry_mutex
+    int touched;  // Already in the batch being delivered, notifier thread only
+};
+
+typedef struct Delivery {
+    Subscriber *subscriber;
+    const Event *event;
+} Delivery;
+
+atomic_uint notify_watches = 0;
+atomic_uint notify_filter[NOTIFY_FILTER_SIZE];
+
+// The notifier thread only holds the mutex to look up who gets a batch, never
+// while delivering: owners may subscribe with their own locks held.
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+static Watch *watches[WATCH_BUCKETS];
+
+// Intrusive MPSC queue in the style of Vyukov: producers swap themselves in
+// as the tail and then link the previous tail to them. The stub keeps the
+// queue from ever being empty, so the consumer never races a producer for
+// the last event.
+static Event stub;
+static _Atomic(Event *) queue_tail = &stub;
+static Event *queue_head = &stub;  // Notifier thread only
+static atomic_int wake_pending = 0;  // A sem_post is on its way, the next ones are not needed
+static atomic_size_t queued = 0;     // Events pushed and not freed yet
+static atomic_int dropping = 0;      // Dropping changes, reported once until the queue drains
+static sem_t wake;
+static atomic_int stopping = 0;
+static pthread_t notifier;
+static NotifyOps ops;
+
+static void push(Event *event) {
+    atomic_store_explicit(&event->next, NULL, memory_order_relaxed);
+    Event *prev = atomic_exchange(&queue_tail, event);
+    atomic_store_explicit(&prev->next, event, memory_order_release);
+}
+
+// Takes the oldest event. Returns NULL if the queue is empty, or if a
+// producer has swapped in the event after the head but not linked it yet.
+static Event *pop(void) {
+    Event *head = queue_head;
+    Event *next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (head == &stub) {
+        if (next == NULL) return NULL;
+        queue_head = head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        queue_head = next;
+        return head;
+    }
+    if (head != atomic_load(&queue_tail)) return NULL;
+    // head is the last event: the stub goes behind it before it is taken
+    push(&stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next == NULL) return NULL;
+    queue_head = next;
+    return head;
+}
+
+void notify_publish(uint64_t h, const char *key, const char *value) {
+    // Writers never wait for the notifier thread, so its queue is bounded instead
+    if (atomic_fetch_add(&queued, 1) >= NOTIFY_MAX_QUEUED) {
+        atomic_fetch_sub(&queued, 1);
+        if (atomic_exchange(&dropping, 1) == 0) fprintf(stderr, "Notification queue full, dropping changes\n");
+        return;
+    }
+    Event *event = malloc(sizeof(Event));
+    if (event == NULL) {
+        atomic_fetch_sub(&queued, 1);
+        fprintf(stderr, "Failed to allocate memory for a notification\n");
+        return;
+    }
+    event->h = h;
+    event->deleted = value == NULL;
+    size_t len = strnlen(key, MAX_STRING_SIZE - 1);
+    memcpy(event->key, key, len);
+    event->key[len] = '\0';
+    if (value != NULL) {
+        len = strnlen(value, MAX_STRING_SIZE - 1);
+        memcpy(event->value, value, len);
+        event->value[len] = '\0';
+    }
+    push(event);
+    if (atomic_exchange(&wake_pending, 1) == 0) sem_post(&wake);
+}
+
+static Watch **find_watch(uint64_t h, const char *key) {
+    Watch **link = &watches[h & (WATCH_BUCKETS - 1)];
+    while (*link != NULL && ((*link)->h != h || strcmp((*link)->key, key) != 0)) link = &(*link)->next;
+    return link;
+}
+
+static void remove_watch(Watch **link) {
+    Watch *watch = *link;
+    *link = watch->next;
+    atomic_fetch_sub(&notify_filter[(watch->h >> 32) & (NOTIFY_FILTER_SIZE - 1)], 1);
+    atomic_fetch_sub(&notify_watches, 1);
+    free(watch);
+}
+
+// Takes up to max events off the queue, waiting for producers caught between
+// their two steps.
+static size_t drain(Event *events[], size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        Event *event = pop();
+        if (event != NULL) {
+            events[n++] = event;
+        } else if (queue_head == atomic_load(&queue_tail)) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    return n;
+}
+
+static void *notifier_thread(void *arg) {
+    (void)arg;
+    Event *events[NOTIFY_BATCH];
+    Delivery *deliveries = NULL;
+    size_t deliveries_capacity = 0;
+    Subscriber **touched = NULL;
+    size_t touched_capacity = 0;
+
+    while (1) {
+        while (sem_wait(&wake) != 0 && errno == EINTR) {
+        }
+        int stop = atomic_load(&stopping);
+        atomic_store(&wake_pending, 0);
+
+        size_t num_events;
+        while ((num_events = drain(events, NOTIFY_BATCH)) > 0) {
+            size_t num_deliveries = 0;
+            size_t num_touched = 0;
+            pthread_mutex_lock(&registry_mutex);
+            for (size_t i = 0; i < num_events; i++) {
+                Watch *watch = *find_watch(events[i]->h, events[i]->key);
+                for (Subscription *sub = watch != NULL ? watch->subscriptions : NULL; sub != NULL; sub = sub->next) {
+                    if (num_deliveries == deliveries_capacity) {
+                        size_t capacity = deliveries_capacity * 2 + 64;
+                        Delivery *grown = realloc(deliveries, capacity * sizeof(Delivery));
+                        if (grown == NULL) break;
+                        deliveries = grown;
+                        deliveries_capacity = capacity;
+                    }
+                    if (!sub->subscriber->touched) {
+                        if (num_touched == touched_capacity) {
+                            size_t capacity = touched_capacity * 2 + 16;
+                            Subscriber **grown = realloc(touched, capacity * sizeof(Subscriber *));
+                            if (grown == NULL) break;
+                            touched = grown;
+                            touched_capacity = capacity;
+                        }
+                        sub->subscriber->touched = 1;
+                        sub->subscriber->refs++;
+                        touched[num_touched++] = sub->subscriber;
+                    }
+                    deliveries[num_deliveries++] = (Delivery){sub->subscriber, events[i]};
+                }
+            }
+            pthread_mutex_unlock(&registry_mutex);
+
+            for (size_t i = 0; i < num_deliveries; i++) {
+                const Event *event = deliveries[i].event;
+                ops.deliver(deliveries[i].subscriber->owner, event->key, event->deleted ? NULL : event->value);
+            }
+            for (size_t i = 0; i < num_touched; i++) {
+                ops.flush(touched[i]->owner);
+            }
+
+            pthread_mutex_lock(&registry_mutex);
+            for (size_t i = 0; i < num_touched; i++) {
+                touched[i]->touched = 0;
+                touched[i]->refs--;
+            }
+            pthread_cond_broadcast(&released);
+            pthread_mutex_unlock(&registry_mutex);
+            for (size_t i = 0; i < num_events; i++) {
+                free(events[i]);
+            }
+            atomic_fetch_sub(&queued, num_events);
+        }
+        atomic_store(&dropping, 0);
+        if (stop) break;
+    }
+    free(deliveries);
+    free(touched);
+    return NULL;
+}
+
+int notify_start(const NotifyOps *notify_ops) {
+    ops = *notify_ops;
+    atomic_store(&stopping, 0);
+    if (sem_init(&wake, 0, 0) != 0) return 1;
+    if (pthread_create(&notifier, NULL, notifier_thread, NULL) != 0) {
+        sem_destroy(&wake);
+        return 1;
+    }
+    return 0;
+}
+
+void notify_stop(void) {
+    atomic_store(&stopping, 1);
+    sem_post(&wake);
+    pthread_join(notifier, NULL);
+    sem_destroy(&wake);
+}
+
+Subscriber *notify_subscriber_create(void *owner) {
+    Subscriber *subscriber = malloc(sizeof(Subscriber));
+    if (subscriber == NULL) return NULL;
+    subscriber->owner = owner;
+    subscriber->refs = 0;
+    subscriber->touched = 0;
+    return subscriber;
+}
+
+// Unlinks the subscription of a subscriber to a watched key, dropping the
+// watch with its last subscriber. The caller must hold registry_mutex.
+static void drop_subscription(Watch **link, Subscriber *subscriber) {
+    Subscription **sub = &(*link)->subscriptions;
+    while (*sub != NULL && (*sub)->subscriber != subscriber) sub = &(*sub)->next;
+    if (*sub == NULL) return;
+    Subscription *dropped = *sub;
+    *sub = dropped->next;
+    free(dropped);
+    if ((*link)->subscriptions == NULL) remove_watch(link);
+}
+
+void notify_subscriber_destroy(Subscriber *subscriber) {
+    pthread_mutex_lock(&registry_mutex);
+    for (size_t i = 0; i < WATCH_BUCKETS; i++) {
+        Watch **link = &watches[i];
+        while (*link != NULL) {
+            Watch *watch = *link;
+            drop_subscription(link, subscriber);
+            if (*link == watch) link = &watch->next;  // Still watched by others
+        }
+    }
+    while (subscriber->refs > 0) {
+        pthread_cond_wait(&released, &registry_mutex);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(subscriber);
+}
+
+int notify_subscribe(Subscriber *subscriber, const char *key) {
+    uint64_t h = kvs_hash(key);
+    pthread_mutex_lock(&registry_mutex);
+    Watch **link = find_watch(h, key);
+    if (*link == NULL) {
+        Watch *watch = malloc(sizeof(Watch));
+        if (watch == NULL) {
+            pthread_mutex_unlock(&registry_mutex);
+            return 1;
+        }
+        watch->h = h;
+        size_t len = strnlen(key, MAX_STRING_SIZE - 1);
+        memcpy(watch->key, key, len);
+        watch->key[len] = '\0';
+        watch->subscriptions = NULL;
+        watch->next = NULL;
+        *link = watch;
+        atomic_fetch_add(&notify_filter[(h >> 32) & (NOTIFY_FILTER_SIZE - 1)], 1);
+        atomic_fetch_add(&notify_watches, 1);
+    }
+
+    for (Subscription *sub = (*link)->subscriptions; sub != NULL; sub = sub->next) {
+        if (sub->subscriber == subscriber) {
+            pthread_mutex_unlock(&registry_mutex);
+            return 0;
+        }
+    }
+    Subscription *sub = malloc(sizeof(Subscription));
+    if (sub == NULL) {
+        if ((*link)->subscriptions == NULL) remove_watch(link);
+        pthread_mutex_unlock(&registry_mutex);
+        return 1;
+    }
+    sub->subscriber = subscriber;
+    sub->next = (*link)->subscriptions;
+    (*link)->subscriptions = sub;
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+void notify_unsubscribe(Subscriber *subscriber, const char *key) {
+    pthread_mutex_lock(&registry_mutex);
+    Watch **link = find_watch(kvs_hash(key), key);
+    if (*link != NULL) drop_subscription(link, subscriber);
+    pthread_mutex_unlock(&registry_mutex);
+}
@@ -0,0 +1,89 @@
+#ifndef KVS_NOTIFY_H
+#define KVS_NOTIFY_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Change notifications for subscribed keys. The writers of kvs.c publish
+// every change of a watched key, still holding the stripe lock, to a
+// lock-free multi-producer single-consumer queue. One notifier thread drains
+// it and delivers the changes in batches: each subscriber gets every change
+// of the batch, then one flush.
+//
+// A write checks notify_watched first: with no subscription at all it is one
+// load of a shared counter, otherwise one load from a filter of counters
+// indexed by the hash of the key. Only a key whose filter slot is taken is
+// looked up, by the notifier thread.
+//
+// Writers never wait for the notifier thread. If it falls too far behind, new
+// changes are dropped rather than queued without bound, and that is reported
+// on stderr.
+
+#define NOTIFY_FILTER_SIZE 4096  // Filter slots, a power of two
+
+typedef struct Subscriber Subscriber;
+
+// How the notifier thread hands changes to the owner of a subscriber. They
+// are called without any lock of this module held, and never again for a
+// subscriber once notify_subscriber_destroy has returned. They must not
+// block: every subscriber waits for the slowest one.
+typedef struct NotifyOps {
+    // One change of a key the subscriber is subscribed to; value is NULL
+    // when the key was deleted
+    void (*deliver)(void *owner, const char *key, const char *value);
+    // After the last change of a batch delivered to the subscriber
+    void (*flush)(void *owner);
+} NotifyOps;
+
+extern atomic_uint notify_watches;                    // Keys with at least one subscriber
+extern atomic_uint notify_filter[NOTIFY_FILTER_SIZE];  // Watched keys per hash slot
+
+/// Tells whether a key may have subscribers.
+/// @param h Hash of the key, see kvs_hash.
+/// @return 0 if it has none, 1 if it may have some.
+static inline int notify_watched(uint64_t h) {
+    return atomic_load_explicit(&notify_watches, memory_order_relaxed) != 0 &&
+           atomic_load_explicit(&notify_filter[(h >> 32) & (NOTIFY_FILTER_SIZE - 1)], memory_order_relaxed) != 0;
+}
+
+/// Queues a change for the notifier thread. Called with the stripe of the key
+/// write locked, so the changes of a key are delivered in the order they
+/// were applied.
+/// @param h Hash of the key.
+/// @param key Key that changed.
+/// @param value New value, NULL if the key was deleted.
+void notify_publish(uint64_t h, const char *key, const char *value);
+
+/// Starts the notifier thread.
+/// @param ops Functions the changes are delivered with.
+/// @return 0 on success, 1 otherwise.
+int notify_start(const NotifyOps *ops);
+
+/// Delivers the changes still queued and stops the notifier thread. Every
+/// subscriber must have been destroyed.
+void notify_stop(void);
+
+/// Creates a subscriber with no subscriptions.
+/// @param owner Passed to the NotifyOps functions.
+/// @return The new subscriber, NULL if out of memory.
+Subscriber *notify_subscriber_create(void *owner);
+
+/// Drops every subscription of a subscriber and frees it, once the notifier
+/// thread is done delivering to it.
+/// @param subscriber Subscriber to destroy.
+void notify_subscriber_destroy(Subscriber *subscriber);
+
+/// Subscribes to the changes of a key made from now on. Subscribing twice
+/// to the same key has no effect.
+/// @param subscriber Subscriber to notify.
+/// @param key Key to watch.
+/// @return 0 on success, 1 if out of memory.
+int notify_subscribe(Subscriber *subscriber, const char *key);
+
+/// Drops a subscription, if there is one.
+/// @param subscriber Subscriber to stop notifying.
+/// @param key Key to stop watching.
+void notify_unsubscribe(Subscriber *subscriber, const char *key);
+
+#endif  // KVS_NOTIFY_H
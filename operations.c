@@ -5,22 +5,45 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include "kvs.h"
 #include "constants.h"
 #include "parser.h"
+#include "operations.h"
+#include "pipeline.h"
+#include "backup.h"
+#include "wal.h"
+#include "stats.h"
+#include "lockprof.h"
+#include "notify.h"
 
 static struct HashTable* kvs_table = NULL;
-static int backup_count = 0;
+static int backup_count = 0;  // Backups still being written, guarded by backup_mutex
+static pthread_mutex_t backup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backup_done = PTHREAD_COND_INITIALIZER;
+static int use_mmap = 0;
+static size_t pipeline_executors = 0;
+static int binary_backups = 0;
+static int sorted_keys = 0;  // SHOW lista os pares por ordem das chaves
+static int full_backup_every = 0;  // Com deltas, um em cada N backups é completo; 0 sem deltas
+static backup_chain_t *backup_chains = NULL;  // Jobs em curso, guardados por backup_mutex
+static Wal *wal = NULL;
 
 
 typedef struct {
     char job_file[MAX_JOB_FILE_NAME_SIZE];
-    int max_backups;
-} thread_data_t;
+    off_t size;
+} job_t;
 
-pthread_mutex_t kvs_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Fila de trabalho partilhada pelos workers, ordenada do maior para o menor ficheiro
+typedef struct {
+    const job_t *jobs;
+    size_t num_jobs;
+    size_t next;            // Próximo job a ser entregue a um worker
+    pthread_mutex_t mutex;
+    int max_backups;
+} job_queue_t;
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -45,6 +68,14 @@ int kvs_terminate() {
         return 1;
     }
 
+    // Os backups ainda a decorrer leem a tabela
+    prof_mutex_lock(&backup_mutex, LOCK_TERMINATE);
+    while (backup_count > 0) {
+        prof_cond_wait(&backup_done, &backup_mutex, LOCK_TERMINATE);
+    }
+    prof_mutex_unlock(&backup_mutex);
+
+    if (wal != NULL) wal_close(wal);
     free_table(kvs_table);
     return 0;
 }
@@ -55,152 +86,317 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
         return 1;
     }
 
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-            fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+    // O comando inteiro é escrito de uma vez, cada lock é tomado uma só vez
+    char failed[num_pairs];
+    if (write_pairs(kvs_table, num_pairs, keys, values, failed) != 0) {
+        for (size_t i = 0; i < num_pairs; i++) {
+            if (failed[i]) {
+                fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+            }
         }
     }
+    if (wal != NULL && wal_commit(wal) != 0) {
+        fprintf(stderr, "Failed to log write\n");
+        return 1;
+    }
 
     return 0;
 }
 
-typedef struct {
-    char key[MAX_STRING_SIZE];
-    char value[MAX_STRING_SIZE];
-} KeyValuePair;
-
-int compare_key_value_pairs(const void* a, const void* b) {
-    return strcmp(((KeyValuePair*)a)->key, ((KeyValuePair*)b)->key);
+int compare_keys(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
 }
 
-int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+int kvs_fetch(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], char missing[]) {
     if (kvs_table == NULL) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    KeyValuePair pairs[num_pairs];
-    size_t pair_count = 0;
+    // Os valores são copiados diretamente para o array, sem alocações
+    read_pairs(kvs_table, num_pairs, keys, values, missing);
+    return 0;
+}
 
+int kvs_lookup(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+    char missing[num_pairs];
+    if (kvs_fetch(num_pairs, keys, values, missing) != 0) {
+        return 1;
+    }
     for (size_t i = 0; i < num_pairs; i++) {
-        char* result = read_pair(kvs_table, keys[i]);
-        if (result == NULL) {
-            snprintf(pairs[pair_count].key, MAX_STRING_SIZE, "%s", keys[i]);
-            snprintf(pairs[pair_count].value, MAX_STRING_SIZE, "KVSERROR");
-        } else {
-            snprintf(pairs[pair_count].key, MAX_STRING_SIZE, "%s", keys[i]);
-            snprintf(pairs[pair_count].value, MAX_STRING_SIZE, "%s", result);
-            free(result);
+        if (missing[i]) {
+            memcpy(values[i], "KVSERROR", sizeof("KVSERROR"));
         }
-        pair_count++;
     }
 
-    // Usa o QuickSort para ordenar por ordem alfabética crescente
-    qsort(pairs, pair_count, sizeof(KeyValuePair), compare_key_value_pairs);
+    return 0;
+}
 
-    write(fd, "[", 1);
-    for (size_t i = 0; i < pair_count; i++) {
-        char buffer[MAX_STRING_SIZE * 2 + 10];
-        int len = snprintf(buffer, sizeof(buffer), "(%s,%s)", pairs[i].key, pairs[i].value);
-        write(fd, buffer, (size_t)len);
+void kvs_write_read_result(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+    // Usa o QuickSort para ordenar por ordem alfabética crescente; só os
+    // ponteiros para as chaves são ordenados, o valor está na mesma posição
+    const char *sorted[num_pairs];
+    for (size_t i = 0; i < num_pairs; i++) {
+        sorted[i] = keys[i];
     }
-    write(fd, "]\n", 2);
+    qsort(sorted, num_pairs, sizeof(const char *), compare_keys);
 
-    return 0;
+    output_append(out, "[", 1);
+    for (size_t i = 0; i < num_pairs; i++) {
+        size_t index = (size_t)(sorted[i] - keys[0]) / MAX_STRING_SIZE;
+        output_append(out, "(", 1);
+        output_append_str(out, keys[index]);
+        output_append(out, ",", 1);
+        output_append_str(out, values[index]);
+        output_append(out, ")", 1);
+    }
+    output_append(out, "]\n", 2);
 }
 
+int kvs_read(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+    char values[num_pairs][MAX_STRING_SIZE];
+    if (kvs_lookup(num_pairs, keys, values) != 0) {
+        return 1;
+    }
 
-int kvs_delete(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+    kvs_write_read_result(out, num_pairs, keys, values);
+    return 0;
+}
+
+int kvs_remove(size_t num_pairs, char keys[][MAX_STRING_SIZE], char missing[]) {
     if (kvs_table == NULL) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
+
+    delete_pairs(kvs_table, num_pairs, keys, missing);
+    if (wal != NULL && wal_commit(wal) != 0) {
+        fprintf(stderr, "Failed to log delete\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+void kvs_write_delete_result(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE], const char missing[]) {
     int aux = 0;
 
     for (size_t i = 0; i < num_pairs; i++) {
-        if (delete_pair(kvs_table, keys[i]) != 0) {
+        if (missing[i]) {
             if (!aux) {
-                write(fd, "[", 1);
+                output_append(out, "[", 1);
                 aux = 1;
             }
-            char buffer[MAX_STRING_SIZE + 12];
-            int len = snprintf(buffer, sizeof(buffer), "(%s,KVSMISSING)", keys[i]);
-            write(fd, buffer, (size_t)len);
+            output_append(out, "(", 1);
+            output_append_str(out, keys[i]);
+            output_append(out, ",KVSMISSING)", sizeof(",KVSMISSING)") - 1);
         }
     }
     if (aux) {
-        write(fd, "]\n", 2);
+        output_append(out, "]\n", 2);
     }
+}
 
+int kvs_delete(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+    char missing[num_pairs];
+    if (kvs_remove(num_pairs, keys, missing) != 0) {
+        return 1;
+    }
+
+    kvs_write_delete_result(out, num_pairs, keys, missing);
     return 0;
 }
 
 
-void kvs_show(int fd) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = kvs_table->table[i];
-        while (keyNode != NULL) {
-            char buffer[MAX_STRING_SIZE * 2 + 10];
-            int len = snprintf(buffer, sizeof(buffer), "(%s, %s)\n", keyNode->key, keyNode->value);
-            write(fd, buffer, (size_t)len);
-            keyNode = keyNode->next;
-        }
-    }
+/// Writes one pair in the SHOW format.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @param arg The OutputBuffer to write to.
+static void write_pair_line(const char *key, const char *value, void *arg) {
+    OutputBuffer *out = arg;
+    output_append(out, "(", 1);
+    output_append_str(out, key);
+    output_append(out, ", ", 2);
+    output_append_str(out, value);
+    output_append(out, ")\n", 2);
 }
 
-int kvs_backup(const char *job_file, int max_backups) {
-    if (backup_count >= max_backups) {
-        // Esperar que um processo filho termine
-        wait(NULL);
-        backup_count--;
+void kvs_show_each(void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+    rdlock_table(kvs_table);
+    if (!sorted_keys || for_each_pair_sorted(kvs_table, NULL, NULL, fn, arg) != 0) {
+        for_each_pair(kvs_table, fn, arg);
     }
+    unlock_table(kvs_table);
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("Failed to fork");
+void kvs_show(OutputBuffer *out) {
+    kvs_show_each(write_pair_line, out);
+}
+
+/// Writes one pair in the READ format.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @param arg The OutputBuffer to write to.
+static void write_scan_pair(const char *key, const char *value, void *arg) {
+    OutputBuffer *out = arg;
+    output_append(out, "(", 1);
+    output_append_str(out, key);
+    output_append(out, ",", 1);
+    output_append_str(out, value);
+    output_append(out, ")", 1);
+}
+
+int kvs_scan(OutputBuffer *out, const char *start, const char *end) {
+    if (kvs_table == NULL) {
+        fprintf(stderr, "KVS state must be initialized\n");
         return 1;
-    } else if (pid == 0) {
-        // Processo filho
-        char backup_file[MAX_JOB_FILE_NAME_SIZE];
-        strncpy(backup_file, job_file, MAX_JOB_FILE_NAME_SIZE - 1);
-        backup_file[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
+    }
 
-        char *ext = strstr(backup_file, ".job");
-        if (ext != NULL) {
-            snprintf(ext, (size_t)(MAX_JOB_FILE_NAME_SIZE - (ext - backup_file)), "-%d.bck", backup_count + 1);
-        } else {
-            snprintf(backup_file, MAX_JOB_FILE_NAME_SIZE, "%s-%d.bck", job_file, backup_count + 1);
-        }
+    // Com só um prefixo, o fim do intervalo é o prefixo seguido de 0xFF até
+    // ao tamanho máximo de uma chave, maior que qualquer chave que o tenha
+    char prefix_end[MAX_STRING_SIZE];
+    if (end == NULL) {
+        size_t len = strnlen(start, MAX_STRING_SIZE - 1);
+        memcpy(prefix_end, start, len);
+        memset(prefix_end + len, 0xFF, MAX_STRING_SIZE - 1 - len);
+        prefix_end[MAX_STRING_SIZE - 1] = '\0';
+        end = prefix_end;
+    }
+
+    output_append(out, "[", 1);
+    rdlock_table(kvs_table);
+    int result = for_each_pair_sorted(kvs_table, start, end, write_scan_pair, out);
+    unlock_table(kvs_table);
+    output_append(out, "]\n", 2);
+    return result;
+}
+
+/// Forgets the changes that no delta of a running job can still need.
+static void trim_backup_changes(void) {
+    if (full_backup_every <= 1) return;
+    uint64_t oldest = UINT64_MAX;
+    prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+    for (backup_chain_t *chain = backup_chains; chain != NULL; chain = chain->next) {
+        if (chain->generation > 0 && chain->generation < oldest) oldest = chain->generation;
+    }
+    prof_mutex_unlock(&backup_mutex);
+    trim_changes(kvs_table, oldest);
+}
+
+typedef struct {
+    Snapshot *snapshot;
+    char backup_file[MAX_JOB_FILE_NAME_SIZE];
+} backup_t;
+
+/// Makes the creation of a file durable by syncing its directory.
+/// @param path Path of the file.
+/// @return 0 on success, 1 otherwise.
+static int sync_parent_dir(const char *path) {
+    char dir[MAX_JOB_FILE_NAME_SIZE];
+    strncpy(dir, path, MAX_JOB_FILE_NAME_SIZE - 1);
+    dir[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL) *(slash == dir ? slash + 1 : slash) = '\0';
+    int fd = open(slash != NULL ? dir : ".", O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return 1;
+    int failed = fsync(fd) != 0;
+    close(fd);
+    return failed;
+}
+
+/// Writes a snapshot to its backup file and frees it.
+/// @param arg The backup_t to write.
+static void *backup_worker(void *arg) {
+    backup_t *backup = arg;
 
-        int fd = open(backup_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (snapshot_capture(kvs_table, backup->snapshot) != 0) {
+        fprintf(stderr, "Failed to copy the KVS state for %s\n", backup->backup_file);
+    } else {
+        int fd = open(backup->backup_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
         if (fd < 0) {
             perror("Failed to create backup file");
-            _exit(1);
-        }
-
-        for (int i = 0; i < TABLE_SIZE; i++) {
-            KeyNode *keyNode = kvs_table->table[i];
-            while (keyNode != NULL) {
-                char buffer[MAX_STRING_SIZE * 2 + 10];
-                int len = snprintf(buffer, sizeof(buffer), "(%s, %s)\n", keyNode->key, keyNode->value);
-                if (len < 0) {
-                    perror("Failed to format string");
-                    close(fd);
-                    _exit(1);
+        } else {
+            int failed = binary_backups ? backup_write_binary(fd, backup->snapshot)
+                                        : backup_write_text(fd, backup->snapshot);
+            if (failed) {
+                fprintf(stderr, "Failed to write backup file %s\n", backup->backup_file);
+            }
+            // Um backup binário completo já tem tudo o que o log tem antes da sua
+            // posição, que pode ser descartado depois de o backup ser durável
+            if (!failed && wal != NULL && binary_backups && !snapshot_is_delta(backup->snapshot)) {
+                if (fsync(fd) != 0 || sync_parent_dir(backup->backup_file) != 0 ||
+                    wal_checkpoint(wal, snapshot_log_position(backup->snapshot)) != 0) {
+                    fprintf(stderr, "Failed to checkpoint the write-ahead log after %s\n", backup->backup_file);
                 }
-                write(fd, buffer, (size_t)len);
-                keyNode = keyNode->next;
             }
+            close(fd);
         }
+    }
+    snapshot_free(backup->snapshot);
+    free(backup);
+    trim_backup_changes();
+
+    prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+    backup_count--;
+    pthread_cond_signal(&backup_done);
+    prof_mutex_unlock(&backup_mutex);
+    return NULL;
+}
 
-        close(fd);
-        _exit(0);
-    } else {
-        // Processo pai
-        backup_count++;
+int kvs_backup(const char *job_file, backup_chain_t *chain, int max_backups) {
+    // Esperar que um backup termine se já houver max_backups a decorrer
+    prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+    while (backup_count >= max_backups) {
+        prof_cond_wait(&backup_done, &backup_mutex, LOCK_BACKUP);
     }
+    backup_count++;
+    prof_mutex_unlock(&backup_mutex);
 
-    return 0;
+    backup_t *backup = malloc(sizeof(backup_t));
+    if (backup != NULL) {
+        strncpy(backup->backup_file, job_file, MAX_JOB_FILE_NAME_SIZE - 1);
+        backup->backup_file[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
+
+        char *ext = strstr(backup->backup_file, ".job");
+        if (ext != NULL) {
+            snprintf(ext, (size_t)(MAX_JOB_FILE_NAME_SIZE - (ext - backup->backup_file)), "-%d.bck", chain->count + 1);
+        } else {
+            snprintf(backup->backup_file, MAX_JOB_FILE_NAME_SIZE, "%s-%d.bck", job_file, chain->count + 1);
+        }
+
+        // Entre backups completos, cada backup só tem o que mudou desde o anterior
+        uint64_t base = 0;
+        if (full_backup_every > 1 && chain->count % full_backup_every != 0) base = chain->generation;
+        chain->count++;
+
+        // O snapshot fixa o estado atual; a escrita do ficheiro fica para a thread
+        backup->snapshot = snapshot_create(kvs_table, base);
+        if (backup->snapshot != NULL) {
+            prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+            chain->generation = snapshot_generation(backup->snapshot);
+            prof_mutex_unlock(&backup_mutex);
+        }
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (backup->snapshot != NULL && pthread_create(&thread, &attr, backup_worker, backup) == 0) {
+            pthread_attr_destroy(&attr);
+            return 0;
+        }
+        pthread_attr_destroy(&attr);
+        if (backup->snapshot != NULL) {
+            snapshot_capture(kvs_table, backup->snapshot);
+            snapshot_free(backup->snapshot);
+        }
+        free(backup);
+    }
+
+    prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+    backup_count--;
+    pthread_cond_signal(&backup_done);
+    prof_mutex_unlock(&backup_mutex);
+    return 1;
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -257,113 +453,353 @@ int count_job_files(const char *dir_path) {
     return count;
 }
 
-void process_commands(int source, int output_fd, const char *job_file, int max_backups) {
-    while (1) {
-        char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-        char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-        unsigned int delay;
-        size_t num_pairs;
-        const char *help_msg =
-                    "Available commands:\n"
-                    "  WRITE [(key,value)(key2,value2),...]\n"
-                    "  READ [key,key2,...]\n"
-                    "  DELETE [key,key2,...]\n"
-                    "  SHOW\n"
-                    "  WAIT <delay_ms>\n"
-                    "  BACKUP\n"
-                    "  HELP\n";
-        switch (get_next(source)) {
-            case CMD_WRITE:
-                num_pairs = parse_write(source, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                if (kvs_write(num_pairs, keys, values)) {
-                    fprintf(stderr, "Failed to write pair\n");
-                }
-                break;
-            case CMD_READ:
-                num_pairs = parse_read_delete(source, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                if (kvs_read(output_fd, num_pairs, keys)) {
-                    fprintf(stderr, "Failed to read pair\n");
-                }
-                break;
-            case CMD_DELETE:
-                num_pairs = parse_read_delete(source, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                if (kvs_delete(output_fd, num_pairs, keys)) {
-                    fprintf(stderr, "Failed to delete pair\n");
-                }
-                break;
-            case CMD_SHOW:
-                kvs_show(output_fd);
-                break;
-            case CMD_WAIT:
-                if (parse_wait(source, &delay, NULL) == -1) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                if (delay > 0) {
-                    printf("Waiting...\n");
-                    kvs_wait(delay);
-                }
-                break;
-            case CMD_BACKUP:
-                if (kvs_backup(job_file, max_backups)) {
-                    fprintf(stderr, "Failed to perform backup.\n");
-                }
-                break;
-            case CMD_INVALID:
+struct job_session {
+    Pipeline *pipeline;
+    OutputBuffer *out;
+    backup_chain_t chain;
+    int max_backups;
+    Subscriber *subscriber;  // Quem recebe as alterações subscritas, NULL fora do servidor
+    char job_file[MAX_JOB_FILE_NAME_SIZE];
+};
+
+job_session_t *job_session_open(OutputBuffer *out, const char *job_file, int max_backups) {
+    job_session_t *session = malloc(sizeof(job_session_t));
+    if (session == NULL) return NULL;
+    session->out = out;
+    session->max_backups = max_backups;
+    strncpy(session->job_file, job_file, MAX_JOB_FILE_NAME_SIZE - 1);
+    session->job_file[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
+
+    // No modo pipeline os comandos com chaves são executados por outras threads
+    session->pipeline = NULL;
+    if (pipeline_executors > 0) {
+        session->pipeline = pipeline_create(pipeline_executors, out);
+        if (session->pipeline == NULL) {
+            fprintf(stderr, "Failed to create pipeline, processing %s serially\n", job_file);
+        }
+    }
+
+    session->subscriber = NULL;
+    session->chain = (backup_chain_t){NULL, 0, 0};
+    prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+    session->chain.next = backup_chains;
+    backup_chains = &session->chain;
+    prof_mutex_unlock(&backup_mutex);
+    return session;
+}
+
+void job_session_set_subscriber(job_session_t *session, Subscriber *subscriber) {
+    session->subscriber = subscriber;
+}
+
+int job_session_backup(job_session_t *session) {
+    if (session->pipeline != NULL) pipeline_drain(session->pipeline);
+    output_flush(session->out);
+    uint64_t start = stats_now();
+    int result = kvs_backup(session->job_file, &session->chain, session->max_backups);
+    if (result) {
+        fprintf(stderr, "Failed to perform backup.\n");
+    }
+    stats_command(STATS_BACKUP, start);
+    return result;
+}
+
+int job_session_execute(job_session_t *session, InputBuffer *source) {
+    Pipeline *pipeline = session->pipeline;
+    OutputBuffer *out = session->out;
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    unsigned int delay;
+    size_t num_pairs;
+    // Com KVS_STATS mede-se cada comando; no modo pipeline, WRITE, READ e
+    // DELETE medem só a entrega às threads que os executam
+    uint64_t start;
+    int result = 0;
+    const char *help_msg =
+                "Available commands:\n"
+                "  WRITE [(key,value)(key2,value2),...]\n"
+                "  READ [key,key2,...]\n"
+                "  DELETE [key,key2,...]\n"
+                "  SHOW\n"
+                "  SCAN [start,end] | SCAN [prefix]\n"
+                "  WAIT <delay_ms>\n"
+                "  BACKUP\n"
+                "  SUBSCRIBE [key,key2,...]\n"
+                "  UNSUBSCRIBE [key,key2,...]\n"
+                "  HELP\n";
+    enum Command cmd = get_next(source);
+    switch (cmd) {
+        case CMD_WRITE:
+            num_pairs = parse_write(source, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 1;
+            }
+            start = stats_now();
+            if (pipeline != NULL) {
+                pipeline_submit(pipeline, CMD_WRITE, num_pairs, keys, values);
+            } else if (kvs_write(num_pairs, keys, values)) {
+                fprintf(stderr, "Failed to write pair\n");
+                result = 1;
+            }
+            stats_command(STATS_WRITE, start);
+            break;
+        case CMD_READ:
+            num_pairs = parse_read_delete(source, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 1;
+            }
+            start = stats_now();
+            if (pipeline != NULL) {
+                pipeline_submit(pipeline, CMD_READ, num_pairs, keys, NULL);
+            } else if (kvs_read(out, num_pairs, keys)) {
+                fprintf(stderr, "Failed to read pair\n");
+                result = 1;
+            }
+            stats_command(STATS_READ, start);
+            break;
+        case CMD_DELETE:
+            num_pairs = parse_read_delete(source, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 1;
+            }
+            start = stats_now();
+            if (pipeline != NULL) {
+                pipeline_submit(pipeline, CMD_DELETE, num_pairs, keys, NULL);
+            } else if (kvs_delete(out, num_pairs, keys)) {
+                fprintf(stderr, "Failed to delete pair\n");
+                result = 1;
+            }
+            stats_command(STATS_DELETE, start);
+            break;
+        case CMD_SHOW:
+            if (pipeline != NULL) pipeline_drain(pipeline);
+            start = stats_now();
+            kvs_show(out);
+            stats_command(STATS_SHOW, start);
+            break;
+        case CMD_SCAN:
+            num_pairs = parse_read_delete(source, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+            if (num_pairs == 0 || num_pairs > 2) {
                 fprintf(stderr, "Invalid command. See HELP for usage\n");
-                break;
-            case CMD_HELP:
-                write(output_fd, help_msg, strlen(help_msg));
-                break;
-            case CMD_EMPTY:
-                break;
-            case EOC:
-                return;
+                return 1;
+            }
+            if (pipeline != NULL) pipeline_drain(pipeline);
+            if (kvs_scan(out, keys[0], num_pairs == 2 ? keys[1] : NULL)) {
+                fprintf(stderr, "Failed to scan pairs\n");
+                result = 1;
+            }
+            break;
+        case CMD_WAIT:
+            if (parse_wait(source, &delay, NULL) == -1) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 1;
+            }
+            if (pipeline != NULL) pipeline_drain(pipeline);
+            output_flush(out);
+            if (delay > 0) {
+                printf("Waiting...\n");
+                kvs_wait(delay);
+            }
+            break;
+        case CMD_BACKUP:
+            result = job_session_backup(session);
+            break;
+        case CMD_INVALID:
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            result = 1;
+            break;
+        case CMD_SUBSCRIBE:
+        case CMD_UNSUBSCRIBE: {
+            int subscribe = cmd == CMD_SUBSCRIBE;
+            num_pairs = parse_read_delete(source, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 1;
+            }
+            // Num ficheiro de job não há a quem entregar as alterações
+            if (session->subscriber == NULL) {
+                fprintf(stderr, "Subscriptions are only available to server clients\n");
+                return 1;
+            }
+            for (size_t i = 0; i < num_pairs; i++) {
+                if (!subscribe) {
+                    notify_unsubscribe(session->subscriber, keys[i]);
+                } else if (notify_subscribe(session->subscriber, keys[i])) {
+                    fprintf(stderr, "Failed to subscribe to %s\n", keys[i]);
+                    result = 1;
+                }
+            }
+            break;
         }
+        case CMD_HELP:
+            if (pipeline != NULL) pipeline_drain(pipeline);
+            output_append_str(out, help_msg);
+            break;
+        case CMD_EMPTY:
+            break;
+        case EOC:
+            return -1;
     }
+    return result;
 }
 
-void* process_job_file_thread(void* arg) {
-    thread_data_t* data = (thread_data_t*)arg;
+void job_session_close(job_session_t *session) {
+    if (session->pipeline != NULL) pipeline_destroy(session->pipeline);
+    output_flush(session->out);
+    prof_mutex_lock(&backup_mutex, LOCK_BACKUP);
+    backup_chain_t **link = &backup_chains;
+    while (*link != &session->chain) link = &(*link)->next;
+    *link = session->chain.next;
+    prof_mutex_unlock(&backup_mutex);
+    trim_backup_changes();
+    free(session);
+}
+
+void process_commands(InputBuffer *source, OutputBuffer *out, const char *job_file, int max_backups) {
+    job_session_t *session = job_session_open(out, job_file, max_backups);
+    if (session == NULL) {
+        fprintf(stderr, "Failed to allocate memory for %s\n", job_file);
+        return;
+    }
+    while (job_session_execute(session, source) != -1) {
+    }
+    job_session_close(session);
+}
+
+/// Processes one job file, writing its output to the matching .out file.
+/// @param job_file Path of the job file.
+/// @param max_backups Maximum number of backups allowed.
+static void process_job_file(const char *job_file, int max_backups) {
     char output_file[MAX_JOB_FILE_NAME_SIZE];
-    strncpy(output_file, data->job_file, MAX_JOB_FILE_NAME_SIZE - 1);
+    strncpy(output_file, job_file, MAX_JOB_FILE_NAME_SIZE - 1);
     output_file[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
     char *ext = strstr(output_file, ".job");
     if (ext != NULL) {
         strcpy(ext, ".out");
     }
 
-    int input_fd = open(data->job_file, O_RDONLY);
+    int input_fd = open(job_file, O_RDONLY);
     if (input_fd < 0) {
-        fprintf(stderr, "Failed to open job file: %s\n", data->job_file);
-        pthread_exit(NULL);
+        fprintf(stderr, "Failed to open job file: %s\n", job_file);
+        return;
     }
 
     int output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (output_fd < 0) {
         fprintf(stderr, "Failed to create output file: %s\n", output_file);
         close(input_fd);
-        pthread_exit(NULL);
+        return;
     }
 
-    process_commands(input_fd, output_fd, data->job_file, data->max_backups);
+    InputBuffer input;
+    if (!use_mmap || parser_init_mmap(&input, input_fd) != 0) {
+        // Ficheiros vazios ou que não podem ser mapeados são lidos com read()
+        parser_init(&input, input_fd);
+    }
+    OutputBuffer output;
+    output_init(&output, output_fd);
+    process_commands(&input, &output, job_file, max_backups);
 
+    parser_release(&input);
     close(input_fd);
     close(output_fd);
+}
+
+/// Worker of the thread pool: takes job files from the queue until it is empty.
+/// @param arg Pointer to the shared job_queue_t.
+static void* job_worker(void* arg) {
+    job_queue_t* queue = (job_queue_t*)arg;
+    while (1) {
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->next == queue->num_jobs) {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        const job_t *job = &queue->jobs[queue->next++];
+        pthread_mutex_unlock(&queue->mutex);
+
+        process_job_file(job->job_file, queue->max_backups);
+    }
+    return NULL;
+}
 
-    pthread_exit(NULL);
+/// Orders jobs by decreasing file size, then by name.
+static int compare_jobs(const void* a, const void* b) {
+    const job_t *ja = (const job_t*)a;
+    const job_t *jb = (const job_t*)b;
+    if (ja->size != jb->size) {
+        return ja->size < jb->size ? 1 : -1;
+    }
+    return strcmp(ja->job_file, jb->job_file);
+}
+
+void set_job_input_mmap(int enabled) {
+    use_mmap = enabled;
+}
+
+void set_pipeline_executors(size_t executors) {
+    pipeline_executors = executors;
+}
+
+int set_sorted_keys(int enabled) {
+    if (kvs_table == NULL) {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+    if (set_ordered_index(kvs_table, enabled)) return 1;
+    sorted_keys = enabled;
+    return 0;
+}
+
+void set_backup_binary(int enabled) {
+    binary_backups = enabled;
+}
+
+void set_backup_deltas(int full_every) {
+    full_backup_every = full_every;
+    if (kvs_table != NULL) set_change_tracking(kvs_table, full_every > 1);
+}
+
+int kvs_restore(const char *backup_file, uint64_t *log_position) {
+    if (kvs_table == NULL) {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    long num_pairs = backup_restore(kvs_table, backup_file, log_position);
+    if (num_pairs < 0) {
+        fprintf(stderr, "Failed to restore backup: %s\n", backup_file);
+        return 1;
+    }
+    return 0;
+}
+
+static void log_change(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], void *arg) {
+    wal_append(arg, num_pairs, keys, values);
+}
+
+static uint64_t log_position(void *arg) {
+    return wal_position(arg);
+}
+
+int kvs_open_wal(const char *wal_file, uint64_t from, unsigned int window_us) {
+    if (kvs_table == NULL) {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    // O log é reposto antes de ser ligado à tabela, para não ser escrito de novo
+    wal = wal_open(wal_file, kvs_table, from, window_us);
+    if (wal == NULL) {
+        fprintf(stderr, "Failed to open write-ahead log: %s\n", wal_file);
+        return 1;
+    }
+    ChangeLog log = {log_change, log_position, wal};
+    set_change_log(kvs_table, &log);
+    return 0;
 }
 
 char process_job_files(char *directory, int max_backups, int max_threads) {
@@ -374,34 +810,36 @@ char process_job_files(char *directory, int max_backups, int max_threads) {
     }
 
     char job_files[num_files][MAX_JOB_FILE_NAME_SIZE];
-    list_job_files(directory, job_files);
-
-    pthread_t threads[max_threads];
-    thread_data_t thread_data[max_threads];
-    int thread_count = 0;
+    size_t num_jobs = list_job_files(directory, job_files);
+
+    // Os ficheiros maiores são processados primeiro, para que um ficheiro
+    // longo não fique para o fim com os restantes workers parados
+    job_t jobs[num_jobs];
+    for (size_t i = 0; i < num_jobs; i++) {
+        memcpy(jobs[i].job_file, job_files[i], MAX_JOB_FILE_NAME_SIZE);
+        struct stat st;
+        jobs[i].size = stat(jobs[i].job_file, &st) == 0 ? st.st_size : 0;
+    }
+    qsort(jobs, num_jobs, sizeof(job_t), compare_jobs);
 
-    for (int i = 0; i < num_files; i++) {
-        strncpy(thread_data[thread_count].job_file, job_files[i], MAX_JOB_FILE_NAME_SIZE - 1);
-        thread_data[thread_count].job_file[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
-        thread_data[thread_count].max_backups = max_backups;
+    job_queue_t queue = {jobs, num_jobs, 0, PTHREAD_MUTEX_INITIALIZER, max_backups};
+    size_t num_workers = (size_t)max_threads < num_jobs ? (size_t)max_threads : num_jobs;
+    pthread_t workers[num_workers > 0 ? num_workers : 1];
+    size_t started = 0;
+    char result = 1;
 
-        if (pthread_create(&threads[thread_count], NULL, process_job_file_thread, &thread_data[thread_count]) != 0) {
+    for (; started < num_workers; started++) {
+        if (pthread_create(&workers[started], NULL, job_worker, &queue) != 0) {
             perror("Failed to create thread");
-            return 0;
-        }
-
-        thread_count++;
-        if (thread_count == max_threads) {
-            for (int j = 0; j < thread_count; j++) {
-                pthread_join(threads[j], NULL);
-            }
-            thread_count = 0;
+            result = 0;
+            break;
         }
     }
 
-    for (int j = 0; j < thread_count; j++) {
-        pthread_join(threads[j], NULL);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
     }
+    pthread_mutex_destroy(&queue.mutex);
 
-    return 1;
+    return result;
 }
@@ -2,6 +2,11 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+#include "parser.h"
+#include "output.h"
+#include "notify.h"
 
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
@@ -18,29 +23,90 @@ int kvs_terminate();
 /// @return 0 if the pairs were written successfully, 1 otherwise.
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
 
+/// Reads values from the KVS without producing any output.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param values Array where the value of each key is stored, "KVSERROR" if it does not exist.
+/// @return 0 if the pairs were read successfully, 1 otherwise.
+int kvs_lookup(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+
+/// Reads values from the KVS, telling which keys are missing.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param values Array where the value of each key that exists is stored.
+/// @param missing Array where missing[i] is set to 1 if keys[i] does not exist, 0 otherwise.
+/// @return 0 if the pairs were read successfully, 1 otherwise.
+int kvs_fetch(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], char missing[]);
+
+/// Writes the output of a READ, with the pairs sorted by key.
+/// @param out Buffered writer for the output.
+/// @param num_pairs Number of pairs read.
+/// @param keys Array of keys' strings.
+/// @param values Array of the values read, see kvs_lookup.
+void kvs_write_read_result(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+
 /// Reads values from the KVS.
-/// @param fd File descriptor for the output
+/// @param out Buffered writer for the output.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were read successfully, 1 otherwise.
-int kvs_read(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+int kvs_read(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+
+/// Deletes key value pairs from the KVS without producing any output.
+/// @param num_pairs Number of pairs to delete.
+/// @param keys Array of keys' strings.
+/// @param missing Array where missing[i] is set to 1 if keys[i] did not exist, 0 otherwise.
+/// @return 0 if the pairs were deleted successfully, 1 otherwise.
+int kvs_remove(size_t num_pairs, char keys[][MAX_STRING_SIZE], char missing[]);
+
+/// Writes the output of a DELETE, listing the keys that did not exist.
+/// @param out Buffered writer for the output.
+/// @param num_pairs Number of keys deleted.
+/// @param keys Array of keys' strings.
+/// @param missing Array of flags filled by kvs_remove.
+void kvs_write_delete_result(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE], const char missing[]);
+
 /// Deletes key value pairs from the KVS.
-/// @param fd File descriptor for the output
+/// @param out Buffered writer for the output.
 /// @param num_pairs Number of pairs to delete.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(int fd, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+int kvs_delete(OutputBuffer *out, size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+
+/// Calls fn for every pair of the KVS, in the order of SHOW, with the table
+/// locked throughout.
+/// @param fn Function called with each key and value.
+/// @param arg Extra argument passed to fn.
+void kvs_show_each(void (*fn)(const char *key, const char *value, void *arg), void *arg);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+/// @param out Buffered writer for the output.
+void kvs_show(OutputBuffer *out);
+
+/// Writes the pairs with start <= key <= end, sorted by key, in the READ
+/// format; with no end, the pairs whose key starts with start.
+/// @param out Buffered writer for the output.
+/// @param start First key of the range, or the prefix.
+/// @param end Last key of the range, NULL to scan a prefix.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_scan(OutputBuffer *out, const char *start, const char *end);
+
+/// Backups of one job file: the number of the last one and what the next
+/// delta is relative to (see set_backup_deltas).
+typedef struct backup_chain {
+    struct backup_chain *next;
+    int count;            // Backups made so far, numbered from 1
+    uint64_t generation;  // Snapshot generation of the last backup, 0 before the first
+} backup_chain_t;
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// backup file. The state is taken right away and written by a background
+/// thread; waits first if max_backups backups are still being written.
 /// @param job_file The job file name.
+/// @param chain Backups of the job so far, updated with this one.
 /// @param max_backups The maximum number of backups allowed.
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(const char *job_file, int max_backups);
+/// @return 0 if the backup was started successfully, 1 otherwise.
+int kvs_backup(const char *job_file, backup_chain_t *chain, int max_backups);
 
 /// Waits for a given amount of time.
 /// @param delay_ms Delay in milliseconds.
@@ -57,6 +123,46 @@ size_t list_job_files(const char *dir_path, char files[][MAX_JOB_FILE_NAME_SIZE]
 /// @return Number of job files found.
 int count_job_files(const char *dir_path);
 
+/// Selects how job files are read by process_job_files.
+/// @param enabled 1 to memory-map each job file, 0 to read it with read().
+void set_job_input_mmap(int enabled);
+
+/// Selects whether each job file is executed by a pipeline (see pipeline.h).
+/// @param executors Number of executor threads per job file, 0 to run commands serially.
+void set_pipeline_executors(size_t executors);
+
+/// Keeps an ordered index of the keys (see set_ordered_index in kvs.h):
+/// SHOW lists the pairs sorted by key and SCAN walks the index instead of
+/// sorting the table. Must be called after kvs_init, before any job runs.
+/// @param enabled 1 to keep the index, 0 not to.
+/// @return 0 on success, 1 if the index could not be built.
+int set_sorted_keys(int enabled);
+
+/// Selects the format of the backup files written by kvs_backup.
+/// @param enabled 1 for the binary format (see backup.h), 0 for text.
+void set_backup_binary(int enabled);
+
+/// Selects delta backups: of every full_every backups of a job, the first
+/// is a full copy and the others only hold the keys changed since the
+/// previous backup. Must be called after kvs_init, before any job runs.
+/// @param full_every Backups per full copy, 0 or 1 for full copies only.
+void set_backup_deltas(int full_every);
+
+/// Loads a binary backup into the KVS, replacing the pairs with the same keys.
+/// @param backup_file Path of the binary backup file.
+/// @param log_position Set to the write-ahead log position of the backup.
+/// @return 0 if the backup was restored, 1 otherwise.
+int kvs_restore(const char *backup_file, uint64_t *log_position);
+
+/// Replays a write-ahead log from a position, then logs every later WRITE
+/// and DELETE to it. Each command returns once its change is durable; the
+/// commands of all threads are synced together (see wal.h).
+/// @param wal_file Path of the log file, created if missing.
+/// @param from Position to replay from, the one of the restored backup or 0.
+/// @param window_us Group commit window in microseconds.
+/// @return 0 if the log was opened, 1 otherwise.
+int kvs_open_wal(const char *wal_file, uint64_t from, unsigned int window_us);
+
 /// Processes job files in a directory.
 /// @param directory Path to the directory.
 /// @param max_backups Maximum number of backups allowed.
@@ -64,10 +170,41 @@ int count_job_files(const char *dir_path);
 /// @return 1 if the job files were processed successfully, 0 otherwise.
 char process_job_files(char *directory, int max_backups, int max_threads);
 
+/// State of a running job: its output, its pipeline and its backups.
+typedef struct job_session job_session_t;
+
+/// Starts a job whose commands are then run one at a time.
+/// @param out Buffered writer for the output, used until the session is closed.
+/// @param job_file Name of the job, backups are named after it.
+/// @param max_backups Maximum number of backups allowed.
+/// @return The new session, NULL if out of memory.
+job_session_t *job_session_open(OutputBuffer *out, const char *job_file, int max_backups);
+
+/// Runs the next command of a job.
+/// @param session Session of the job.
+/// @param source Buffered reader for the input.
+/// @return 0 if the command ran, 1 if it was invalid or failed, -1 at the end of the commands.
+int job_session_execute(job_session_t *session, InputBuffer *source);
+
+/// Lets the job SUBSCRIBE to keys; without a subscriber it cannot.
+/// @param session Session of the job.
+/// @param subscriber Subscriber the subscriptions of the job belong to.
+void job_session_set_subscriber(job_session_t *session, Subscriber *subscriber);
+
+/// Runs a BACKUP of a job, after the commands before it.
+/// @param session Session of the job.
+/// @return 0 if the backup was started, 1 otherwise.
+int job_session_backup(job_session_t *session);
+
+/// Ends a job: waits for its pipeline, flushes its output and frees the session.
+/// @param session Session to close.
+void job_session_close(job_session_t *session);
+
 /// Processes commands from a job file.
-/// @param source File descriptor for the input.
+/// @param source Buffered reader for the input.
+/// @param out Buffered writer for the output, flushed at WAIT, BACKUP and the end.
 /// @param job_file Name of the job file.
 /// @param max_backups Maximum number of backups allowed.
-void process_commands(int source, const char *job_file, int max_backups);
+void process_commands(InputBuffer *source, OutputBuffer *out, const char *job_file, int max_backups);
 
 #endif  // KVS_OPERATIONS_H
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "output.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+static int emit(OutputBuffer *out, const char *data, size_t len) {
+    return out->sink != NULL ? out->sink(out->sink_arg, data, len) : write_all(out->fd, data, len);
+}
+
+void output_init(OutputBuffer *out, int fd) {
+    out->fd = fd;
+    out->sink = NULL;
+    out->sink_arg = NULL;
+    out->len = 0;
+}
+
+void output_init_sink(OutputBuffer *out, int (*sink)(void *arg, const char *data, size_t len), void *arg) {
+    out->fd = -1;
+    out->sink = sink;
+    out->sink_arg = arg;
+    out->len = 0;
+}
+
+int output_flush(OutputBuffer *out) {
+    if (out->len == 0) return 0;
+    int failed = emit(out, out->data, out->len);
+    out->len = 0;
+    return failed;
+}
+
+void output_append(OutputBuffer *out, const char *data, size_t len) {
+    if (out->len + len > OUTPUT_BUFFER_SIZE) {
+        output_flush(out);
+        if (len > OUTPUT_BUFFER_SIZE) {
+            // Too big to be worth copying, it goes straight to the file
+            emit(out, data, len);
+            return;
+        }
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+void output_append_str(OutputBuffer *out, const char *str) {
+    output_append(out, str, strlen(str));
+}
@@ -0,0 +1,49 @@
+#ifndef KVS_OUTPUT_H
+#define KVS_OUTPUT_H
+
+#include <stddef.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/// Buffered writer for the output of a job file, so that each command does
+/// not cost one write() per piece of text. It is flushed when it fills up
+/// and explicitly at the points where the output must reach the file
+/// (WAIT, BACKUP and the end of the job file).
+typedef struct OutputBuffer {
+    int fd;
+    // Takes the bytes instead of fd when set, see output_init_sink
+    int (*sink)(void *arg, const char *data, size_t len);
+    void *sink_arg;
+    size_t len;              // Bytes of data not written yet
+    char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+/// Prepares a buffered writer for a file descriptor.
+/// @param out Writer to initialize.
+/// @param fd File descriptor to write to.
+void output_init(OutputBuffer *out, int fd);
+
+/// Prepares a buffered writer that hands its bytes to a function instead of
+/// writing them to a file descriptor, for writers that must never block.
+/// @param out Writer to initialize.
+/// @param sink Called with the bytes to write out, returns 0 on success, 1 otherwise.
+/// @param arg Passed to sink.
+void output_init_sink(OutputBuffer *out, int (*sink)(void *arg, const char *data, size_t len), void *arg);
+
+/// Appends bytes to the buffer, writing it out first if they do not fit.
+/// @param out Writer to append to.
+/// @param data Bytes to append.
+/// @param len Number of bytes.
+void output_append(OutputBuffer *out, const char *data, size_t len);
+
+/// Appends a string without its terminator.
+/// @param out Writer to append to.
+/// @param str String to append.
+void output_append_str(OutputBuffer *out, const char *str);
+
+/// Writes out everything buffered so far.
+/// @param out Writer to flush.
+/// @return 0 on success, 1 if a write failed.
+int output_flush(OutputBuffer *out);
+
+#endif  // KVS_OUTPUT_H
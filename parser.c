@@ -1,56 +1,230 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "constants.h"
+#include "stats.h"
+
+void parser_init(InputBuffer *in, int fd) {
+  in->fd = fd;
+  in->base = in->data;
+  in->pos = 0;
+  in->len = 0;
+  in->chunk = PARSER_BUFFER_SIZE;
+  in->refills = 0;
+  in->map = NULL;
+}
+
+int parser_init_mmap(InputBuffer *in, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return 1;
+  }
+  posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+  stats_parsed(size);
+
+  parser_init(in, fd);
+  in->base = map;
+  in->len = size;
+  in->map = map;
+  return 0;
+}
+
+void parser_init_memory(InputBuffer *in, const char *data, size_t len) {
+  parser_init(in, -1);
+  in->base = data;
+  in->len = len;
+}
+
+void parser_release(InputBuffer *in) {
+  if (in->map != NULL) {
+    munmap(in->map, in->len);
+    in->map = NULL;
+  }
+}
+
+// Reads the next chunk of the file into the buffer.
+// @return 0 on end of file or error, 1 otherwise.
+static int refill(InputBuffer *in) {
+  if (in->map != NULL || in->fd < 0) {
+    return 0; // The whole input is already in memory
+  }
 
-static int read_string(int fd, char *buffer, size_t max) {
   ssize_t bytes_read;
-  char ch;
-  size_t i = 0;
-  int value = -1;
+  do {
+    bytes_read = read(in->fd, in->data, in->chunk);
+  } while (bytes_read < 0 && errno == EINTR);
+  in->refills++;
 
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+  if (bytes_read <= 0) {
+    return 0;
+  }
 
-    if (bytes_read <= 0) {
-        return -1;
+  in->pos = 0;
+  in->len = (size_t)bytes_read;
+  stats_parsed(in->len);
+  return 1;
+}
+
+static inline int next_char(InputBuffer *in, char *ch) {
+  if (in->pos == in->len && !refill(in)) {
+    return 0;
+  }
+
+  *ch = in->base[in->pos++];
+  return 1;
+}
+
+// Same contract as read(fd, buf, count) on a regular file: fewer than count
+// bytes are only returned at the end of the file.
+static size_t next_bytes(InputBuffer *in, char *buf, size_t count) {
+  size_t copied = 0;
+  while (copied < count) {
+    if (in->pos == in->len && !refill(in)) {
+      break;
     }
 
-    if (ch == ' ') {
-      return -1;
+    size_t n = in->len - in->pos;
+    if (n > count - copied) {
+      n = count - copied;
     }
+    memcpy(buf + copied, in->base + in->pos, n);
+    in->pos += n;
+    copied += n;
+  }
+  return copied;
+}
 
-    if (ch == ',') {
-      value = 0;
-      break;
+static inline int is_delimiter(char ch) {
+  return ch == ',' || ch == ')' || ch == ']' || ch == ' ';
+}
+
+#if defined(__SSE2__)
+static inline __m128i delimiter_mask_128(__m128i v) {
+  __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(','));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+  return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+#endif
+
+// Returns the index of the first character that ends a key or value
+// (',', ')', ']' or the invalid ' ') in p[0..n), or n if there is none.
+static size_t scan_delimiter(const char *p, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(p + i));
+    __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
     }
-    else if (ch == ')') {
-      value = 1;
-      break;
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(delimiter_mask_128(v));
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (is_delimiter(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+static int delimiter_value(char ch) {
+  switch (ch) {
+    case ',':
+      return 0;
+    case ')':
+      return 1;
+    case ']':
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+static int read_string(InputBuffer *in, char *buffer, size_t max) {
+  // Fast path: find the whole token inside the buffer and copy it at once
+  size_t avail = in->len - in->pos;
+  size_t window = avail < max ? avail : max;
+  size_t n = scan_delimiter(in->base + in->pos, window);
+  if (n < window) {
+    char delimiter = in->base[in->pos + n];
+    memcpy(buffer, in->base + in->pos, n);
+    buffer[n] = '\0';
+    in->pos += n + 1;
+    return delimiter_value(delimiter);
+  }
+  if (window == max) {
+    in->pos += max; // Too long, consumed like the slow path would
+    return -1;
+  }
+
+  // The token crosses the end of the buffer, read it one character at a time
+  char ch;
+  size_t i = 0;
+  int value = -1;
+
+  while (i < max) {
+    if (!next_char(in, &ch)) {
+        return -1;
     }
-    else if (ch == ']') {
-      value = 2;
+
+    if (is_delimiter(ch)) {
+      value = delimiter_value(ch);
       break;
     }
 
     buffer[i++] = ch;
   }
 
+  if (value == -1) {
+    return -1; // No room left for the terminator
+  }
+
   buffer[i] = '\0';
 
   return value;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next) {
+static int read_uint(InputBuffer *in, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (i == (int)sizeof(buf)) {
+      return 1;
+    }
+
+    if (!next_char(in, buf + i)) {
       *next = '\0';
       break;
     }
@@ -76,23 +250,32 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+static void cleanup(InputBuffer *in) {
+  // Skip straight to the end of the line inside the buffer
+  while (1) {
+    const char *newline = memchr(in->base + in->pos, '\n', in->len - in->pos);
+    if (newline != NULL) {
+      in->pos = (size_t)(newline - in->base) + 1;
+      return;
+    }
+    in->pos = in->len;
+    if (!refill(in)) {
+      return;
+    }
+  }
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(InputBuffer *in) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (!next_char(in, buf)) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-          cleanup(fd);
+      if (next_bytes(in, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (next_bytes(in, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+          cleanup(in);
           return CMD_INVALID;
         }
         return CMD_WRITE;
@@ -101,114 +284,140 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-        cleanup(fd);
+      if (next_bytes(in, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-        cleanup(fd);
+      if (next_bytes(in, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-        cleanup(fd);
+      if (next_bytes(in, buf + 1, 3) != 3) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (strncmp(buf, "SUBS", 4) == 0) {
+        if (next_bytes(in, buf + 4, 6) != 6 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
+          cleanup(in);
+          return CMD_INVALID;
+        }
+        return CMD_SUBSCRIBE;
+      }
+
+      if (strncmp(buf, "SCAN", 4) == 0) {
+        if (next_bytes(in, buf + 4, 1) != 1 || buf[4] != ' ') {
+          cleanup(in);
+          return CMD_INVALID;
+        }
+        return CMD_SCAN;
+      }
+
+      if (strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (next_bytes(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-        cleanup(fd);
+      if (next_bytes(in, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-        cleanup(fd);
+      if (next_bytes(in, buf + 6, 1) != 0 && buf[6] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (next_bytes(in, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (next_bytes(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
+    case 'U':
+      if (next_bytes(in, buf + 1, 11) != 11 || strncmp(buf, "UNSUBSCRIBE ", 12) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      return CMD_UNSUBSCRIBE;
+
     case '#':
-      cleanup(fd);
+      cleanup(in);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(in);
       return CMD_INVALID;
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+static int parse_pair(InputBuffer *in, char *key, char *value) {
+  if (read_string(in, key, MAX_STRING_SIZE) != 0) {
+    cleanup(in);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if (read_string(in, value, MAX_STRING_SIZE) != 1) {
+    cleanup(in);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(InputBuffer *in, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!next_char(in, &ch) || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (!next_char(in, &ch) || ch != '(') {
+    cleanup(in);
     return 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
+  (void)max_string_size; // Keys and values are parsed straight into the arrays
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if(parse_pair(in, keys[num_pairs], values[num_pairs]) == 0) {
+      cleanup(in);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (!next_char(in, &ch) || (ch != '(' && ch != ']')) {
+      cleanup(in);
       return 0;
     }
 
@@ -218,36 +427,35 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!next_char(in, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(InputBuffer *in, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!next_char(in, &ch) || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(in, keys[num_keys], max_string_size);
     if(output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2){
       break;
@@ -255,34 +463,34 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!next_char(in, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(InputBuffer *in, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(in, delay, &ch) != 0) {
+    cleanup(in);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(in, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(in);
       return -1;
     }
 
@@ -290,7 +498,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(in);
     return -1;
   }
 }
@@ -4,46 +4,87 @@
 #include <stddef.h>
 #include "constants.h"
 
+#define PARSER_BUFFER_SIZE (64 * 1024)
+
+/// Buffered reader shared by every parse function, so that input is read
+/// from the file descriptor in large chunks instead of one byte at a time.
+/// It can also parse a memory mapping of the whole file (see parser_init_mmap).
+typedef struct InputBuffer {
+  int fd;                  // -1 when parsing memory only
+  const char *base;        // Bytes being parsed: data, or the file mapping
+  size_t pos;              // Next byte of base to be consumed
+  size_t len;              // Number of valid bytes in base
+  size_t chunk;            // Bytes requested from each read()
+  unsigned long refills;   // Number of read() calls made so far
+  void *map;               // File mapping, NULL when reading into data
+  char data[PARSER_BUFFER_SIZE];
+} InputBuffer;
+
 enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
+  CMD_SUBSCRIBE,
+  CMD_UNSUBSCRIBE,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
 };
 
+/// Prepares a buffered reader for a file descriptor.
+/// @param in Reader to initialize.
+/// @param in Reader to read from.
+void parser_init(InputBuffer *in, int fd);
+
+/// Prepares a reader that parses a memory mapping of the whole file.
+/// @param in Reader to initialize.
+/// @param fd File descriptor of a regular, non-empty file.
+/// @return 0 if the file was mapped, 1 otherwise (in is left untouched).
+int parser_init_mmap(InputBuffer *in, int fd);
+
+/// Prepares a reader that parses bytes already in memory, such as the
+/// complete lines received from a client. The bytes are not copied.
+/// @param in Reader to initialize.
+/// @param data Bytes to parse, valid while the reader is used.
+/// @param len Number of bytes.
+void parser_init_memory(InputBuffer *in, const char *data, size_t len);
+
+/// Releases the file mapping of a reader, if it has one.
+/// @param in Reader to release.
+void parser_release(InputBuffer *in);
+
 /// Reads a line and returns the corresponding command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(InputBuffer *in);
 
 /// Parses a WRITE command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @param keys Array of keys to be written.
 /// @param values Array of values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(InputBuffer *in, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 
 /// Parses a READ or DELETE command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @param keys Array of keys to be written.
 /// @param max_keys number of keys to be iread or deleted.
 /// @param max_string_size maximum size for keys and values.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(InputBuffer *in, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(InputBuffer *in, unsigned int *delay, unsigned int *thread_id);
 
 #endif  // KVS_PARSER_H
@@ -0,0 +1,293 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "operations.h"
+
+typedef struct PipelineSlot {
+    enum Command cmd;
+    size_t num_keys;
+    size_t pending;                            // Executors that still have to run their part
+    unsigned char owner[MAX_WRITE_SIZE];       // Executor of each key
+    char missing[MAX_WRITE_SIZE];              // DELETE results
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];  // WRITE input, READ results
+} PipelineSlot;
+
+typedef struct Executor {
+    struct Pipeline *pipeline;
+    size_t id;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t queue[PIPELINE_DEPTH];  // Slots with work for this executor, in submission order
+    size_t head;
+    size_t tail;
+    int stop;
+} Executor;
+
+struct Pipeline {
+    PipelineSlot *slots;
+    Executor *executors;
+    size_t num_executors;
+    OutputBuffer *out;
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_done;     // A slot finished running
+    pthread_cond_t slot_emitted;  // The writer emitted a slot
+    unsigned long submitted;      // Commands submitted so far
+    unsigned long emitted;        // Commands whose output was written
+    int stop;
+};
+
+static size_t owner_of(const char *key, size_t num_executors) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h >> 32) % num_executors;
+}
+
+// Runs the keys of a slot owned by one executor as a single batch.
+static void run_part(PipelineSlot *slot, size_t id) {
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char missing[MAX_WRITE_SIZE];
+    size_t index[MAX_WRITE_SIZE];
+    size_t n = 0;
+
+    for (size_t i = 0; i < slot->num_keys; i++) {
+        if (slot->owner[i] != id) continue;
+        memcpy(keys[n], slot->keys[i], MAX_STRING_SIZE);
+        if (slot->cmd == CMD_WRITE) {
+            memcpy(values[n], slot->values[i], MAX_STRING_SIZE);
+        }
+        index[n++] = i;
+    }
+
+    switch (slot->cmd) {
+        case CMD_WRITE:
+            kvs_write(n, keys, values);
+            break;
+        case CMD_READ:
+            kvs_lookup(n, keys, values);
+            for (size_t j = 0; j < n; j++) {
+                memcpy(slot->values[index[j]], values[j], MAX_STRING_SIZE);
+            }
+            break;
+        case CMD_DELETE:
+            kvs_remove(n, keys, missing);
+            for (size_t j = 0; j < n; j++) {
+                slot->missing[index[j]] = missing[j];
+            }
+            break;
+        case CMD_SHOW:
+        case CMD_SCAN:
+        case CMD_WAIT:
+        case CMD_BACKUP:
+        case CMD_HELP:
+        case CMD_SUBSCRIBE:
+        case CMD_UNSUBSCRIBE:
+        case CMD_EMPTY:
+        case CMD_INVALID:
+        case EOC:
+            break;
+    }
+}
+
+static void* executor_thread(void* arg) {
+    Executor *executor = (Executor*)arg;
+    Pipeline *pipeline = executor->pipeline;
+
+    while (1) {
+        pthread_mutex_lock(&executor->mutex);
+        while (executor->head == executor->tail && !executor->stop) {
+            pthread_cond_wait(&executor->cond, &executor->mutex);
+        }
+        if (executor->head == executor->tail) {
+            pthread_mutex_unlock(&executor->mutex);
+            break;
+        }
+        size_t index = executor->queue[executor->head % PIPELINE_DEPTH];
+        executor->head++;
+        pthread_mutex_unlock(&executor->mutex);
+
+        PipelineSlot *slot = &pipeline->slots[index];
+        run_part(slot, executor->id);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        if (--slot->pending == 0) {
+            pthread_cond_signal(&pipeline->slot_done);
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+    }
+    return NULL;
+}
+
+// Emits the output of the slots in submission order as they finish.
+static void* writer_thread(void* arg) {
+    Pipeline *pipeline = (Pipeline*)arg;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    while (1) {
+        PipelineSlot *slot = &pipeline->slots[pipeline->emitted % PIPELINE_DEPTH];
+        if (pipeline->emitted == pipeline->submitted || slot->pending != 0) {
+            if (pipeline->stop && pipeline->emitted == pipeline->submitted) break;
+            pthread_cond_wait(&pipeline->slot_done, &pipeline->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        if (slot->cmd == CMD_READ) {
+            kvs_write_read_result(pipeline->out, slot->num_keys, slot->keys, slot->values);
+        } else if (slot->cmd == CMD_DELETE) {
+            kvs_write_delete_result(pipeline->out, slot->num_keys, slot->keys, slot->missing);
+        }
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->emitted++;
+        pthread_cond_broadcast(&pipeline->slot_emitted);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+static void stop_executors(Pipeline *pipeline, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        Executor *executor = &pipeline->executors[i];
+        pthread_mutex_lock(&executor->mutex);
+        executor->stop = 1;
+        pthread_cond_signal(&executor->cond);
+        pthread_mutex_unlock(&executor->mutex);
+        pthread_join(executor->thread, NULL);
+        pthread_cond_destroy(&executor->cond);
+        pthread_mutex_destroy(&executor->mutex);
+    }
+}
+
+Pipeline *pipeline_create(size_t num_executors, OutputBuffer *out) {
+    if (num_executors == 0 || num_executors > PIPELINE_MAX_EXECUTORS) return NULL;
+
+    Pipeline *pipeline = malloc(sizeof(Pipeline));
+    if (pipeline == NULL) return NULL;
+    pipeline->slots = malloc(PIPELINE_DEPTH * sizeof(PipelineSlot));
+    pipeline->executors = malloc(num_executors * sizeof(Executor));
+    if (pipeline->slots == NULL || pipeline->executors == NULL) {
+        free(pipeline->slots);
+        free(pipeline->executors);
+        free(pipeline);
+        return NULL;
+    }
+    pipeline->num_executors = num_executors;
+    pipeline->out = out;
+    pipeline->submitted = 0;
+    pipeline->emitted = 0;
+    pipeline->stop = 0;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->slot_done, NULL);
+    pthread_cond_init(&pipeline->slot_emitted, NULL);
+
+    size_t started = 0;
+    for (; started < num_executors; started++) {
+        Executor *executor = &pipeline->executors[started];
+        executor->pipeline = pipeline;
+        executor->id = started;
+        executor->head = 0;
+        executor->tail = 0;
+        executor->stop = 0;
+        pthread_mutex_init(&executor->mutex, NULL);
+        pthread_cond_init(&executor->cond, NULL);
+        if (pthread_create(&executor->thread, NULL, executor_thread, executor) != 0) {
+            pthread_cond_destroy(&executor->cond);
+            pthread_mutex_destroy(&executor->mutex);
+            break;
+        }
+    }
+
+    if (started < num_executors || pthread_create(&pipeline->writer, NULL, writer_thread, pipeline) != 0) {
+        stop_executors(pipeline, started);
+        pthread_cond_destroy(&pipeline->slot_emitted);
+        pthread_cond_destroy(&pipeline->slot_done);
+        pthread_mutex_destroy(&pipeline->mutex);
+        free(pipeline->slots);
+        free(pipeline->executors);
+        free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+void pipeline_submit(Pipeline *pipeline, enum Command cmd, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                     char values[][MAX_STRING_SIZE]) {
+    // Only the parsing thread submits, so the slot stays ours once it is free
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->submitted - pipeline->emitted == PIPELINE_DEPTH) {
+        pthread_cond_wait(&pipeline->slot_emitted, &pipeline->mutex);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    size_t index = pipeline->submitted % PIPELINE_DEPTH;
+    PipelineSlot *slot = &pipeline->slots[index];
+    slot->cmd = cmd;
+    slot->num_keys = num_keys;
+    memcpy(slot->keys, keys, num_keys * MAX_STRING_SIZE);
+    if (cmd == CMD_WRITE) {
+        memcpy(slot->values, values, num_keys * MAX_STRING_SIZE);
+    }
+
+    int involved[PIPELINE_MAX_EXECUTORS] = {0};
+    size_t parts = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        size_t owner = owner_of(keys[i], pipeline->num_executors);
+        slot->owner[i] = (unsigned char)owner;
+        if (!involved[owner]) {
+            involved[owner] = 1;
+            parts++;
+        }
+    }
+    slot->pending = parts;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->submitted++;
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    for (size_t e = 0; e < pipeline->num_executors; e++) {
+        if (!involved[e]) continue;
+        Executor *executor = &pipeline->executors[e];
+        pthread_mutex_lock(&executor->mutex);
+        executor->queue[executor->tail % PIPELINE_DEPTH] = index;
+        executor->tail++;
+        pthread_cond_signal(&executor->cond);
+        pthread_mutex_unlock(&executor->mutex);
+    }
+}
+
+void pipeline_drain(Pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->emitted != pipeline->submitted) {
+        pthread_cond_wait(&pipeline->slot_emitted, &pipeline->mutex);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void pipeline_destroy(Pipeline *pipeline) {
+    pipeline_drain(pipeline);
+
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->stop = 1;
+    pthread_cond_signal(&pipeline->slot_done);
+    pthread_mutex_unlock(&pipeline->mutex);
+    pthread_join(pipeline->writer, NULL);
+    stop_executors(pipeline, pipeline->num_executors);
+
+    pthread_cond_destroy(&pipeline->slot_emitted);
+    pthread_cond_destroy(&pipeline->slot_done);
+    pthread_mutex_destroy(&pipeline->mutex);
+    free(pipeline->slots);
+    free(pipeline->executors);
+    free(pipeline);
+}
@@ -0,0 +1,45 @@
+#ifndef KVS_PIPELINE_H
+#define KVS_PIPELINE_H
+
+#include <stddef.h>
+#include "constants.h"
+#include "parser.h"
+#include "output.h"
+
+#define PIPELINE_DEPTH 64           // Commands of a job file in flight at once
+#define PIPELINE_MAX_EXECUTORS 64   // Upper bound for the number of executors
+
+// Pipelined execution of one job file. The thread that parses the file
+// submits WRITE, READ and DELETE commands into a ring of PIPELINE_DEPTH
+// slots. Each key is owned by one executor thread (chosen by its hash), so
+// the commands on a key run in submission order while different keys run
+// in parallel. A writer thread emits the output of the commands in the
+// order they were submitted.
+typedef struct Pipeline Pipeline;
+
+/// Starts the executor and writer threads of a pipeline.
+/// @param num_executors Number of executor threads, 1 to PIPELINE_MAX_EXECUTORS.
+/// @param out Buffered writer for the output. Only the writer thread uses it
+/// until the pipeline is drained.
+/// @return Newly created pipeline, NULL on failure.
+Pipeline *pipeline_create(size_t num_executors, OutputBuffer *out);
+
+/// Submits a command, waiting for a free slot if the ring is full.
+/// @param pipeline Pipeline to submit to.
+/// @param cmd CMD_WRITE, CMD_READ or CMD_DELETE.
+/// @param num_keys Number of keys of the command.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings, only used by CMD_WRITE.
+void pipeline_submit(Pipeline *pipeline, enum Command cmd, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                     char values[][MAX_STRING_SIZE]);
+
+/// Waits until every submitted command has run and its output was written.
+/// Commands that need the whole table (SHOW, BACKUP, ...) run after this.
+/// @param pipeline Pipeline to drain.
+void pipeline_drain(Pipeline *pipeline);
+
+/// Drains the pipeline, stops its threads and frees it.
+/// @param pipeline Pipeline to destroy.
+void pipeline_destroy(Pipeline *pipeline);
+
+#endif  // KVS_PIPELINE_H
@@ -0,0 +1,729 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "constants.h"
+#include "notify.h"
+#include "operations.h"
+#include "output.h"
+#include "parser.h"
+#include "stats.h"
+#include "wire.h"
+
+#define SERVER_EVENTS 64     // Events taken per epoll_wait
+#define SERVER_SHOW_CHUNK 256  // Pairs per frame of a binary SHOW response
+
+enum ConnectionMode { MODE_NEW, MODE_TEXT, MODE_BINARY };
+
+// Bytes waiting to be sent, in order
+typedef struct Backlog {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t capacity;
+} Backlog;
+
+typedef struct Connection {
+    int fd;
+    enum ConnectionMode mode;        // Decided by the first byte received
+    job_session_t *session;
+    Subscriber *subscriber;
+    // Guards pending, changes, serving and dropped, shared by the worker
+    // serving the connection, the epoll thread and the notifier thread. It is
+    // never held while a command runs.
+    pthread_mutex_t lock;
+    Backlog pending;                 // Sent when epoll reports the socket writable
+    // Changes delivered while a worker is serving the connection, which go
+    // after its replies so that they never land inside one
+    Backlog changes;
+    int serving;                     // Queued for or held by a worker, not armed in epoll
+    int dropped;                     // Disconnected for not reading its changes
+    struct Server *server;
+    struct Connection *next_ready;   // Queue of connections waiting for a worker
+    struct Connection *prev;         // Every open connection, to close them at shutdown
+    struct Connection *next;
+    size_t len;                      // Bytes of data received but not run yet
+    char data[SERVER_MAX_REQUEST];
+    OutputBuffer out;
+} Connection;
+
+typedef struct Server {
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;
+    int max_backups;
+    const char *socket_path;
+    unsigned long connections_made;
+    pthread_mutex_t mutex;           // Guards the queue, the connections and stop
+    pthread_cond_t ready;
+    Connection *ready_head;
+    Connection *ready_tail;
+    Connection *connections;
+    // Open connections by fd. Events carry the fd rather than the connection,
+    // so that a stale one never reaches a connection already freed.
+    Connection **by_fd;
+    size_t by_fd_size;
+    int stop;
+} Server;
+
+// What a worker thread decodes requests and encodes responses into, allocated
+// once so that serving a connection allocates nothing.
+typedef struct Worker {
+    InputBuffer in;
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char flags[MAX_WRITE_SIZE];
+    OutputBuffer *out;               // Of the connection being served
+    uint16_t chunk_count;
+    size_t chunk_len;
+    char chunk[SERVER_SHOW_CHUNK * 2 * MAX_STRING_SIZE];
+} Worker;
+
+int server_block_signals(void) {
+    // A client that goes away must not kill the server while it writes a reply
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &ignore, NULL) != 0) return 1;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    return pthread_sigmask(SIG_BLOCK, &set, NULL) != 0;
+}
+
+// Waits for the next commands, unless too many replies are pending, and for
+// the socket to take more replies if there are any. The caller holds
+// conn->lock, so that the worker and the notifier thread never arm the
+// connection with stale events.
+static int arm(Server *server, Connection *conn, int op) {
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    if (conn->pending.len < SERVER_MAX_PENDING) event.events |= EPOLLIN | EPOLLRDHUP;
+    if (conn->pending.len > 0) event.events |= EPOLLOUT;
+    event.data.fd = conn->fd;
+    return epoll_ctl(server->epoll_fd, op, conn->fd, &event);
+}
+
+// Sends what the socket takes without blocking.
+// @return Number of bytes sent, -1 if the connection failed.
+static ssize_t send_some(int fd, const char *data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, data + sent, len - sent, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    return (ssize_t)sent;
+}
+
+// Adds bytes at the end of a backlog.
+// @return 0 on success, 1 if out of memory.
+static int backlog_append(Backlog *backlog, const char *data, size_t len) {
+    if (backlog->start + backlog->len + len > backlog->capacity) {
+        if (backlog->len > 0) memmove(backlog->data, backlog->data + backlog->start, backlog->len);
+        backlog->start = 0;
+        if (backlog->len + len > backlog->capacity) {
+            size_t capacity = backlog->capacity * 2;
+            if (capacity < backlog->len + len) capacity = backlog->len + len;
+            char *grown = realloc(backlog->data, capacity);
+            if (grown == NULL) return 1;
+            backlog->data = grown;
+            backlog->capacity = capacity;
+        }
+    }
+    memcpy(backlog->data + backlog->start + backlog->len, data, len);
+    backlog->len += len;
+    return 0;
+}
+
+// Drops the first bytes of a backlog.
+static void backlog_consume(Backlog *backlog, size_t len) {
+    backlog->start += len;
+    backlog->len -= len;
+    if (backlog->len == 0 && backlog->capacity > OUTPUT_BUFFER_SIZE) {
+        // Do not keep the memory of one big SHOW for the life of the connection
+        free(backlog->data);
+        backlog->data = NULL;
+        backlog->capacity = 0;
+    }
+    if (backlog->len == 0) backlog->start = 0;
+}
+
+// Sends as many pending bytes as the socket takes without blocking. The
+// caller holds conn->lock.
+// @return 0 on success, 1 if the connection failed.
+static int send_pending(Connection *conn) {
+    if (conn->pending.len == 0) return 0;
+    ssize_t sent = send_some(conn->fd, conn->pending.data + conn->pending.start, conn->pending.len);
+    if (sent < 0) return 1;
+    backlog_consume(&conn->pending, (size_t)sent);
+    return 0;
+}
+
+// Where the output of a connection goes instead of a blocking write(): the
+// bytes the socket does not take right away wait in pending, so a client that
+// stops reading never holds up a worker, not even one that has the table
+// locked for a SHOW.
+static int send_reply(void *arg, const char *data, size_t len) {
+    Connection *conn = arg;
+    pthread_mutex_lock(&conn->lock);
+    size_t sent = 0;
+    int failed = 0;
+    if (conn->pending.len == 0) {
+        ssize_t n = send_some(conn->fd, data, len);
+        failed = n < 0;
+        sent = n < 0 ? len : (size_t)n;
+    }
+    if (sent < len) failed = backlog_append(&conn->pending, data + sent, len - sent);
+    pthread_mutex_unlock(&conn->lock);
+    return failed;
+}
+
+static void close_connection(Server *server, Connection *conn) {
+    pthread_mutex_lock(&server->mutex);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        server->connections = conn->next;
+    }
+    if (conn->next != NULL) conn->next->prev = conn->prev;
+    server->by_fd[conn->fd] = NULL;
+    pthread_mutex_unlock(&server->mutex);
+
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    // Waits for the notifier thread to be done with the connection
+    notify_subscriber_destroy(conn->subscriber);
+    job_session_close(conn->session);
+    pthread_mutex_lock(&conn->lock);
+    send_pending(conn);  // The last replies, if the socket takes them
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->pending.data);
+    free(conn->changes.data);
+    close(conn->fd);
+    free(conn);
+}
+
+static void accept_connections(Server *server) {
+    while (1) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Failed to accept connection");
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        Connection *conn = malloc(sizeof(Connection));
+        if (conn == NULL) {
+            fprintf(stderr, "Failed to allocate memory for a connection\n");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->mode = MODE_NEW;
+        conn->len = 0;
+        conn->next_ready = NULL;
+        conn->pending = (Backlog){NULL, 0, 0, 0};
+        conn->changes = (Backlog){NULL, 0, 0, 0};
+        conn->serving = 0;
+        conn->dropped = 0;
+        conn->server = server;
+        pthread_mutex_init(&conn->lock, NULL);
+        output_init_sink(&conn->out, send_reply, conn);
+        // Backups of the connection are named like those of a job file
+        char name[MAX_JOB_FILE_NAME_SIZE];
+        snprintf(name, sizeof(name), "%s-%lu", server->socket_path, ++server->connections_made);
+        conn->session = job_session_open(&conn->out, name, server->max_backups);
+        conn->subscriber = notify_subscriber_create(conn);
+        if (conn->session == NULL || conn->subscriber == NULL) {
+            fprintf(stderr, "Failed to allocate memory for a connection\n");
+            if (conn->session != NULL) job_session_close(conn->session);
+            free(conn->subscriber);
+            pthread_mutex_destroy(&conn->lock);
+            close(fd);
+            free(conn);
+            continue;
+        }
+        job_session_set_subscriber(conn->session, conn->subscriber);
+
+        pthread_mutex_lock(&server->mutex);
+        if ((size_t)fd >= server->by_fd_size) {
+            size_t size = (size_t)fd * 2 + 64;
+            Connection **grown = realloc(server->by_fd, size * sizeof(Connection *));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&server->mutex);
+                fprintf(stderr, "Failed to allocate memory for a connection\n");
+                notify_subscriber_destroy(conn->subscriber);
+                job_session_close(conn->session);
+                pthread_mutex_destroy(&conn->lock);
+                close(fd);
+                free(conn);
+                continue;
+            }
+            memset(grown + server->by_fd_size, 0, (size - server->by_fd_size) * sizeof(Connection *));
+            server->by_fd = grown;
+            server->by_fd_size = size;
+        }
+        server->by_fd[fd] = conn;
+        conn->prev = NULL;
+        conn->next = server->connections;
+        if (conn->next != NULL) conn->next->prev = conn;
+        server->connections = conn;
+        pthread_mutex_unlock(&server->mutex);
+
+        if (arm(server, conn, EPOLL_CTL_ADD) != 0) {
+            perror("Failed to watch connection");
+            close_connection(server, conn);
+        }
+    }
+}
+
+// Runs the complete lines received, replying to each.
+// @return 0 to keep the connection, 1 to close it.
+static int serve_text(Connection *conn, Worker *worker) {
+    size_t end = conn->len;
+    while (end > 0 && conn->data[end - 1] != '\n') end--;
+    if (end == 0) {
+        if (conn->len < SERVER_MAX_REQUEST) return 0;  // Wait for the rest of the line
+        output_append_str(&conn->out, "ERR\n");
+        output_flush(&conn->out);
+        return 1;
+    }
+
+    parser_init_memory(&worker->in, conn->data, end);
+    int result;
+    while ((result = job_session_execute(conn->session, &worker->in)) != -1) {
+        output_append_str(&conn->out, result == 0 ? "OK\n" : "ERR\n");
+    }
+    memmove(conn->data, conn->data + end, conn->len - end);
+    conn->len -= end;
+    return output_flush(&conn->out);
+}
+
+static void reply_header(OutputBuffer *out, uint8_t opcode, uint8_t flags, uint16_t count, size_t length) {
+    char buf[WIRE_HEADER_SIZE];
+    WireHeader header = {(uint32_t)length, opcode, flags, count};
+    wire_put_header(buf, &header);
+    output_append(out, buf, WIRE_HEADER_SIZE);
+}
+
+static void flush_chunk(Worker *worker, uint8_t flags) {
+    reply_header(worker->out, WIRE_SHOW, flags, worker->chunk_count, worker->chunk_len);
+    output_append(worker->out, worker->chunk, worker->chunk_len);
+    worker->chunk_count = 0;
+    worker->chunk_len = 0;
+}
+
+static void put_string(Worker *worker, const char *str) {
+    size_t len = strlen(str);
+    worker->chunk[worker->chunk_len] = (char)len;
+    memcpy(worker->chunk + worker->chunk_len + 1, str, len);
+    worker->chunk_len += 1 + len;
+}
+
+static void show_pair(const char *key, const char *value, void *arg) {
+    Worker *worker = arg;
+    if (worker->chunk_count == SERVER_SHOW_CHUNK) flush_chunk(worker, WIRE_MORE);
+    put_string(worker, key);
+    put_string(worker, value);
+    worker->chunk_count++;
+}
+
+// Runs one request frame and writes its response.
+static void run_frame(Connection *conn, Worker *worker, const WireHeader *header, const char *payload) {
+    OutputBuffer *out = &conn->out;
+    size_t count = header->count;
+    uint64_t start = stats_now();
+    int failed = 0;
+    switch (header->opcode) {
+        case WIRE_WRITE:
+        case WIRE_READ:
+        case WIRE_DELETE:
+            if (count == 0 || count > MAX_WRITE_SIZE ||
+                wire_decode_request(header, payload, worker->keys, worker->values) != 0) {
+                failed = 1;
+                break;
+            }
+            if (header->opcode == WIRE_WRITE) {
+                if ((failed = kvs_write(count, worker->keys, worker->values)) == 0) {
+                    reply_header(out, WIRE_WRITE, 0, 0, 0);
+                    stats_command(STATS_WRITE, start);
+                }
+            } else if (header->opcode == WIRE_READ) {
+                if ((failed = kvs_fetch(count, worker->keys, worker->values, worker->flags)) == 0) {
+                    size_t length = count;
+                    for (size_t i = 0; i < count; i++) {
+                        if (!worker->flags[i]) length += strlen(worker->values[i]);
+                    }
+                    reply_header(out, WIRE_READ, 0, (uint16_t)count, length);
+                    for (size_t i = 0; i < count; i++) {
+                        size_t len = worker->flags[i] ? 0 : strlen(worker->values[i]);
+                        char len_byte = (char)(worker->flags[i] ? WIRE_MISSING : len);
+                        output_append(out, &len_byte, 1);
+                        output_append(out, worker->values[i], len);
+                    }
+                    stats_command(STATS_READ, start);
+                }
+            } else if ((failed = kvs_remove(count, worker->keys, worker->flags)) == 0) {
+                reply_header(out, WIRE_DELETE, 0, (uint16_t)count, count);
+                output_append(out, worker->flags, count);
+                stats_command(STATS_DELETE, start);
+            }
+            break;
+        case WIRE_SHOW:
+            worker->out = out;
+            worker->chunk_count = 0;
+            worker->chunk_len = 0;
+            kvs_show_each(show_pair, worker);
+            flush_chunk(worker, 0);
+            stats_command(STATS_SHOW, start);
+            break;
+        case WIRE_BACKUP:
+            // Timed by job_session_backup
+            if ((failed = job_session_backup(conn->session)) == 0) reply_header(out, WIRE_BACKUP, 0, 0, 0);
+            break;
+        case WIRE_SUBSCRIBE:
+        case WIRE_UNSUBSCRIBE:
+            if (count == 0 || count > MAX_WRITE_SIZE ||
+                wire_decode_request(header, payload, worker->keys, worker->values) != 0) {
+                failed = 1;
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (header->opcode == WIRE_UNSUBSCRIBE) {
+                    notify_unsubscribe(conn->subscriber, worker->keys[i]);
+                } else {
+                    failed |= notify_subscribe(conn->subscriber, worker->keys[i]);
+                }
+            }
+            if (!failed) reply_header(out, header->opcode, 0, 0, 0);
+            break;
+        default:
+            failed = 1;
+            break;
+    }
+    if (failed) reply_header(out, header->opcode, WIRE_ERR, 0, 0);
+}
+
+// Runs the requests of a BATCH frame in order.
+static void run_batch(Connection *conn, Worker *worker, const WireHeader *batch, const char *payload) {
+    size_t pos = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        WireHeader header;
+        if (batch->length - pos < WIRE_HEADER_SIZE) break;
+        wire_get_header(payload + pos, &header);
+        pos += WIRE_HEADER_SIZE;
+        if (batch->length - pos < header.length) break;
+        if (header.opcode == WIRE_BATCH) {
+            reply_header(&conn->out, WIRE_BATCH, WIRE_ERR, 0, 0);
+        } else {
+            run_frame(conn, worker, &header, payload + pos);
+        }
+        pos += header.length;
+        if (i + 1 == batch->count && pos == batch->length) return;
+    }
+    // The requests before the malformed one already have their responses
+    if (batch->count > 0) reply_header(&conn->out, WIRE_BATCH, WIRE_ERR, 0, 0);
+}
+
+// Runs the complete frames received, replying to each.
+// @return 0 to keep the connection, 1 to close it.
+static int serve_binary(Connection *conn, Worker *worker) {
+    size_t pos = 0;
+    while (conn->len - pos >= WIRE_HEADER_SIZE) {
+        WireHeader header;
+        wire_get_header(conn->data + pos, &header);
+        // A frame that can never be received whole ends the connection
+        if (header.length > SERVER_MAX_REQUEST - WIRE_HEADER_SIZE) {
+            output_flush(&conn->out);
+            return 1;
+        }
+        if (conn->len - pos - WIRE_HEADER_SIZE < header.length) break;
+        const char *payload = conn->data + pos + WIRE_HEADER_SIZE;
+        if (header.opcode == WIRE_BATCH) {
+            run_batch(conn, worker, &header, payload);
+        } else {
+            run_frame(conn, worker, &header, payload);
+        }
+        pos += WIRE_HEADER_SIZE + header.length;
+    }
+    memmove(conn->data, conn->data + pos, conn->len - pos);
+    conn->len -= pos;
+    return output_flush(&conn->out);
+}
+
+// Reads what the client sent and runs the commands it completes.
+// @return 0 to keep the connection, 1 to close it.
+static int serve(Connection *conn, Worker *worker) {
+    pthread_mutex_lock(&conn->lock);
+    int failed = send_pending(conn);
+    // The next commands wait until the client reads the replies it has
+    int behind = conn->pending.len >= SERVER_MAX_PENDING;
+    pthread_mutex_unlock(&conn->lock);
+    if (failed || behind) return failed;
+    ssize_t n = recv(conn->fd, conn->data + conn->len, SERVER_MAX_REQUEST - conn->len, MSG_DONTWAIT);
+    if (n == 0) return 1;
+    if (n < 0) return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+    conn->len += (size_t)n;
+
+    if (conn->mode == MODE_NEW) {
+        conn->mode = (uint8_t)conn->data[0] == WIRE_MAGIC ? MODE_BINARY : MODE_TEXT;
+        if (conn->mode == MODE_BINARY) memmove(conn->data, conn->data + 1, --conn->len);
+    }
+    return conn->mode == MODE_BINARY ? serve_binary(conn, worker) : serve_text(conn, worker);
+}
+
+static void *worker_thread(void *arg) {
+    // Too big for the stack of a thread
+    Worker *worker = malloc(sizeof(Worker));
+    if (worker == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a worker\n");
+        return NULL;
+    }
+    Server *server = arg;
+
+    while (1) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->ready_head == NULL && !server->stop) {
+            pthread_cond_wait(&server->ready, &server->mutex);
+        }
+        if (server->stop) {
+            pthread_mutex_unlock(&server->mutex);
+            break;
+        }
+        Connection *conn = server->ready_head;
+        server->ready_head = conn->next_ready;
+        if (server->ready_head == NULL) server->ready_tail = NULL;
+        pthread_mutex_unlock(&server->mutex);
+
+        int done = serve(conn, worker);
+        pthread_mutex_lock(&conn->lock);
+        if (done == 0 && conn->changes.len > 0) {
+            done = backlog_append(&conn->pending, conn->changes.data + conn->changes.start, conn->changes.len) ||
+                   send_pending(conn);
+            backlog_consume(&conn->changes, conn->changes.len);
+        }
+        if (done == 0) done = arm(server, conn, EPOLL_CTL_MOD) != 0;
+        // A connection being closed stays serving, so that nothing queues it again
+        if (done == 0) conn->serving = 0;
+        pthread_mutex_unlock(&conn->lock);
+        if (done != 0) close_connection(server, conn);
+    }
+    free(worker);
+    return NULL;
+}
+
+// Changes of subscribed keys go out with the replies, in the connection's
+// encoding. The notifier thread never waits for a socket: the changes join the
+// pending replies, and a subscriber that lets more than SERVER_MAX_BACKLOG
+// bytes pile up is disconnected.
+static void deliver_change(void *owner, const char *key, const char *value) {
+    Connection *conn = owner;
+    char change[WIRE_HEADER_SIZE + 2 * MAX_STRING_SIZE + sizeof("NOTIFY (,KVSMISSING)\n")];
+    size_t len;
+    if (conn->mode == MODE_BINARY) {
+        size_t key_len = strlen(key);
+        size_t value_len = value != NULL ? strlen(value) : 0;
+        WireHeader header = {(uint32_t)(2 + key_len + value_len), WIRE_NOTIFY, 0, 1};
+        wire_put_header(change, &header);
+        len = WIRE_HEADER_SIZE;
+        change[len++] = (char)key_len;
+        memcpy(change + len, key, key_len);
+        len += key_len;
+        change[len++] = (char)(value != NULL ? value_len : WIRE_MISSING);
+        if (value != NULL) memcpy(change + len, value, value_len);
+        len += value_len;
+    } else {
+        len = (size_t)snprintf(change, sizeof(change), "NOTIFY (%s,%s)\n", key, value != NULL ? value : "KVSMISSING");
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->dropped) {
+        // Already on its way out
+    } else if (conn->pending.len + conn->changes.len + len > SERVER_MAX_BACKLOG) {
+        // The socket reports a hangup, and the worker that takes it closes the connection
+        conn->dropped = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+    } else if (backlog_append(conn->serving ? &conn->changes : &conn->pending, change, len) != 0) {
+        fprintf(stderr, "Failed to allocate memory for a notification\n");
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void flush_changes(void *owner) {
+    Connection *conn = owner;
+    pthread_mutex_lock(&conn->lock);
+    // A worker serving the connection sends the changes after its replies
+    if (!conn->serving && !conn->dropped && conn->pending.len > 0) {
+        // A failure shows up as a hangup of the socket
+        send_pending(conn);
+        if (conn->pending.len > 0) arm(conn->server, conn, EPOLL_CTL_MOD);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Hands a connection with events to a worker. The event may be stale: its fd
+// may have been closed, or reused by a newer connection, or the notifier
+// thread may have armed the connection again after it fired.
+static void dispatch(Server *server, int fd) {
+    pthread_mutex_lock(&server->mutex);
+    Connection *conn = (size_t)fd < server->by_fd_size ? server->by_fd[fd] : NULL;
+    if (conn != NULL) {
+        pthread_mutex_lock(&conn->lock);
+        int queued = conn->serving;
+        conn->serving = 1;
+        pthread_mutex_unlock(&conn->lock);
+        if (!queued) {
+            conn->next_ready = NULL;
+            if (server->ready_tail != NULL) {
+                server->ready_tail->next_ready = conn;
+            } else {
+                server->ready_head = conn;
+            }
+            server->ready_tail = conn;
+            pthread_cond_signal(&server->ready);
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static int open_socket(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Failed to create socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        perror("Failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int watch(int epoll_fd, int fd) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int server_run(const char *socket_path, int max_backups, int num_workers) {
+    Server server;
+    server.max_backups = max_backups;
+    server.socket_path = socket_path;
+    server.connections_made = 0;
+    server.ready_head = NULL;
+    server.ready_tail = NULL;
+    server.connections = NULL;
+    server.by_fd = NULL;
+    server.by_fd_size = 0;
+    server.stop = 0;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    server.signal_fd = signalfd(-1, &set, 0);
+    server.epoll_fd = epoll_create1(0);
+    server.listen_fd = open_socket(socket_path);
+    if (server.signal_fd < 0 || server.epoll_fd < 0 || server.listen_fd < 0 ||
+        watch(server.epoll_fd, server.listen_fd) != 0 || watch(server.epoll_fd, server.signal_fd) != 0) {
+        if (server.signal_fd < 0 || server.epoll_fd < 0) perror("Failed to start server");
+        if (server.listen_fd >= 0) {
+            close(server.listen_fd);
+            unlink(socket_path);
+        }
+        if (server.epoll_fd >= 0) close(server.epoll_fd);
+        if (server.signal_fd >= 0) close(server.signal_fd);
+        return 1;
+    }
+    NotifyOps ops = {deliver_change, flush_changes};
+    if (notify_start(&ops) != 0) {
+        fprintf(stderr, "Failed to start the notifier thread\n");
+        close(server.listen_fd);
+        unlink(socket_path);
+        close(server.epoll_fd);
+        close(server.signal_fd);
+        return 1;
+    }
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    pthread_t workers[num_workers];
+    int started = 0;
+    while (started < num_workers && pthread_create(&workers[started], NULL, worker_thread, &server) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Failed to create worker threads\n");
+    }
+
+    struct epoll_event events[SERVER_EVENTS];
+    int running = started > 0;
+    while (running) {
+        int n = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("Failed to wait for events");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == server.listen_fd) {
+                accept_connections(&server);
+            } else if (events[i].data.fd == server.signal_fd) {
+                running = 0;
+            } else {
+                dispatch(&server, events[i].data.fd);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&server.mutex);
+    server.stop = 1;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.mutex);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    while (server.connections != NULL) {
+        close_connection(&server, server.connections);
+    }
+    notify_stop();
+
+    close(server.listen_fd);
+    unlink(socket_path);
+    close(server.epoll_fd);
+    close(server.signal_fd);
+    free(server.by_fd);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.mutex);
+    return started == 0;
+}
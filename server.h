@@ -0,0 +1,46 @@
+#ifndef KVS_SERVER_H
+#define KVS_SERVER_H
+
+#define SERVER_MAX_REQUEST (64 * 1024)  // Longest command line or frame a client may send
+#define SERVER_MAX_PENDING (4 * 1024 * 1024)  // Unsent reply bytes past which a client's commands wait
+#define SERVER_MAX_BACKLOG (16 * 1024 * 1024)  // Unsent bytes past which a subscriber is disconnected
+#define SERVER_BACKLOG 128
+
+// Long-running mode: the table stays in memory and clients send commands of
+// the job file language over a Unix domain stream socket, one per line.
+// The output of each command is sent back followed by a status line, "OK"
+// or "ERR", so a client knows where the reply ends. No output line of a
+// command can be mistaken for a status line.
+//
+// One thread waits for connections and input with epoll. A connection with
+// input is handed to a fixed pool of worker threads, one worker at a time
+// (EPOLLONESHOT), which runs its complete lines in order and writes the
+// replies. Replies never block a worker: what the socket does not take is
+// kept and sent when epoll reports the socket writable, and a client with
+// more than SERVER_MAX_PENDING bytes of them unread is not read from until
+// it catches up. Each connection runs like a job file of its own, with its
+// own backups, named after the socket path and the connection number.
+//
+// Changes of the keys a client subscribed to join its unsent replies, between
+// two of them. A subscriber that leaves more than SERVER_MAX_BACKLOG bytes
+// unread is disconnected, so that it holds up neither the notifier thread
+// nor the memory of the server.
+//
+// A client that sends WIRE_MAGIC as its first byte speaks the binary frames
+// of wire.h instead of text lines: the server decodes them without parsing
+// text and encodes the responses straight into the connection's buffer.
+
+/// Blocks SIGINT and SIGTERM in the calling thread, so that server_run can
+/// take them to shut down. Must be called before any other thread is created,
+/// so that every thread inherits the blocked signals.
+/// @return 0 on success, 1 otherwise.
+int server_block_signals(void);
+
+/// Serves clients until SIGINT or SIGTERM, then closes every connection.
+/// @param socket_path Path of the socket, replaced if it exists.
+/// @param max_backups Maximum number of backups allowed at once.
+/// @param num_workers Number of worker threads.
+/// @return 0 after a clean shutdown, 1 if the server could not start.
+int server_run(const char *socket_path, int max_backups, int num_workers);
+
+#endif  // KVS_SERVER_H
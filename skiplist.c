@@ -0,0 +1,106 @@
+#include "skiplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct SkipList {
+    SkipNode *head[SKIPLIST_MAX_HEIGHT];
+    unsigned int height;   // Levels in use
+    uint64_t random;       // xorshift64 state for node heights
+};
+
+SkipList *skiplist_create(void) {
+    SkipList *list = calloc(1, sizeof(SkipList));
+    if (list == NULL) return NULL;
+    list->height = 1;
+    list->random = 0x9E3779B97F4A7C15ULL;
+    return list;
+}
+
+// Each level has a quarter of the nodes of the one below it
+static unsigned int random_height(SkipList *list) {
+    uint64_t x = list->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    list->random = x;
+    unsigned int height = 1;
+    while (height < SKIPLIST_MAX_HEIGHT && (x & 3) == 0) {
+        height++;
+        x >>= 2;
+    }
+    return height;
+}
+
+// Fills prev with the last link before key on each level.
+// @return The node of the first key not smaller than key, NULL if none.
+static SkipNode *find(SkipList *list, const char *key, SkipNode **prev[SKIPLIST_MAX_HEIGHT]) {
+    SkipNode **links = list->head;
+    for (unsigned int level = list->height; level > 0; level--) {
+        while (links[level - 1] != NULL && strcmp(links[level - 1]->key, key) < 0) {
+            links = links[level - 1]->next;
+        }
+        prev[level - 1] = &links[level - 1];
+    }
+    return links[0];
+}
+
+int skiplist_insert(SkipList *list, const char *key, uint64_t h) {
+    SkipNode **prev[SKIPLIST_MAX_HEIGHT];
+    SkipNode *found = find(list, key, prev);
+    if (found != NULL && strcmp(found->key, key) == 0) return 0;
+
+    unsigned int height = random_height(list);
+    size_t key_len = strlen(key) + 1;
+    SkipNode *node = malloc(sizeof(SkipNode) + height * sizeof(SkipNode *) + key_len);
+    if (node == NULL) return 1;
+    char *key_copy = (char *)(node->next + height);
+    memcpy(key_copy, key, key_len);
+    node->key = key_copy;
+    node->hash = h;
+    node->height = height;
+
+    while (list->height < height) {
+        prev[list->height] = &list->head[list->height];
+        list->height++;
+    }
+    for (unsigned int level = 0; level < height; level++) {
+        node->next[level] = *prev[level];
+        *prev[level] = node;
+    }
+    return 0;
+}
+
+int skiplist_remove(SkipList *list, const char *key) {
+    SkipNode **prev[SKIPLIST_MAX_HEIGHT];
+    SkipNode *found = find(list, key, prev);
+    if (found == NULL || strcmp(found->key, key) != 0) return 1;
+
+    for (unsigned int level = 0; level < found->height; level++) {
+        *prev[level] = found->next[level];
+    }
+    while (list->height > 1 && list->head[list->height - 1] == NULL) list->height--;
+    free(found);
+    return 0;
+}
+
+const SkipNode *skiplist_seek(const SkipList *list, const char *key) {
+    if (key == NULL) return list->head[0];
+    SkipNode *const *links = list->head;
+    for (unsigned int level = list->height; level > 0; level--) {
+        while (links[level - 1] != NULL && strcmp(links[level - 1]->key, key) < 0) {
+            links = links[level - 1]->next;
+        }
+    }
+    return links[0];
+}
+
+void skiplist_destroy(SkipList *list) {
+    SkipNode *node = list->head[0];
+    while (node != NULL) {
+        SkipNode *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    free(list);
+}
@@ -0,0 +1,50 @@
+#ifndef KVS_SKIPLIST_H
+#define KVS_SKIPLIST_H
+
+#include <stdint.h>
+
+// Skip list of keys in strcmp order, the ordered index kept next to each
+// stripe of the table (see set_ordered_index in kvs.h). It holds no values
+// and has no lock of its own: the caller serializes changes and iterations,
+// which kvs.c does with the stripe lock.
+
+#define SKIPLIST_MAX_HEIGHT 16
+
+typedef struct SkipNode {
+    uint64_t hash;              // Hash of the key, so its value is found without rehashing
+    const char *key;            // Stored right after next[]
+    unsigned int height;
+    struct SkipNode *next[];    // next[0] is the following key
+} SkipNode;
+
+typedef struct SkipList SkipList;
+
+/// Creates an empty skip list.
+/// @return Newly created skip list, NULL on failure.
+SkipList *skiplist_create(void);
+
+/// Inserts a key, unless it is already in the list.
+/// @param list Skip list to modify.
+/// @param key Key to insert.
+/// @param h Hash of the key, kept in its node.
+/// @return 0 if the key is in the list, 1 if it could not be inserted.
+int skiplist_insert(SkipList *list, const char *key, uint64_t h);
+
+/// Removes a key.
+/// @param list Skip list to modify.
+/// @param key Key to remove.
+/// @return 0 if the key was removed, 1 if it was not found.
+int skiplist_remove(SkipList *list, const char *key);
+
+/// Finds the first key that is not smaller than a given one. The following
+/// keys are reached through next[0].
+/// @param list Skip list to search.
+/// @param key Key to seek to, NULL for the first key of the list.
+/// @return Node of that key, NULL if every key is smaller.
+const SkipNode *skiplist_seek(const SkipList *list, const char *key);
+
+/// Frees the skip list and all its nodes.
+/// @param list Skip list to free.
+void skiplist_destroy(SkipList *list);
+
+#endif  // KVS_SKIPLIST_H
@@ -0,0 +1,81 @@
+#include "slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Start of every chunk, so slab_free finds the slab of an object by masking
+// its address
+struct SlabChunk {
+    Slab *slab;
+    SlabChunk *next;
+    _Alignas(64) char objects[];  // Objects of a cache line size do not straddle two
+};
+
+typedef struct FreeObject {
+    struct FreeObject *next;
+} FreeObject;
+
+void slab_init(Slab *slab, size_t object_size) {
+    // Objects stay aligned for the pointers and integers they hold
+    slab->object_size = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    slab->free_list = NULL;
+    atomic_init(&slab->remote_free, NULL);
+    slab->chunks = NULL;
+    slab->next = NULL;
+    slab->end = NULL;
+    slab->num_chunks = 0;
+}
+
+static int add_chunk(Slab *slab) {
+    SlabChunk *chunk = aligned_alloc(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+    if (chunk == NULL) return 1;
+    chunk->slab = slab;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->next = chunk->objects;
+    slab->end = (char *)chunk + SLAB_CHUNK_SIZE;
+    slab->num_chunks++;
+    return 0;
+}
+
+void *slab_alloc(Slab *slab) {
+    if (slab->free_list == NULL) {
+        slab->free_list = atomic_exchange_explicit(&slab->remote_free, NULL, memory_order_acquire);
+    }
+    if (slab->free_list != NULL) {
+        FreeObject *object = slab->free_list;
+        slab->free_list = object->next;
+        return object;
+    }
+
+    if ((size_t)(slab->end - slab->next) < slab->object_size && add_chunk(slab) != 0) return NULL;
+    void *object = slab->next;
+    slab->next += slab->object_size;
+    return object;
+}
+
+void slab_free(void *ptr) {
+    SlabChunk *chunk = (SlabChunk *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+    Slab *slab = chunk->slab;
+    FreeObject *object = ptr;
+    void *head = atomic_load_explicit(&slab->remote_free, memory_order_relaxed);
+    do {
+        object->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slab->remote_free, &head, object,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+size_t slab_object_size(const void *ptr) {
+    const SlabChunk *chunk = (const SlabChunk *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+    return chunk->slab->object_size;
+}
+
+void slab_destroy(Slab *slab) {
+    SlabChunk *chunk = slab->chunks;
+    while (chunk != NULL) {
+        SlabChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab_init(slab, slab->object_size);
+}
@@ -0,0 +1,54 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Allocator of objects of one fixed size, carved out of SLAB_CHUNK_SIZE
+// chunks. Every stripe of the table has its own slabs, and only the thread
+// holding the stripe lock allocates from them, so slab_alloc takes no lock.
+// slab_free may run on any thread (memory retired through the epoch is
+// freed by whichever thread reclaims it): it pushes the object on an atomic
+// list that the next slab_alloc takes over. slab_destroy releases the chunks
+// as a whole, without visiting the objects.
+
+// Power of two, chunks are aligned to it. Chunks this large are mapped on
+// their own: smaller ones come from the heap, where the alignment wastes up
+// to a chunk between two of them and spreads a slab over twice the memory.
+#define SLAB_CHUNK_SIZE (256 * 1024)
+
+typedef struct SlabChunk SlabChunk;
+
+typedef struct Slab {
+    size_t object_size;
+    void *free_list;             // Freed objects, only used by the allocating thread
+    _Atomic(void *) remote_free; // Objects freed by slab_free, taken over by slab_alloc
+    SlabChunk *chunks;           // Every chunk of the slab
+    char *next;                  // Unused part of the newest chunk
+    char *end;
+    size_t num_chunks;
+} Slab;
+
+/// Prepares an empty slab. No memory is allocated until the first object.
+/// @param slab Slab to initialize.
+/// @param object_size Size of every object, at least sizeof(void *).
+void slab_init(Slab *slab, size_t object_size);
+
+/// Allocates an object. Calls on the same slab must not overlap.
+/// @param slab Slab to allocate from.
+/// @return Uninitialized object, NULL if out of memory.
+void *slab_alloc(Slab *slab);
+
+/// Gives an object back to the slab it came from. Safe on any thread.
+/// @param ptr Object returned by slab_alloc.
+void slab_free(void *ptr);
+
+/// Returns the usable size of an object, object_size rounded up.
+/// @param ptr Object returned by slab_alloc.
+size_t slab_object_size(const void *ptr);
+
+/// Releases every chunk of the slab, and so every object still allocated.
+/// @param slab Slab to destroy.
+void slab_destroy(Slab *slab);
+
+#endif  // KVS_SLAB_H
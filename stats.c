@@ -0,0 +1,218 @@
+#include "stats.h"
+
+#ifdef KVS_STATS
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Log-linear histogram in the style of HdrHistogram: values below
+// 2^STATS_SUB_BITS get a bucket each, every larger power of two is split
+// into 2^STATS_SUB_BITS buckets, so a bucket is within 1/16 of its values.
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1u << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// Counters of one thread. Only their thread writes them, with plain
+// load/store pairs; stats_dump reads them from another thread, so they are
+// atomics, but no increment is a locked read-modify-write.
+typedef struct ThreadStats {
+    struct ThreadStats *next;
+    _Atomic uint64_t latency[STATS_COMMANDS][STATS_BUCKETS];
+    _Atomic uint64_t latency_max[STATS_COMMANDS];
+    _Atomic uint64_t latency_sum[STATS_COMMANDS];
+    _Atomic uint64_t lock_waits;
+    _Atomic uint64_t lock_wait_ns;
+    _Atomic uint64_t lock_wait_max;
+    _Atomic uint64_t lookups;
+    _Atomic uint64_t walked;
+    _Atomic uint64_t walked_max;
+    _Atomic uint64_t parsed_bytes;
+} ThreadStats;
+
+static const char *const command_names[STATS_COMMANDS] = {"WRITE", "READ", "DELETE", "SHOW", "BACKUP"};
+
+// Blocks of every thread that recorded something. Blocks are never freed, so
+// the counts of threads that already exited stay in the totals.
+static _Atomic(ThreadStats *) all_stats = NULL;
+static _Thread_local ThreadStats *local_stats = NULL;
+
+static ThreadStats *get_stats(void) {
+    if (local_stats != NULL) return local_stats;
+    ThreadStats *stats = calloc(1, sizeof(ThreadStats));
+    if (stats == NULL) return NULL;
+    ThreadStats *head = atomic_load_explicit(&all_stats, memory_order_relaxed);
+    do {
+        stats->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&all_stats, &head, stats, memory_order_release,
+                                                    memory_order_relaxed));
+    local_stats = stats;
+    return stats;
+}
+
+static void add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void raise_max(_Atomic uint64_t *counter, uint64_t value) {
+    if (value > atomic_load_explicit(counter, memory_order_relaxed)) {
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+    }
+}
+
+static size_t bucket_of(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) return (size_t)value;
+    unsigned int shift = (unsigned int)(63 - __builtin_clzll(value)) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + (size_t)((value >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls in a bucket.
+static uint64_t bucket_max(size_t bucket) {
+    if (bucket < STATS_SUB_BUCKETS) return bucket;
+    unsigned int shift = (unsigned int)(bucket / STATS_SUB_BUCKETS) - 1;
+    uint64_t low = (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void stats_command(enum StatsCommand cmd, uint64_t start) {
+    ThreadStats *stats = get_stats();
+    if (stats == NULL) return;
+    uint64_t ns = stats_now() - start;
+    add(&stats->latency[cmd][bucket_of(ns)], 1);
+    add(&stats->latency_sum[cmd], ns);
+    raise_max(&stats->latency_max[cmd], ns);
+}
+
+void stats_lock_wait(uint64_t ns) {
+    ThreadStats *stats = get_stats();
+    if (stats == NULL) return;
+    add(&stats->lock_waits, 1);
+    add(&stats->lock_wait_ns, ns);
+    raise_max(&stats->lock_wait_max, ns);
+}
+
+void stats_lookup(size_t walked) {
+    ThreadStats *stats = get_stats();
+    if (stats == NULL) return;
+    add(&stats->lookups, 1);
+    add(&stats->walked, walked);
+    raise_max(&stats->walked_max, walked);
+}
+
+void stats_parsed(size_t bytes) {
+    ThreadStats *stats = get_stats();
+    if (stats == NULL) return;
+    add(&stats->parsed_bytes, bytes);
+}
+
+static uint64_t percentile(const uint64_t *histogram, uint64_t count, uint64_t max, unsigned int per_mille) {
+    uint64_t rank = (count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t value = bucket_max(b);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+static uint64_t load(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void stats_dump(FILE *stream) {
+    static uint64_t histogram[STATS_BUCKETS];
+    static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&dump_mutex);
+
+    ThreadStats *first = atomic_load_explicit(&all_stats, memory_order_acquire);
+    size_t threads = 0;
+    for (ThreadStats *stats = first; stats != NULL; stats = stats->next) threads++;
+    fprintf(stream, "{\"threads\": %zu, \"commands\": {", threads);
+    for (int cmd = 0; cmd < STATS_COMMANDS; cmd++) {
+        uint64_t count = 0, sum = 0, max = 0;
+        for (size_t b = 0; b < STATS_BUCKETS; b++) histogram[b] = 0;
+        for (ThreadStats *stats = first; stats != NULL; stats = stats->next) {
+            for (size_t b = 0; b < STATS_BUCKETS; b++) {
+                uint64_t n = load(&stats->latency[cmd][b]);
+                histogram[b] += n;
+                count += n;
+            }
+            sum += load(&stats->latency_sum[cmd]);
+            if (load(&stats->latency_max[cmd]) > max) max = load(&stats->latency_max[cmd]);
+        }
+        fprintf(stream,
+                "%s\n  \"%s\": {\"count\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+                cmd > 0 ? "," : "", command_names[cmd], (unsigned long long)count,
+                (unsigned long long)(count > 0 ? sum / count : 0),
+                (unsigned long long)percentile(histogram, count, max, 500),
+                (unsigned long long)percentile(histogram, count, max, 900),
+                (unsigned long long)percentile(histogram, count, max, 990),
+                (unsigned long long)percentile(histogram, count, max, 999), (unsigned long long)max);
+    }
+
+    uint64_t lock_waits = 0, lock_wait_ns = 0, lock_wait_max = 0;
+    uint64_t lookups = 0, walked = 0, walked_max = 0, parsed_bytes = 0;
+    for (ThreadStats *stats = first; stats != NULL; stats = stats->next) {
+        lock_waits += load(&stats->lock_waits);
+        lock_wait_ns += load(&stats->lock_wait_ns);
+        if (load(&stats->lock_wait_max) > lock_wait_max) lock_wait_max = load(&stats->lock_wait_max);
+        lookups += load(&stats->lookups);
+        walked += load(&stats->walked);
+        if (load(&stats->walked_max) > walked_max) walked_max = load(&stats->walked_max);
+        parsed_bytes += load(&stats->parsed_bytes);
+    }
+    fprintf(stream, "},\n \"lock_wait\": {\"contended\": %llu, \"total_ns\": %llu, \"max_ns\": %llu},\n",
+            (unsigned long long)lock_waits, (unsigned long long)lock_wait_ns, (unsigned long long)lock_wait_max);
+    fprintf(stream, " \"lookups\": {\"count\": %llu, \"walked\": %llu, \"max_walked\": %llu},\n",
+            (unsigned long long)lookups, (unsigned long long)walked, (unsigned long long)walked_max);
+    fprintf(stream, " \"parsed_bytes\": %llu}\n", (unsigned long long)parsed_bytes);
+    fflush(stream);
+
+    pthread_mutex_unlock(&dump_mutex);
+}
+
+// Dumps on SIGUSR1. The signal is blocked everywhere and taken here with
+// sigwait, so the dump runs as a normal thread and not in a signal handler.
+static void *dump_thread(void *arg) {
+    FILE *stream = arg;
+    sigset_t set;
+    // No other signal is taken here, they stay with the threads that wait for them
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) == 0) stats_dump(stream);
+    }
+    return NULL;
+}
+
+int stats_init(FILE *stream) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) return 1;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&thread, &attr, dump_thread, stream) != 0;
+    pthread_attr_destroy(&attr);
+    return result;
+}
+
+#endif  // KVS_STATS
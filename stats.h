@@ -0,0 +1,64 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Runtime statistics: a latency histogram per command type, the time spent
+// waiting for the stripe locks, the entries walked per lookup and the bytes
+// read by the parser. Every thread counts into its own block, so recording
+// takes no lock and shares no cache line; stats_dump adds the blocks up.
+//
+// Only built with -DKVS_STATS (make STATS=1). Without it every function
+// below is an empty inline and the instrumented code compiles as if the
+// calls were not there.
+
+enum StatsCommand { STATS_WRITE, STATS_READ, STATS_DELETE, STATS_SHOW, STATS_BACKUP, STATS_COMMANDS };
+
+#ifdef KVS_STATS
+
+/// Blocks SIGUSR1 in the calling thread and starts a thread that dumps the
+/// statistics to the stream on every SIGUSR1. Must be called before any other
+/// thread is created, so that they all inherit the blocked signal.
+/// @param stream Where the dumps go.
+/// @return 0 on success, 1 otherwise.
+int stats_init(FILE *stream);
+
+/// Writes the statistics gathered so far by every thread as one JSON object.
+/// @param stream Stream to write to.
+void stats_dump(FILE *stream);
+
+/// @return Current time in nanoseconds, to pass to stats_command.
+uint64_t stats_now(void);
+
+/// Records the latency of a command.
+/// @param cmd Type of the command.
+/// @param start Value of stats_now when it started.
+void stats_command(enum StatsCommand cmd, uint64_t start);
+
+/// Records the time a thread waited for a contended lock.
+/// @param ns Nanoseconds waited.
+void stats_lock_wait(uint64_t ns);
+
+/// Records the entries a lookup visited.
+/// @param walked Chain nodes or probe groups visited.
+void stats_lookup(size_t walked);
+
+/// Records bytes read by the parser.
+/// @param bytes Number of bytes.
+void stats_parsed(size_t bytes);
+
+#else
+
+static inline int stats_init(FILE *stream) { (void)stream; return 0; }
+static inline void stats_dump(FILE *stream) { (void)stream; }
+static inline uint64_t stats_now(void) { return 0; }
+static inline void stats_command(enum StatsCommand cmd, uint64_t start) { (void)cmd; (void)start; }
+static inline void stats_lock_wait(uint64_t ns) { (void)ns; }
+static inline void stats_lookup(size_t walked) { (void)walked; }
+static inline void stats_parsed(size_t bytes) { (void)bytes; }
+
+#endif  // KVS_STATS
+
+#endif  // KVS_STATS_H
@@ -0,0 +1,426 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+
+#define WAL_FRAME_HEADER 12  // u32 payload_len, u64 checksum
+#define WAL_HEADER 24        // magic, u64 base, u64 checksum
+#define WAL_MAGIC "KVSWAL\0\0"
+#define WAL_COPY_CHUNK (64 * 1024)
+
+struct Wal {
+    int fd;
+    char *path;
+    pthread_mutex_t checkpoint;  // Serializes wal_checkpoint
+    pthread_t flusher;
+    pthread_mutex_t mutex;
+    pthread_cond_t appended;  // Wakes the flusher
+    pthread_cond_t synced;    // Wakes the committers
+    unsigned char *buffer;    // Frames appended but not written yet
+    size_t len;
+    size_t capacity;
+    unsigned char *spare;     // Buffer written by the flusher, swapped with buffer
+    size_t spare_capacity;
+    uint64_t end;             // Position after the last appended frame
+    uint64_t durable;         // Position up to which the log is synced
+    uint64_t syncs;
+    uint64_t base;            // Position of the first frame in the file
+    size_t header_len;        // 0 for a log written before the header existed
+    unsigned int window_us;
+    int failed;
+    int writing;              // The flusher is writing a batch
+    int paused;               // Set by wal_checkpoint while it swaps the file
+    int stop;
+};
+
+// Last frame appended by this thread, what wal_commit waits for
+static _Thread_local Wal *last_wal = NULL;
+static _Thread_local uint64_t last_append = 0;
+
+static int write_all(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+static void *flusher_thread(void *arg) {
+    Wal *wal = arg;
+    pthread_mutex_lock(&wal->mutex);
+    while (1) {
+        while ((wal->len == 0 && !wal->stop) || wal->paused) {
+            pthread_cond_wait(&wal->appended, &wal->mutex);
+        }
+        if (wal->len == 0) break;
+        wal->writing = 1;
+
+        if (wal->window_us > 0 && !wal->stop) {
+            // Give other threads the window to join this sync
+            struct timespec window = {wal->window_us / 1000000, (long)(wal->window_us % 1000000) * 1000};
+            pthread_mutex_unlock(&wal->mutex);
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(&wal->mutex);
+        }
+
+        unsigned char *data = wal->buffer;
+        size_t len = wal->len;
+        uint64_t target = wal->end;
+        wal->buffer = wal->spare;
+        wal->spare = data;
+        size_t capacity = wal->capacity;
+        wal->capacity = wal->spare_capacity;
+        wal->spare_capacity = capacity;
+        wal->len = 0;
+        pthread_mutex_unlock(&wal->mutex);
+
+        int failed = write_all(wal->fd, data, len) || fdatasync(wal->fd) != 0;
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->failed |= failed;
+        wal->durable = target;
+        wal->syncs++;
+        wal->writing = 0;
+        pthread_cond_broadcast(&wal->synced);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+void wal_append(Wal *wal, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+    size_t payload_len = 1;
+    for (size_t i = 0; i < num_pairs; i++) {
+        payload_len += 1 + strnlen(keys[i], MAX_STRING_SIZE - 1);
+        if (values != NULL) payload_len += 1 + strnlen(values[i], MAX_STRING_SIZE - 1);
+    }
+    size_t frame_len = WAL_FRAME_HEADER + payload_len;
+
+    pthread_mutex_lock(&wal->mutex);
+    if (wal->len + frame_len > wal->capacity) {
+        size_t capacity = (wal->len + frame_len) * 2;
+        unsigned char *buffer = realloc(wal->buffer, capacity);
+        if (buffer == NULL) {
+            wal->failed = 1;
+            pthread_mutex_unlock(&wal->mutex);
+            return;
+        }
+        wal->buffer = buffer;
+        wal->capacity = capacity;
+    }
+
+    unsigned char *frame = wal->buffer + wal->len;
+    unsigned char *p = frame + WAL_FRAME_HEADER;
+    *p++ = values != NULL ? 'W' : 'D';
+    for (size_t i = 0; i < num_pairs; i++) {
+        size_t len = strnlen(keys[i], MAX_STRING_SIZE - 1);
+        *p++ = (unsigned char)len;
+        memcpy(p, keys[i], len);
+        p += len;
+        if (values != NULL) {
+            len = strnlen(values[i], MAX_STRING_SIZE - 1);
+            *p++ = (unsigned char)len;
+            memcpy(p, values[i], len);
+            p += len;
+        }
+    }
+    uint32_t len32 = (uint32_t)payload_len;
+    uint64_t sum = backup_checksum(frame + WAL_FRAME_HEADER, payload_len);
+    memcpy(frame, &len32, 4);
+    memcpy(frame + 4, &sum, 8);
+
+    wal->len += frame_len;
+    wal->end += frame_len;
+    last_wal = wal;
+    last_append = wal->end;
+    pthread_cond_signal(&wal->appended);
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+int wal_commit(Wal *wal) {
+    if (last_wal != wal) return 0;
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->durable < last_append) {
+        pthread_cond_wait(&wal->synced, &wal->mutex);
+    }
+    int failed = wal->failed;
+    pthread_mutex_unlock(&wal->mutex);
+    return failed;
+}
+
+uint64_t wal_position(Wal *wal) {
+    pthread_mutex_lock(&wal->mutex);
+    uint64_t end = wal->end;
+    pthread_mutex_unlock(&wal->mutex);
+    return end;
+}
+
+uint64_t wal_syncs(Wal *wal) {
+    pthread_mutex_lock(&wal->mutex);
+    uint64_t syncs = wal->syncs;
+    pthread_mutex_unlock(&wal->mutex);
+    return syncs;
+}
+
+// Checks a frame and, if ht is not NULL, applies it to the table.
+// @return 0 if the frame is valid, 1 otherwise.
+static int replay_frame(const unsigned char *payload, size_t payload_len, HashTable *ht) {
+    if (payload_len < 1 || (payload[0] != 'W' && payload[0] != 'D')) return 1;
+    int is_write = payload[0] == 'W';
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char results[MAX_WRITE_SIZE];
+    size_t n = 0;
+
+    size_t pos = 1;
+    while (pos < payload_len) {
+        size_t key_len = payload[pos++];
+        if (key_len >= MAX_STRING_SIZE || payload_len - pos < key_len) return 1;
+        memcpy(keys[n], payload + pos, key_len);
+        keys[n][key_len] = '\0';
+        pos += key_len;
+        if (is_write) {
+            if (pos == payload_len) return 1;
+            size_t value_len = payload[pos++];
+            if (value_len >= MAX_STRING_SIZE || payload_len - pos < value_len) return 1;
+            memcpy(values[n], payload + pos, value_len);
+            values[n][value_len] = '\0';
+            pos += value_len;
+        }
+        // Frames of more than MAX_WRITE_SIZE pairs are applied in parts
+        if (++n == MAX_WRITE_SIZE || pos == payload_len) {
+            if (ht != NULL && is_write) write_pairs(ht, n, keys, values, results);
+            if (ht != NULL && !is_write) delete_pairs(ht, n, keys, results);
+            n = 0;
+        }
+    }
+    return 0;
+}
+
+// Replays the frames of a log that start at or after from.
+// @param start File offset of the first frame, whose position is base.
+// @param end Set to the file offset after the last valid frame.
+// @return 0 on success, 1 if the log could not be read.
+static int replay(int fd, size_t size, size_t start, uint64_t base, HashTable *ht, uint64_t from, size_t *end) {
+    *end = start;
+    if (size <= start) return 0;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 1;
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    const unsigned char *data = map;
+    size_t pos = start;
+    while (size - pos >= WAL_FRAME_HEADER) {
+        uint32_t payload_len;
+        uint64_t sum;
+        memcpy(&payload_len, data + pos, 4);
+        memcpy(&sum, data + pos + 4, 8);
+        const unsigned char *payload = data + pos + WAL_FRAME_HEADER;
+        if (size - pos - WAL_FRAME_HEADER < payload_len) break;
+        if (backup_checksum(payload, payload_len) != sum) break;
+        // Checked before it is applied, a frame is replayed whole or not at all
+        if (replay_frame(payload, payload_len, NULL) != 0) break;
+        if (base + (pos - start) >= from) replay_frame(payload, payload_len, ht);
+        pos += WAL_FRAME_HEADER + payload_len;
+    }
+    munmap(map, size);
+    *end = pos;
+    return 0;
+}
+
+static int write_header(int fd, uint64_t base) {
+    unsigned char header[WAL_HEADER];
+    memcpy(header, WAL_MAGIC, 8);
+    memcpy(header + 8, &base, 8);
+    uint64_t sum = backup_checksum(header, 16);
+    memcpy(header + 16, &sum, 8);
+    return write_all(fd, header, WAL_HEADER);
+}
+
+// Reads the header of a log.
+// @return 1 if the file starts with a valid header, 0 otherwise.
+static int read_header(int fd, size_t size, uint64_t *base) {
+    unsigned char header[WAL_HEADER];
+    if (size < WAL_HEADER || pread(fd, header, WAL_HEADER, 0) != WAL_HEADER) return 0;
+    uint64_t sum;
+    memcpy(&sum, header + 16, 8);
+    if (memcmp(header, WAL_MAGIC, 8) != 0 || backup_checksum(header, 16) != sum) return 0;
+    memcpy(base, header + 8, 8);
+    return 1;
+}
+
+// Appends the bytes of src between two file offsets to dst.
+// @return 0 on success, 1 if reading or writing failed.
+static int copy_range(int src, uint64_t from, uint64_t to, int dst) {
+    unsigned char buffer[WAL_COPY_CHUNK];
+    while (from < to) {
+        size_t len = to - from < WAL_COPY_CHUNK ? (size_t)(to - from) : WAL_COPY_CHUNK;
+        ssize_t n = pread(src, buffer, len, (off_t)from);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(dst, buffer, (size_t)n) != 0) return 1;
+        from += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Makes a rename in the directory of path durable.
+// @return 0 on success, 1 otherwise.
+static int sync_dir(const char *path) {
+    char *dir = strdup(path);
+    if (dir == NULL) return 1;
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL) *(slash == dir ? slash + 1 : slash) = '\0';  // Keeps "/" for the root
+    int fd = open(slash != NULL ? dir : ".", O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) return 1;
+    int failed = fsync(fd) != 0;
+    close(fd);
+    return failed;
+}
+
+Wal *wal_open(const char *path, HashTable *ht, uint64_t from, unsigned int window_us) {
+    Wal *wal = calloc(1, sizeof(Wal));
+    if (wal == NULL) return NULL;
+    wal->path = strdup(path);
+    wal->fd = open(path, O_RDWR | O_CREAT, 0666);
+    struct stat st;
+    if (wal->path == NULL || wal->fd < 0 || fstat(wal->fd, &st) < 0) {
+        if (wal->fd >= 0) close(wal->fd);
+        free(wal->path);
+        free(wal);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (read_header(wal->fd, size, &wal->base)) wal->header_len = WAL_HEADER;
+    // Whatever follows the last valid frame is a torn append, cut it off
+    size_t end;
+    int failed = replay(wal->fd, size, wal->header_len, wal->base, ht, from, &end) != 0 ||
+                 (end < size && ftruncate(wal->fd, (off_t)end) != 0);
+    if (!failed && end == 0) {
+        // A new log starts where the restored backup left off
+        wal->base = from;
+        wal->header_len = WAL_HEADER;
+        end = WAL_HEADER;
+        failed = write_header(wal->fd, from) != 0 || fdatasync(wal->fd) != 0;
+    }
+    // The frames between the restored backup and the start of the log are gone
+    if (failed || from < wal->base || lseek(wal->fd, (off_t)end, SEEK_SET) < 0) {
+        close(wal->fd);
+        free(wal->path);
+        free(wal);
+        return NULL;
+    }
+
+    wal->end = wal->base + (end - wal->header_len);
+    wal->durable = wal->end;
+    wal->window_us = window_us;
+    pthread_mutex_init(&wal->checkpoint, NULL);
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->appended, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    if (pthread_create(&wal->flusher, NULL, flusher_thread, wal) != 0) {
+        pthread_mutex_destroy(&wal->checkpoint);
+        pthread_mutex_destroy(&wal->mutex);
+        pthread_cond_destroy(&wal->appended);
+        pthread_cond_destroy(&wal->synced);
+        close(wal->fd);
+        free(wal->path);
+        free(wal);
+        return NULL;
+    }
+    return wal;
+}
+
+int wal_checkpoint(Wal *wal, uint64_t position) {
+    pthread_mutex_lock(&wal->checkpoint);
+    pthread_mutex_lock(&wal->mutex);
+    uint64_t base = wal->base;
+    uint64_t durable = wal->durable;
+    size_t header_len = wal->header_len;
+    pthread_mutex_unlock(&wal->mutex);
+    // Only the frames already in the file can be dropped
+    if (position > durable) position = durable;
+    if (position <= base) {
+        pthread_mutex_unlock(&wal->checkpoint);
+        return 0;
+    }
+
+    size_t path_len = strlen(wal->path);
+    char *tmp = malloc(path_len + 5);
+    if (tmp == NULL) {
+        pthread_mutex_unlock(&wal->checkpoint);
+        return 1;
+    }
+    memcpy(tmp, wal->path, path_len);
+    memcpy(tmp + path_len, ".new", 5);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    // The frames synced so far are copied while appends go on
+    int failed = fd < 0 || write_header(fd, position) != 0 ||
+                 copy_range(wal->fd, position - base + header_len, durable - base + header_len, fd) != 0;
+
+    // The rest is copied with the flusher paused, so that no batch is lost
+    pthread_mutex_lock(&wal->mutex);
+    wal->paused = 1;
+    while (wal->writing) {
+        pthread_cond_wait(&wal->synced, &wal->mutex);
+    }
+    uint64_t end = wal->durable;
+    pthread_mutex_unlock(&wal->mutex);
+    failed = failed || copy_range(wal->fd, durable - base + header_len, end - base + header_len, fd) != 0 ||
+             fdatasync(fd) != 0;
+    int renamed = !failed && rename(tmp, wal->path) == 0;
+    failed = !renamed || sync_dir(wal->path) != 0;
+
+    pthread_mutex_lock(&wal->mutex);
+    if (renamed) {
+        close(wal->fd);
+        wal->fd = fd;
+        wal->base = position;
+        wal->header_len = WAL_HEADER;
+    }
+    wal->paused = 0;
+    pthread_cond_signal(&wal->appended);
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (!renamed && fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    free(tmp);
+    pthread_mutex_unlock(&wal->checkpoint);
+    return failed;
+}
+
+void wal_close(Wal *wal) {
+    pthread_mutex_lock(&wal->mutex);
+    wal->stop = 1;
+    pthread_cond_signal(&wal->appended);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->flusher, NULL);
+
+    pthread_mutex_destroy(&wal->checkpoint);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->appended);
+    pthread_cond_destroy(&wal->synced);
+    close(wal->fd);
+    free(wal->path);
+    free(wal->buffer);
+    free(wal->spare);
+    free(wal);
+}
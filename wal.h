@@ -0,0 +1,78 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+#include "kvs.h"
+
+// Append-only write-ahead log with group commit.
+// The file starts with a header, then each WRITE or DELETE is appended as
+// one frame:
+//
+//   header   magic "KVSWAL\0\0", u64 base, u64 checksum (of the bytes before it)
+//   frame    u32 payload_len, u64 checksum of the payload (FNV-1a), payload
+//   payload  u8 op ('W' or 'D'), then per pair u8 key_len, key and,
+//            for 'W', u8 value_len, value
+//
+// Integers are in host byte order; the log is not meant to move between
+// machines. Appends only copy the frame to memory. A flusher thread writes
+// what was appended and makes it durable with a single fdatasync, so the
+// commits of every thread that appended in the meantime share that sync.
+//
+// Positions count the bytes of every frame ever appended; base is the
+// position of the first frame still in the file. A log without a header,
+// from before it existed, has base 0. wal_checkpoint drops the frames that
+// a durable full backup already holds, so the log only grows with the
+// changes since the last one. From then on the log can only be replayed on
+// top of that backup or a later one.
+typedef struct Wal Wal;
+
+/// Opens or creates a log and replays it into the table from a position.
+/// A torn or corrupt frame at the end of the log, left by a crash, is cut
+/// off; appends go after the last valid frame. A new log starts at from.
+/// @param path Path of the log file.
+/// @param ht Hash table the frames are replayed into.
+/// @param from Position to replay from, e.g. that of a restored snapshot.
+/// @param window_us Time the flusher waits for more commits before each sync, in microseconds.
+/// @return Newly opened log, NULL on failure or if from is before the base
+///         of the log, whose frames from there were dropped by a checkpoint.
+Wal *wal_open(const char *path, HashTable *ht, uint64_t from, unsigned int window_us);
+
+/// Appends a frame. Does not wait for it to be durable, see wal_commit.
+/// @param wal Log to append to.
+/// @param num_pairs Number of pairs of the change.
+/// @param keys Keys of the change.
+/// @param values Values of a write, NULL for a delete.
+void wal_append(Wal *wal, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+
+/// Waits until every frame appended by the calling thread is durable.
+/// @param wal Log to wait on.
+/// @return 0 on success, 1 if writing or syncing the log failed.
+int wal_commit(Wal *wal);
+
+/// Returns the position after the last appended frame.
+/// @param wal Log to query.
+uint64_t wal_position(Wal *wal);
+
+/// Returns how many times the log was synced since it was opened.
+/// @param wal Log to query.
+uint64_t wal_syncs(Wal *wal);
+
+/// Drops the frames before a position. The frames from there on are copied
+/// to a new file, which replaces the log once it is durable. Appends go on
+/// meanwhile; only the flusher waits while the files are swapped. The
+/// position should be that of a full backup, see snapshot_log_position,
+/// made durable before the call.
+/// @param wal Log to checkpoint.
+/// @param position Position of the first frame to keep. Frames not yet
+///        synced are always kept.
+/// @return 0 on success, 1 if writing the new file or syncing its
+///         directory failed.
+int wal_checkpoint(Wal *wal, uint64_t position);
+
+/// Makes every appended frame durable, stops the flusher and closes the log.
+/// @param wal Log to close.
+void wal_close(Wal *wal);
+
+#endif  // KVS_WAL_H
@@ -0,0 +1,59 @@
+#include "wire.h"
+
+#include <string.h>
+
+void wire_put_header(char *buf, const WireHeader *header) {
+    wire_put_u32(buf, header->length);
+    buf[4] = (char)header->opcode;
+    buf[5] = (char)header->flags;
+    wire_put_u16(buf + 6, header->count);
+}
+
+void wire_get_header(const char *buf, WireHeader *header) {
+    header->length = wire_get_u32(buf);
+    header->opcode = (uint8_t)buf[4];
+    header->flags = (uint8_t)buf[5];
+    header->count = wire_get_u16(buf + 6);
+}
+
+// Copies the string at *pos into str, advancing *pos past it.
+static int get_string(const char *payload, size_t length, size_t *pos, char *str) {
+    if (*pos >= length) return 1;
+    size_t len = (uint8_t)payload[*pos];
+    if (len >= MAX_STRING_SIZE || length - *pos - 1 < len) return 1;
+    memcpy(str, payload + *pos + 1, len);
+    str[len] = '\0';
+    *pos += 1 + len;
+    return 0;
+}
+
+int wire_decode_request(const WireHeader *header, const char *payload, char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]) {
+    size_t pos = 0;
+    for (size_t i = 0; i < header->count; i++) {
+        if (get_string(payload, header->length, &pos, keys[i])) return 1;
+        if (header->opcode == WIRE_WRITE && get_string(payload, header->length, &pos, values[i])) return 1;
+    }
+    return pos != header->length;
+}
+
+static size_t put_string(char *buf, size_t size, size_t pos, const char *str) {
+    size_t len = strlen(str);
+    if (len >= MAX_STRING_SIZE || size - pos < len + 1) return 0;
+    buf[pos] = (char)len;
+    memcpy(buf + pos + 1, str, len);
+    return pos + 1 + len;
+}
+
+size_t wire_encode_request(char *buf, size_t size, enum WireOpcode opcode, size_t count, const char *const keys[],
+                           const char *const values[]) {
+    if (size < WIRE_HEADER_SIZE || count > UINT16_MAX) return 0;
+    size_t pos = WIRE_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        if ((pos = put_string(buf, size, pos, keys[i])) == 0) return 0;
+        if (values != NULL && (pos = put_string(buf, size, pos, values[i])) == 0) return 0;
+    }
+    WireHeader header = {(uint32_t)(pos - WIRE_HEADER_SIZE), (uint8_t)opcode, 0, (uint16_t)count};
+    wire_put_header(buf, &header);
+    return pos;
+}
@@ -0,0 +1,127 @@
+#ifndef KVS_WIRE_H
+#define KVS_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Binary encoding of the commands of the server mode (see server.h), for
+// clients that do not want the server to parse text. A connection switches
+// to it by sending WIRE_MAGIC as its first byte; no text command starts
+// with it.
+//
+// Requests and responses are frames: an 8 byte header followed by length
+// bytes of payload. Integers are little endian. Strings are one length byte
+// followed by the bytes, without terminator, shorter than MAX_STRING_SIZE.
+//
+//   header    u32 length, u8 opcode, u8 flags, u16 count
+//
+//   request   payload
+//   WRITE     count pairs: key, value
+//   READ      count keys
+//   DELETE    count keys
+//   SHOW      -
+//   BACKUP    -
+//   SUBSCRIBE count keys
+//   UNSUBSCRIBE count keys
+//   BATCH     count request frames, each with its header; not nested
+//
+//   response  payload
+//   WRITE     -
+//   READ      count values in the order of the keys; a missing key has
+//             length WIRE_MISSING and no bytes
+//   DELETE    count bytes, 1 for every key that did not exist
+//   SHOW      count pairs: key, value. WIRE_MORE is set on every frame but
+//             the last one of the reply.
+//   BACKUP    -
+//   SUBSCRIBE, UNSUBSCRIBE -
+//
+// A NOTIFY frame, with count 1 and the key and its new value as payload,
+// reports a change of a subscribed key; a deleted key has a value of length
+// WIRE_MISSING. It may come between any two responses.
+//
+// Every request but BATCH gets one response, in order; a BATCH gets the
+// responses of its requests. WIRE_ERR is set on the response of a request
+// that failed or could not be decoded, with count 0. A client may send many
+// frames without waiting for their responses.
+
+#define WIRE_MAGIC 0xB7
+#define WIRE_HEADER_SIZE 8
+#define WIRE_MISSING 0xFF
+
+enum WireOpcode {
+    WIRE_WRITE = 1,
+    WIRE_READ = 2,
+    WIRE_DELETE = 3,
+    WIRE_SHOW = 4,
+    WIRE_BACKUP = 5,
+    WIRE_BATCH = 6,
+    WIRE_SUBSCRIBE = 7,
+    WIRE_UNSUBSCRIBE = 8,
+    WIRE_NOTIFY = 9,  // Sent by the server only
+};
+
+enum WireFlags {
+    WIRE_ERR = 1,   // Response of a request that failed
+    WIRE_MORE = 2,  // More frames follow with the same response
+};
+
+typedef struct WireHeader {
+    uint32_t length;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t count;
+} WireHeader;
+
+static inline void wire_put_u16(char *buf, uint16_t value) {
+    buf[0] = (char)(value & 0xFF);
+    buf[1] = (char)(value >> 8);
+}
+
+static inline void wire_put_u32(char *buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) buf[i] = (char)((value >> (8 * i)) & 0xFF);
+}
+
+static inline uint16_t wire_get_u16(const char *buf) {
+    return (uint16_t)((uint8_t)buf[0] | (uint16_t)((uint8_t)buf[1] << 8));
+}
+
+static inline uint32_t wire_get_u32(const char *buf) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)(uint8_t)buf[i] << (8 * i);
+    return value;
+}
+
+/// Writes a frame header.
+/// @param buf Where the WIRE_HEADER_SIZE bytes go.
+/// @param header Header to encode.
+void wire_put_header(char *buf, const WireHeader *header);
+
+/// Reads a frame header.
+/// @param buf The WIRE_HEADER_SIZE bytes of the header.
+/// @param header Decoded header.
+void wire_get_header(const char *buf, WireHeader *header);
+
+/// Decodes the keys, and the values of a WRITE, of a request payload into
+/// NUL-terminated strings.
+/// @param header Header of the request, with an opcode that carries keys.
+/// @param payload The header->length bytes after the header.
+/// @param keys Where the keys go, at least header->count of them.
+/// @param values Where the values of a WRITE go, at least header->count of them.
+/// @return 0 on success, 1 if the payload does not match the header.
+int wire_decode_request(const WireHeader *header, const char *payload, char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]);
+
+/// Encodes a request frame.
+/// @param buf Where the frame goes.
+/// @param size Size of buf.
+/// @param opcode Opcode of the request, not WIRE_BATCH.
+/// @param count Number of keys.
+/// @param keys Keys of the request.
+/// @param values Values of a WRITE, NULL otherwise.
+/// @return Length of the frame, 0 if it does not fit in buf or a string is too long.
+size_t wire_encode_request(char *buf, size_t size, enum WireOpcode opcode, size_t count, const char *const keys[],
+                           const char *const values[]);
+
+#endif  // KVS_WIRE_H